@@ -0,0 +1,175 @@
+// Throughput of the lexer, the parser and the interpreter on generated
+// recipes that stress each of them. Every case runs in a process of its own
+// and prints one JSON object per line, so results can be diffed or graphed.
+//
+//     $ ./build.sh bench && ./mako-bench [scale]
+#define MAKO_NO_MAIN
+#include "../src/main.c"
+
+typedef struct {
+    char* bytes;
+    size_t size, capacity;
+} BenchBuffer;
+
+void bench_printf(BenchBuffer* b, char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (b->size + n + 1 > b->capacity) {
+        b->capacity = (b->size + n + 1) * 2;
+        b->bytes = realloc(b->bytes, b->capacity);
+        if (b->bytes == NULL) error("out of memory");
+    }
+    va_start(args, fmt);
+    vsnprintf(b->bytes + b->size, n + 1, fmt, args);
+    va_end(args);
+    b->size += n;
+}
+
+// Thousands of macros, each called from the top level
+void bench_macros(BenchBuffer* b, size_t scale) {
+    for (size_t i = 0; i < 5000 * scale; i++) bench_printf(b, "macro m%zu { \"a\" \"b\" swap drop drop }\n", i);
+    for (size_t i = 0; i < 5000 * scale; i++) bench_printf(b, "m%zu\n", i);
+}
+
+// Ifs nested almost as deep as the parser allows
+void bench_nesting(BenchBuffer* b, size_t scale) {
+    for (size_t n = 0; n < 200 * scale; n++) {
+        for (size_t i = 0; i < 95; i++) bench_printf(b, "true if { ");
+        bench_printf(b, "1 2 + drop");
+        for (size_t i = 0; i < 95; i++) bench_printf(b, " }");
+        bench_printf(b, "\n");
+    }
+}
+
+// A long running loop, mostly dispatch and arithmetic
+void bench_loop(BenchBuffer* b, size_t scale) {
+    bench_printf(b, "0 while dup %zu < {\n    1 + dup 2 * drop\n} drop\n", 1000000 * scale);
+}
+
+// Few tokens, but each of them is long
+void bench_strings(BenchBuffer* b, size_t scale) {
+    for (size_t n = 0; n < 64 * scale; n++) {
+        bench_printf(b, "\"");
+        for (size_t i = 0; i < 16384; i++) bench_printf(b, "0123456789abcdef");
+        bench_printf(b, "\" drop\n");
+    }
+}
+
+// A directory listing pushing tens of thousands of items
+void bench_listdir(BenchBuffer* b, size_t scale) {
+    mkdir("listdir", 0755);
+    for (size_t i = 0; i < 20000 * scale; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "listdir/file%zu.c", i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0) close(fd);
+    }
+    bench_printf(b, "\"listdir\" listdir while dup 0 > { 1 - swap drop } drop\n");
+    bench_printf(b, "\"listdir/*.c\" fnmatch while dup 0 > { 1 - swap drop } drop\n");
+}
+
+typedef struct {
+    char* name;
+    void (*generate)(BenchBuffer* b, size_t scale);
+} BenchCase;
+
+BenchCase bench_cases[] = {
+    { "macros", bench_macros },
+    { "nesting", bench_nesting },
+    { "loop", bench_loop },
+    { "strings", bench_strings },
+    { "listdir", bench_listdir },
+};
+
+double bench_ms(uint64_t start) {
+    return (profile_now() - start) / 1e6;
+}
+
+double bench_rate(size_t count, double ms) {
+    return ms > 0 ? count / (ms / 1e3) : 0;
+}
+
+void bench_run(BenchCase c, size_t scale) {
+    BenchBuffer b = {0};
+    c.generate(&b, scale);
+    String content = sv_from_bytes(b.bytes, b.size);
+    jobs_init(1);
+
+    uint64_t start = profile_now();
+    Lexer lexer = lexer_new(sv(c.name), content);
+    TokenArray* tokens = lexer_tokenize(&lexer);
+    double lex_ms = bench_ms(start);
+
+    start = profile_now();
+    lexer_crossreference(tokens);
+    double crossreference_ms = bench_ms(start);
+
+    start = profile_now();
+    Bytecode* bytecode = parse_bytecode(tokens);
+    double parse_ms = bench_ms(start);
+
+    // What the recipe prints isn't part of the results
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    dup2(null, STDOUT_FILENO);
+
+    start = profile_now();
+    Program program = interpret_compile(bytecode);
+    verify_program(&program);
+    interpret_program(&program, StringArray_new(&arena));
+    double interpret_ms = bench_ms(start);
+
+    // Run again to count executed operations, which slows dispatch down
+    profile_ops = calloc(COUNT_OPS, sizeof(size_t));
+    if (profile_ops == NULL) error("out of memory");
+    interpret_program(&program, StringArray_new(&arena));
+    size_t executed = 0;
+    for (size_t i = 0; i < COUNT_OPS; i++) executed += profile_ops[i];
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null);
+
+    printf("{\"case\":\"%s\",\"scale\":%zu,\"bytes\":%zu,\"tokens\":%zu,\"ops\":%zu,\"executed\":%zu,"
+           "\"lex_ms\":%.3f,\"crossreference_ms\":%.3f,\"parse_ms\":%.3f,\"interpret_ms\":%.3f,"
+           "\"lex_bytes_per_s\":%.0f,\"tokens_per_s\":%.0f,\"ops_per_s\":%.0f,\"executed_per_s\":%.0f",
+           c.name, scale, b.size, tokens->size, bytecode->size, executed,
+           lex_ms, crossreference_ms, parse_ms, interpret_ms,
+           bench_rate(b.size, lex_ms), bench_rate(tokens->size, lex_ms), bench_rate(bytecode->size, parse_ms), bench_rate(executed, interpret_ms));
+    fflush(stdout);
+    free(b.bytes);
+}
+
+int main(int argc, char** argv) {
+    size_t scale = argc > 1 ? (size_t) atoi(argv[1]) : 1;
+    if (scale == 0) error("expected a positive scale");
+
+    char dir[] = "/tmp/mako-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) error("could not create a directory: %s", strerror(errno));
+    if (chdir(dir) < 0) error("could not enter `%s`: %s", dir, strerror(errno));
+
+    for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) error("could not fork: %s", strerror(errno));
+        if (pid == 0) {
+            bench_run(bench_cases[i], scale);
+            exit(0);
+        }
+        // Peak memory is that of the child, which ran nothing else
+        int status;
+        struct rusage usage;
+        if (wait4(pid, &status, 0, &usage) < 0) error("could not wait for a child process: %s", strerror(errno));
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) error("case `%s` failed", bench_cases[i].name);
+        printf(",\"peak_rss_kb\":%ld}\n", usage.ru_maxrss);
+    }
+
+    char cmd[sizeof(dir) + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0) fprintf(stderr, "WARNING: could not remove `%s`\n", dir);
+    return 0;
+}
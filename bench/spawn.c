@@ -0,0 +1,76 @@
+// Launch overhead of the old `run` path (fork + execvp, searching PATH each
+// time) against the current one (posix_spawn of a path resolved once). The
+// parent touches some memory first, as fork gets slower the bigger it is.
+//
+//     $ cc -O2 -o spawn bench/spawn.c && ./spawn [launches] [megabytes]
+#define _GNU_SOURCE
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void wait_for(pid_t pid) {
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "child failed\n");
+        exit(1);
+    }
+}
+
+void launch_fork(char** argv) {
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); exit(1); }
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    wait_for(pid);
+}
+
+void launch_spawn(char* path, char** argv) {
+    pid_t pid;
+    if (posix_spawn(&pid, path, NULL, NULL, argv, environ) != 0) { perror("posix_spawn"); exit(1); }
+    wait_for(pid);
+}
+
+int main(int argc, char** argv) {
+    int launches = argc > 1 ? atoi(argv[1]) : 2000;
+    size_t megabytes = argc > 2 ? (size_t) atoi(argv[2]) : 256;
+
+    char* heap = malloc(megabytes << 20);
+    if (heap == NULL) { perror("malloc"); return 1; }
+    memset(heap, 1, megabytes << 20);
+
+    char* args[] = { "true", NULL };
+    char* path = NULL;
+    char* dirs = strdup(getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+    for (char* dir = strtok(dirs, ":"); dir != NULL && path == NULL; dir = strtok(NULL, ":")) {
+        char candidate[4096];
+        snprintf(candidate, sizeof(candidate), "%s/true", dir);
+        if (access(candidate, X_OK) == 0) path = strdup(candidate);
+    }
+    if (path == NULL) { fprintf(stderr, "`true` is not in PATH\n"); return 1; }
+
+    double start = now();
+    for (int i = 0; i < launches; i++) launch_fork(args);
+    double forked = now() - start;
+
+    start = now();
+    for (int i = 0; i < launches; i++) launch_spawn(path, args);
+    double spawned = now() - start;
+
+    printf("%d launches, %zu MiB resident\n", launches, megabytes);
+    printf("fork + execvp: %8.1f us per launch\n", forked / launches * 1e6);
+    printf("posix_spawn:   %8.1f us per launch\n", spawned / launches * 1e6);
+    free(heap);
+    return 0;
+}
@@ -7,11 +7,17 @@ macro cflags {
     "-Wall" "-Wextra" "-Werror" "-pedantic"
     "-L./strap" "-I./strap/src"
 }
-macro libs { "-lstrap" }
+macro libs { "-lstrap" "-pthread" }
 
 # ! is a separate token, but can be right in front of other tokens
 "strap/libstrap.a" fileexists! if {
     cmd "/bin/sh" "strap/build.sh" run
 }
 
-cmd cc cflags "-o" "mako" "src/main.c" libs run
+# the first target is built unless others are named, e.g. `./mako bench`
+target mako {
+    cmd cc cflags "-o" "mako" "src/main.c" libs run
+}
+target bench {
+    cmd cc cflags "-O2" "-o" "mako-bench" "bench/bench.c" libs run
+}
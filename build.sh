@@ -8,6 +8,11 @@ fi
 
 CC=gcc
 CFLAGS="-Wall -Wextra -Werror -std=gnu99 -pedantic -L./strap/ -I./strap/src/"
-LIBS="-lstrap"
+LIBS="-lstrap -pthread"
+
+if test "$1" = "bench"; then
+    $CC $CFLAGS -O2 -o mako-bench bench/bench.c $LIBS
+    exit
+fi
 
 $CC $CFLAGS -o mako src/main.c $LIBS
@@ -0,0 +1,165 @@
+// Parsed bytecode of each file of a recipe is saved next to the output cache,
+// so that a file which didn't change since the last run doesn't have to be
+// lexed and parsed again; files are put together afresh every time, see
+// `module_link`. The file is a header, an array of fixed-size op records and a
+// string pool; loaded ops point right into the mapped pool.
+#define BCCACHE_MAGIC "MAKOBC05"
+
+typedef struct {
+    char magic[8];
+    uint64_t build; // of mako that parsed it, see `bccache_build_hash`
+    uint64_t source; // hash of the recipe it was parsed from
+    uint64_t ops, pool_size;
+} BcCacheHeader;
+
+typedef struct {
+    uint32_t type;
+    int32_t value;
+    uint64_t location;
+    uint32_t operand, operand_size; // offsets into the pool
+    uint32_t filename, filename_size;
+    uint32_t offset; // into the recipe, lines are found from it when needed
+} BcCacheOp;
+
+bool bccache_enabled = true;
+
+Hash bccache_build = 0;
+pthread_once_t bccache_build_once = PTHREAD_ONCE_INIT;
+
+void bccache_hash_build(void) {
+    int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* binary = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (binary != MAP_FAILED) {
+            uint64_t layout[3] = { sizeof(BcCacheHeader), sizeof(BcCacheOp), COUNT_MODULE_OPS };
+            Hash hash = hash_bytes(hash_string(HASH_SEED, sv(BCCACHE_MAGIC)), layout, sizeof(layout));
+            bccache_build = hash_bytes(hash, binary, st.st_size);
+            munmap(binary, st.st_size);
+        }
+    }
+    close(fd);
+}
+
+// Hash of our own binary, worked out once: any change to mako, to what ops
+// mean included, makes bytecode parsed by other builds stale. 0 if the
+// binary can't be read, and then nothing is cached.
+Hash bccache_build_hash(void) {
+    pthread_once(&bccache_build_once, bccache_hash_build);
+    return bccache_build;
+}
+
+void bccache_path(String filename, char path[PATH_MAX]) {
+    char hex[HASH_HEX_SIZE + 1];
+    hash_hex(hash_string(HASH_SEED, filename), hex);
+    snprintf(path, PATH_MAX, CACHE_DIR"/bytecode-%s", hex);
+}
+
+// Jumps and calls may go to the end of the file, but no further
+bool bccache_location_valid(BcCacheOp record, uint64_t ops) {
+    switch (record.type) {
+    case OP_JUMP: case OP_JUMPZ: case OP_JUMPNZ: case OP_TARGET: case OP_CALL:
+        return record.location <= ops;
+    case OP_MACRO:
+        return record.location <= ops && record.value >= 0 && record.location + record.value <= ops;
+    default:
+        return true;
+    }
+}
+
+Bytecode* bccache_load(String filename, String content) {
+    if (!bccache_enabled || bccache_build_hash() == 0) return NULL;
+    char path[PATH_MAX];
+    bccache_path(filename, path);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(BcCacheHeader)) { close(fd); return NULL; }
+    char* file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return NULL;
+
+    BcCacheHeader header;
+    memcpy(&header, file, sizeof(header));
+    bool valid = memcmp(header.magic, BCCACHE_MAGIC, 8) == 0
+        && header.build == bccache_build_hash()
+        && header.source == hash_string(HASH_SEED, content)
+        && sizeof(header) + header.ops * sizeof(BcCacheOp) + header.pool_size == (size_t) st.st_size;
+    if (!valid) { munmap(file, st.st_size); return NULL; }
+    lexer_add_source(filename, content);
+
+    // The mapping is kept for the rest of the run: strings live in it
+    BcCacheOp* records = (BcCacheOp*) (file + sizeof(header));
+    char* pool = file + sizeof(header) + header.ops * sizeof(BcCacheOp);
+    Bytecode* bc = Bytecode_new(&arena);
+    for (size_t i = 0; i < header.ops; i++) {
+        BcCacheOp record = records[i];
+        if ((uint64_t) record.operand + record.operand_size > header.pool_size
+            || (uint64_t) record.filename + record.filename_size > header.pool_size
+            || record.type >= COUNT_MODULE_OPS
+            || !bccache_location_valid(record, header.ops)) { munmap(file, st.st_size); return NULL; }
+        Bytecode_push(bc, (Operation) {
+            .type = record.type,
+            .operand = sv_from_bytes(pool + record.operand, record.operand_size),
+            .location = record.location,
+            .value = record.value,
+            .loc = { sv_from_bytes(pool + record.filename, record.filename_size), record.offset },
+        });
+    }
+    return bc;
+}
+
+void bccache_pool_push(StringBuilder* pool, String string) {
+    for (size_t i = 0; i < string.size; i++) StringBuilder_push(pool, sv_index(string, i));
+}
+
+void bccache_save(String filename, String content, Bytecode* bc) {
+    if (!bccache_enabled || bccache_build_hash() == 0) return;
+    char path[PATH_MAX], tmp[PATH_MAX + 32];
+    bccache_path(filename, path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int) getpid());
+
+    StringBuilder* pool = StringBuilder_new(&arena);
+    BcCacheOp* records = malloc(sizeof(BcCacheOp) * (bc->size + 1));
+    if (records == NULL) error("out of memory");
+    String last_filename = {0};
+    uint32_t last_filename_offset = 0;
+    array_foreach(bc, i) {
+        Operation op = Bytecode_get(bc, i);
+        BcCacheOp record = {
+            .type = op.type, .value = op.value, .location = op.location,
+            .operand = pool->size, .operand_size = op.operand.size,
+            .offset = op.loc.offset,
+        };
+        bccache_pool_push(pool, op.operand);
+        // Every op of a file shares the same filename, keep just one copy
+        if (op.loc.filename.bytes != last_filename.bytes || op.loc.filename.size != last_filename.size) {
+            last_filename = op.loc.filename;
+            last_filename_offset = pool->size;
+            bccache_pool_push(pool, op.loc.filename);
+        }
+        record.filename = last_filename_offset;
+        record.filename_size = last_filename.size;
+        records[i] = record;
+    }
+
+    BcCacheHeader header = {
+        .build = bccache_build_hash(),
+        .source = hash_string(HASH_SEED, content),
+        .ops = bc->size,
+        .pool_size = pool->size,
+    };
+    memcpy(header.magic, BCCACHE_MAGIC, 8);
+
+    mkdir(CACHE_DIR, 0755);
+    FILE* file = fopen(tmp, "wb");
+    if (file == NULL) { free(records); return; }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(records, sizeof(BcCacheOp), bc->size, file) == bc->size
+        && fwrite(sv_from_sb(pool).bytes, 1, pool->size, file) == pool->size;
+    if (fclose(file) != 0) ok = false;
+    if (!ok || rename(tmp, path) < 0) unlink(tmp);
+    free(records);
+}
@@ -0,0 +1,105 @@
+#define CACHE_KEY_SIZE HASH_HEX_SIZE
+
+bool cache_enabled = true;
+
+// A command is identified by its exact command line, the directory it runs in
+// and the content of every declared input and recorded dependency. Returns
+// false if one can't be read, in which case the command is just run.
+bool cache_key(Command command, String cmd, StringArray* deps, char key[CACHE_KEY_SIZE + 1]) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) return false;
+
+    Hash hash = hash_string(HASH_SEED, sv(cwd));
+    hash = hash_string(hash, cmd);
+    array_foreach(command.inputs, i) {
+        String input = StringArray_get(command.inputs, i);
+        Hash content;
+        if (!fs_hash_file(HASH_SEED, input, &content)) return false;
+        hash = hash_string(hash, input);
+        hash = hash_bytes(hash, &content, sizeof(content));
+    }
+    if (deps != NULL) array_foreach(deps, i) {
+        String dep = StringArray_get(deps, i);
+        Hash content;
+        if (!fs_hash_file(HASH_SEED, dep, &content)) return false;
+        hash = hash_string(hash, dep);
+        hash = hash_bytes(hash, &content, sizeof(content));
+    }
+    hash_hex(hash, key);
+    return true;
+}
+
+String cache_entry_path(char* dir, size_t index, Arena* a) {
+    StringBuilder* sb = StringBuilder_new(a);
+    char name[32];
+    snprintf(name, sizeof(name), "/%zu", index);
+    for (char* c = dir; *c; c++) StringBuilder_push(sb, *c);
+    for (char* c = name; *c; c++) StringBuilder_push(sb, *c);
+    return sv_from_sb(sb);
+}
+
+// Puts cached outputs of a command in place; false on a miss
+bool cache_restore(Command command, char key[CACHE_KEY_SIZE + 1]) {
+    if (command.outputs->size == 0) return false;
+    char dir[sizeof(CACHE_DIR) + CACHE_KEY_SIZE + 1];
+    snprintf(dir, sizeof(dir), CACHE_DIR"/%s", key);
+
+    array_foreach(command.outputs, i) {
+        if (!fs_stat(cache_entry_path(dir, i, command.arena)).exists) return false;
+    }
+    array_foreach(command.outputs, i) {
+        if (!fs_copy_file(cache_entry_path(dir, i, command.arena), StringArray_get(command.outputs, i))) return false;
+    }
+    return true;
+}
+
+void cache_store(Command command, char key[CACHE_KEY_SIZE + 1]) {
+    if (command.outputs->size == 0) return;
+    char dir[sizeof(CACHE_DIR) + CACHE_KEY_SIZE + 1], tmp[sizeof(dir) + 32];
+    snprintf(dir, sizeof(dir), CACHE_DIR"/%s", key);
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", dir, (int) getpid());
+
+    mkdir(CACHE_DIR, 0755);
+    if (mkdir(tmp, 0755) < 0) return;
+
+    // The entry only becomes visible once it's complete
+    size_t copied = 0;
+    while (copied < command.outputs->size && fs_copy_file(StringArray_get(command.outputs, copied), cache_entry_path(tmp, copied, command.arena))) copied++;
+    if (copied == command.outputs->size && rename(tmp, dir) == 0) {
+        fs_invalidate(sv(dir));
+        return;
+    }
+
+    char cpath[PATH_MAX];
+    for (size_t i = 0; i < copied; i++) unlink(fs_cpath(cache_entry_path(tmp, i, command.arena), cpath));
+    rmdir(tmp);
+}
+
+// Output of a `memo` command is remembered by the key of `cache_key` and the
+// whole environment, in whatever order it comes. False if an input can't be
+// read, in which case the command is just run.
+bool cache_capture_path(Command command, String cmd, char path[PATH_MAX]) {
+    char key[CACHE_KEY_SIZE + 1];
+    if (!cache_key(command, cmd, NULL, key)) return false;
+    Hash env = 0;
+    for (char** var = environ; *var != NULL; var++) env += hash_string(HASH_SEED, sv(*var));
+
+    Hash hash = hash_string(HASH_SEED, sv(key));
+    hash = hash_bytes(hash, &env, sizeof(env));
+    hash_hex(hash, key);
+    snprintf(path, PATH_MAX, CACHE_DIR"/capture-%s", key);
+    return true;
+}
+
+bool cache_capture_load(Command command, String cmd, String* output, Arena* a) {
+    char path[PATH_MAX];
+    return cache_capture_path(command, cmd, path) && fs_read_file(sv(path), output, a);
+}
+
+void cache_capture_store(Command command, String cmd, String output) {
+    char path[PATH_MAX];
+    if (!cache_capture_path(command, cmd, path)) return;
+    mkdir(CACHE_DIR, 0755);
+    bool changed;
+    fs_write_if_changed(sv(path), output, &changed);
+}
@@ -0,0 +1,23 @@
+// What a command marker on the stack is, kept in its `number`
+typedef enum {
+    COMMAND_CMD = 0,
+    COMMAND_MEMO,
+    COMMAND_REMOTE,
+} CommandKind;
+
+typedef struct {
+    String program;
+    StringArray* arguments;
+    StringArray* inputs; // declared with `input`, also present in `arguments`
+    StringArray* outputs; // declared with `output`, also present in `arguments`
+    String depfile; // declared with `depfile`, empty if none
+    bool memo; // started with `memo` rather than `cmd`
+    bool remote; // started with `remote`, so it may run on a worker, see remote.c
+    String macro; // the innermost macro the command comes from, empty if none
+    Location loc;
+    Arena* arena; // of the argument arrays and everything made for the command, freed once it's done
+} Command;
+
+String command_render(Command command) {
+    return sv_from_sb(shell_render_command(command.arena, command.program, command.arguments));
+}
@@ -0,0 +1,667 @@
+// `--daemon`: a server that keeps parsed and checked recipes in memory. A
+// plain `mako` connects to it when it's running, and hands over its arguments,
+// directory, environment, and stdin, stdout and stderr themselves. The run
+// happens in a child of the daemon that inherits everything it has loaded and
+// writes straight to the caller's terminal, and the caller exits with its
+// exit code. Without a daemon, mako runs by itself as usual.
+#define DAEMON_MAX_REQUEST (16*1024*1024)
+#define DAEMON_REQUEST_MS 2000 // for a caller to send its whole request
+#define DAEMON_ALIVE_MS 1000 // between checks that the daemon is still there
+
+// In main.c
+Bytecode* load_bytecode(String filename, Flags* flags);
+Program load_program(Bytecode* bytecode);
+int mako(String filename, Flags* flags);
+
+// A recipe is reused as long as its files look the same as when it was
+// loaded. It's kept under the name it was run by, which its locations are
+// reported by.
+typedef struct {
+    String path; // absolute
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} DaemonFile;
+
+array_define(DaemonFileArray, DaemonFile)
+array_implement(DaemonFileArray, DaemonFile)
+
+typedef struct {
+    String path; // absolute
+    String name;
+    bool optimize;
+    DaemonFileArray* files; // the recipe and the files it includes
+    Program program;
+} DaemonRecipe;
+
+array_define(DaemonRecipeArray, DaemonRecipe)
+array_implement(DaemonRecipeArray, DaemonRecipe)
+
+typedef struct {
+    pid_t pid;
+    int connection; // to the caller, which gets the exit code
+    int report; // the worker tells which recipe it loaded; EOF once it's gone
+    char recipe[2*PATH_MAX + 2];
+    size_t recipe_size;
+    bool killed;
+} DaemonWorker;
+
+array_define(DaemonWorkerArray, DaemonWorker)
+array_implement(DaemonWorkerArray, DaemonWorker)
+
+// Accepted, but its request isn't there yet; it's waited for along with
+// everything else, and dropped once it's late
+typedef struct {
+    int connection;
+    uint64_t deadline;
+} DaemonCaller;
+
+array_define(DaemonCallerArray, DaemonCaller)
+array_implement(DaemonCallerArray, DaemonCaller)
+
+// A child loading a recipe for the daemon to keep, see `daemon_keep`
+typedef struct {
+    pid_t pid;
+    int fd; // what it loaded comes through it; -1 once it did
+    char* received;
+    size_t size, capacity;
+    DaemonRecipe recipe; // all but the files and the program, until received
+} DaemonKeeper;
+
+array_define(DaemonKeeperArray, DaemonKeeper)
+array_implement(DaemonKeeperArray, DaemonKeeper)
+
+DaemonRecipeArray* daemon_recipes = NULL;
+DaemonWorkerArray* daemon_workers = NULL;
+DaemonCallerArray* daemon_callers = NULL;
+DaemonKeeperArray* daemon_keepers = NULL;
+int daemon_listener = -1;
+int daemon_report = -1; // in a worker
+
+// Per user and per build of mako, as requests are in-memory state of a build.
+// It's in a directory nobody else can get into, as callers hand over their
+// environment and terminal: $XDG_RUNTIME_DIR, or one of our own in /tmp.
+// False if there's no such directory, or the path is too long.
+bool daemon_address(struct sockaddr_un* addr) {
+    char dir[PATH_MAX];
+    const char* runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime != NULL && runtime[0] != 0) snprintf(dir, sizeof(dir), "%s", runtime);
+    else {
+        snprintf(dir, sizeof(dir), "/tmp/mako-%d", (int) getuid());
+        mkdir(dir, 0700);
+    }
+    struct stat st;
+    if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) return false;
+    char hex[HASH_HEX_SIZE + 1];
+    hash_hex(bccache_build_hash(), hex);
+    *addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+    int n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/mako-%d-%.8s.sock", dir, (int) getuid(), hex);
+    return n > 0 && (size_t) n < sizeof(addr->sun_path);
+}
+
+bool daemon_write_all(int fd, const char* bytes, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, bytes, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+void daemon_push_string(StringBuilder* sb, const char* string) {
+    for (const char* c = string; *c; c++) StringBuilder_push(sb, *c);
+    StringBuilder_push(sb, 0);
+}
+
+// Reads all of it, but gives up at `deadline`, so a caller that stalls halfway
+// through its request can't hold up everyone else for long
+bool daemon_read_until(int fd, char* bytes, size_t size, uint64_t deadline) {
+    while (size > 0) {
+        uint64_t now = profile_now();
+        if (now >= deadline) return false;
+        struct pollfd p = { .fd = fd, .events = POLLIN };
+        int ready = poll(&p, 1, (deadline - now) / 1000000 + 1);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return false;
+        ssize_t n = read(fd, bytes, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Runs the call in the daemon, if there's one; false if there isn't, and
+// nothing was run
+bool daemon_forward(int argc, char** argv, int* status) {
+    struct sockaddr_un addr;
+    if (!daemon_address(&addr)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) { close(fd); return false; }
+    // Only a daemon of our own gets the request
+    struct ucred cred;
+    socklen_t size = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) < 0 || cred.uid != getuid()) { close(fd); return false; }
+
+    // A request is its size, the number of arguments and of environment
+    // variables, then all of them and the current directory, each ending in
+    // a NUL. Our stdin, stdout and stderr come along with the size.
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) { close(fd); return false; }
+    uint32_t envc = 0;
+    while (environ[envc] != NULL) envc++;
+    StringBuilder* sb = StringBuilder_new(&arena);
+    for (int i = 0; i < argc; i++) daemon_push_string(sb, argv[i]);
+    daemon_push_string(sb, cwd);
+    for (uint32_t i = 0; i < envc; i++) daemon_push_string(sb, environ[i]);
+    String body = sv_from_sb(sb);
+    uint32_t header[3] = { body.size, argc, envc };
+
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = { .iov_base = header, .iov_len = sizeof(header) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t sent;
+    while ((sent = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+    if (sent != (ssize_t) sizeof(header) || !daemon_write_all(fd, body.bytes, body.size)) { close(fd); return false; }
+
+    // The run takes as long as it takes, but not longer than the daemon is
+    // around for
+    int32_t code;
+    for (;;) {
+        struct pollfd p = { .fd = fd, .events = POLLIN };
+        int ready = poll(&p, 1, DAEMON_ALIVE_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) error("could not poll: %s", strerror(errno));
+        if (ready > 0) {
+            uint64_t deadline = profile_now() + DAEMON_ALIVE_MS * 1000000ull;
+            if (!daemon_read_until(fd, (char*) &code, sizeof(code), deadline)) error("the daemon went away before the run was over");
+            break;
+        }
+        if (kill(cred.pid, 0) < 0 && errno == ESRCH) error("the daemon went away before the run was over");
+    }
+    close(fd);
+    *status = code;
+    return true;
+}
+
+// The recipe this worker loaded parsed and checked fine, so the daemon may
+// keep it for the next time. It's told the directory, the name and whether
+// the recipe was optimized.
+void daemon_loaded(String filename, Flags* flags) {
+    if (daemon_report < 0) return;
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) return;
+    StringBuilder* sb = StringBuilder_new(&arena);
+    daemon_push_string(sb, cwd);
+    for (size_t i = 0; i < filename.size; i++) StringBuilder_push(sb, sv_index(filename, i));
+    StringBuilder_push(sb, 0);
+    StringBuilder_push(sb, flags->optimize ? '1' : '0');
+    String report = sv_from_sb(sb);
+    // Left open: it's closed when the worker exits, which is how the daemon
+    // knows it's done
+    daemon_write_all(daemon_report, report.bytes, report.size);
+}
+
+bool daemon_fresh(DaemonRecipe recipe) {
+    array_foreach(recipe.files, i) {
+        DaemonFile file = DaemonFileArray_get(recipe.files, i);
+        struct stat st;
+        char cpath[PATH_MAX];
+        if (stat(fs_cpath(file.path, cpath), &st) < 0) return false;
+        if (file.dev != st.st_dev || file.ino != st.st_ino || file.size != st.st_size || fs_mtime_compare(file.mtime, st.st_mtim) != 0) return false;
+    }
+    return true;
+}
+
+// The index of a recipe the daemon has loaded, or -1
+ssize_t daemon_lookup(String resolved, String name, bool optimize) {
+    array_foreach(daemon_recipes, i) {
+        DaemonRecipe recipe = DaemonRecipeArray_get(daemon_recipes, i);
+        if (sv_compare(recipe.path, resolved) && sv_compare(recipe.name, name) && recipe.optimize == optimize) return i;
+    }
+    return -1;
+}
+
+// A recipe the daemon had loaded before this worker was started
+bool daemon_find(String filename, Flags* flags, Program* program) {
+    if (daemon_recipes == NULL) return false;
+    char cpath[PATH_MAX], resolved[PATH_MAX];
+    if (realpath(fs_cpath(filename, cpath), resolved) == NULL) return false;
+    ssize_t index = daemon_lookup(sv(resolved), filename, flags->optimize);
+    if (index < 0 || !daemon_fresh(DaemonRecipeArray_get(daemon_recipes, index))) return false;
+    *program = DaemonRecipeArray_get(daemon_recipes, index).program;
+    return true;
+}
+
+// From the directory the recipe was run in; false if a file of it changed
+// while it was being loaded
+bool daemon_load(String path, String name, bool optimize, DaemonRecipe* recipe) {
+    Flags flags = { .optimize = optimize, .daemon = true };
+    *recipe = (DaemonRecipe) {
+        .path = path, .name = name, .optimize = optimize,
+        .files = DaemonFileArray_new(&arena),
+        .program = load_program(load_bytecode(name, &flags)),
+    };
+    // A file looks like what was loaded from it if it still holds the same
+    // once it's been looked at; a change after that shows in how it looks
+    bool same = true;
+    Arena* scratch = scratch_begin();
+    array_foreach(modules, i) {
+        Module module = ModuleArray_get(modules, i);
+        struct stat st;
+        char cpath[PATH_MAX], resolved[PATH_MAX];
+        String content;
+        if (realpath(fs_cpath(module.filename, cpath), resolved) == NULL || stat(resolved, &st) < 0) { same = false; break; }
+        if (!fs_read_file(module.filename, &content, scratch) || !sv_compare(content, module.content)) { same = false; break; }
+        DaemonFileArray_push(recipe->files, (DaemonFile) {
+            .path = scratch_keep(sv(resolved)),
+            .dev = st.st_dev, .ino = st.st_ino, .size = st.st_size, .mtime = st.st_mtim,
+        });
+    }
+    scratch_end(scratch);
+    return same;
+}
+
+// A loaded recipe goes from a child to the daemon as it is in memory, in the
+// layout of this very build: sizes are followed by that many bytes, and the
+// strings of the program point into what was received
+void daemon_push_bytes(StringBuilder* sb, const void* bytes, size_t size) {
+    for (size_t i = 0; i < size; i++) StringBuilder_push(sb, ((const char*) bytes)[i]);
+}
+
+void daemon_push_sized(StringBuilder* sb, String string) {
+    uint64_t size = string.size;
+    daemon_push_bytes(sb, &size, sizeof(size));
+    daemon_push_bytes(sb, string.bytes, string.size);
+}
+
+String daemon_recipe_encode(DaemonRecipe recipe) {
+    StringBuilder* sb = StringBuilder_new(&arena);
+    uint64_t counts[3] = { recipe.files->size, modules->size, recipe.program.size };
+    daemon_push_bytes(sb, counts, sizeof(counts));
+    array_foreach(recipe.files, i) {
+        DaemonFile file = DaemonFileArray_get(recipe.files, i);
+        daemon_push_bytes(sb, &file, sizeof(file));
+        daemon_push_sized(sb, file.path);
+    }
+    array_foreach(modules, i) {
+        Module module = ModuleArray_get(modules, i);
+        daemon_push_sized(sb, module.filename);
+        daemon_push_sized(sb, module.content);
+    }
+    daemon_push_bytes(sb, recipe.program.code, sizeof(Instruction) * recipe.program.size);
+    for (size_t i = 0; i < recipe.program.size; i++) {
+        daemon_push_sized(sb, recipe.program.operands[i]);
+        daemon_push_sized(sb, recipe.program.locs[i].filename);
+        daemon_push_bytes(sb, &recipe.program.locs[i].offset, sizeof(size_t));
+    }
+    return sv_from_sb(sb);
+}
+
+typedef struct {
+    char* bytes;
+    size_t size, at;
+    bool ok; // false once something didn't fit
+} DaemonReader;
+
+void* daemon_take(DaemonReader* r, size_t size) {
+    if (!r->ok || size > r->size - r->at) { r->ok = false; return NULL; }
+    r->at += size;
+    return r->bytes + r->at - size;
+}
+
+String daemon_take_sized(DaemonReader* r) {
+    uint64_t size;
+    char* at = daemon_take(r, sizeof(size));
+    if (at == NULL) return (String) {0};
+    memcpy(&size, at, sizeof(size));
+    at = daemon_take(r, size);
+    return at == NULL ? (String) {0} : sv_from_bytes(at, size);
+}
+
+// Takes over `bytes`, which are freed if they don't hold a whole recipe
+bool daemon_recipe_decode(char* bytes, size_t size, DaemonRecipe* recipe) {
+    DaemonReader r = { .bytes = bytes, .size = size, .ok = true };
+    uint64_t counts[3] = {0};
+    char* at = daemon_take(&r, sizeof(counts));
+    if (at != NULL) memcpy(counts, at, sizeof(counts));
+    if (counts[2] > size / sizeof(Instruction)) r.ok = false;
+    recipe->files = DaemonFileArray_new(&arena);
+    for (uint64_t i = 0; r.ok && i < counts[0]; i++) {
+        DaemonFile file;
+        at = daemon_take(&r, sizeof(file));
+        if (at != NULL) memcpy(&file, at, sizeof(file));
+        file.path = daemon_take_sized(&r);
+        if (r.ok) DaemonFileArray_push(recipe->files, file);
+    }
+    size_t sources = r.at;
+    for (uint64_t i = 0; r.ok && i < counts[1] * 2; i++) daemon_take_sized(&r);
+    Program p = { .size = counts[2] };
+    at = daemon_take(&r, sizeof(Instruction) * p.size);
+    p.code = malloc(sizeof(Instruction) * (p.size + 1));
+    p.operands = malloc(sizeof(String) * (p.size + 1));
+    p.locs = malloc(sizeof(Location) * (p.size + 1));
+    if (p.code == NULL || p.operands == NULL || p.locs == NULL) error("out of memory");
+    if (at != NULL) memcpy(p.code, at, sizeof(Instruction) * p.size);
+    for (size_t i = 0; r.ok && i < p.size; i++) {
+        p.operands[i] = daemon_take_sized(&r);
+        p.locs[i].filename = daemon_take_sized(&r);
+        at = daemon_take(&r, sizeof(size_t));
+        if (at != NULL) memcpy(&p.locs[i].offset, at, sizeof(size_t));
+    }
+    if (!r.ok || r.at != r.size) {
+        free(p.code);
+        free(p.operands);
+        free(p.locs);
+        free(bytes);
+        return false;
+    }
+
+    // Strings pushed by the program are ids into the table of this process
+    for (size_t i = 0; i < p.size; i++) {
+        if (p.code[i].type == OP_PUSH_STRING) p.code[i].value = interpret_add_string(p.operands[i]);
+    }
+    r.at = sources;
+    for (uint64_t i = 0; i < counts[1]; i++) {
+        String filename = daemon_take_sized(&r);
+        lexer_add_source(filename, daemon_take_sized(&r));
+    }
+    recipe->program = p;
+    return true;
+}
+
+// What children of the daemon don't need of it
+void daemon_close_all(void) {
+    close(daemon_listener);
+    array_foreach(daemon_workers, i) {
+        close(DaemonWorkerArray_get(daemon_workers, i).connection);
+        close(DaemonWorkerArray_get(daemon_workers, i).report);
+    }
+    array_foreach(daemon_callers, i) close(DaemonCallerArray_get(daemon_callers, i).connection);
+    array_foreach(daemon_keepers, i) {
+        DaemonKeeper keeper = DaemonKeeperArray_get(daemon_keepers, i);
+        if (keeper.fd >= 0) close(keeper.fd);
+    }
+}
+
+// Loads a recipe a worker reported. The daemon never loads a recipe itself:
+// a child does, in the directory it was run in, and sends back what it
+// loaded, see `daemon_kept`. So a recipe that changed into something broken
+// meanwhile can't take the daemon down, and a big one doesn't hold up
+// everyone else.
+void daemon_keep(DaemonWorker worker) {
+    char* cwd = worker.recipe;
+    char* end = memchr(cwd, 0, worker.recipe_size);
+    if (end == NULL || worker.recipe_size < (size_t) (end - cwd) + 3) return;
+    char* name = end + 1;
+    bool optimize = worker.recipe[worker.recipe_size-1] == '1';
+    worker.recipe[worker.recipe_size-2] = 0;
+
+    char joined[sizeof(worker.recipe) + 1], resolved[PATH_MAX];
+    if (name[0] == '/') snprintf(joined, sizeof(joined), "%s", name);
+    else snprintf(joined, sizeof(joined), "%s/%s", cwd, name);
+    if (realpath(joined, resolved) == NULL) return;
+    ssize_t index = daemon_lookup(sv(resolved), sv(name), optimize);
+    if (index >= 0 && daemon_fresh(DaemonRecipeArray_get(daemon_recipes, index))) return;
+    array_foreach(daemon_keepers, i) {
+        DaemonRecipe loading = DaemonKeeperArray_get(daemon_keepers, i).recipe;
+        if (sv_compare(loading.path, sv(resolved)) && sv_compare(loading.name, sv(name)) && loading.optimize == optimize) return;
+    }
+    DaemonKeeper keeper = { .recipe = { .path = scratch_keep(sv(resolved)), .name = scratch_keep(sv(name)), .optimize = optimize } };
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) return;
+    fflush(NULL);
+    keeper.pid = fork();
+    if (keeper.pid < 0) error("could not fork: %s", strerror(errno));
+    if (keeper.pid == 0) {
+        daemon_close_all();
+        close(pipefd[0]);
+        DaemonRecipe loaded;
+        if (chdir(cwd) < 0 || !daemon_load(keeper.recipe.path, keeper.recipe.name, optimize, &loaded)) exit(1);
+        String encoded = daemon_recipe_encode(loaded);
+        exit(daemon_write_all(pipefd[1], encoded.bytes, encoded.size) ? 0 : 1);
+    }
+    close(pipefd[1]);
+    keeper.fd = pipefd[0];
+    DaemonKeeperArray_push(daemon_keepers, keeper);
+}
+
+// Takes what a keeper sent, and closes its end once everything is in
+void daemon_keeper_read(DaemonKeeper* keeper) {
+    if (keeper->size == keeper->capacity) {
+        keeper->capacity = keeper->capacity == 0 ? 65536 : keeper->capacity * 2;
+        keeper->received = realloc(keeper->received, keeper->capacity);
+        if (keeper->received == NULL) error("out of memory");
+    }
+    ssize_t n = read(keeper->fd, keeper->received + keeper->size, keeper->capacity - keeper->size);
+    if (n < 0 && errno == EINTR) return;
+    if (n > 0) {
+        keeper->size += n;
+        return;
+    }
+    close(keeper->fd);
+    keeper->fd = -1;
+}
+
+// The keeper is gone: what it loaded is kept, if it did
+void daemon_kept(size_t index, int status) {
+    DaemonKeeper keeper = DaemonKeeperArray_get(daemon_keepers, index);
+    DaemonKeeperArray_set(daemon_keepers, index, DaemonKeeperArray_get(daemon_keepers, daemon_keepers->size-1));
+    DaemonKeeperArray_pop(daemon_keepers);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) { free(keeper.received); return; }
+    if (!daemon_recipe_decode(keeper.received, keeper.size, &keeper.recipe)) return;
+    printf("DAEMON: loaded `"SV_FMT"`\n", SvFmt(keeper.recipe.path));
+    fflush(stdout);
+    ssize_t kept = daemon_lookup(keeper.recipe.path, keeper.recipe.name, keeper.recipe.optimize);
+    if (kept >= 0) DaemonRecipeArray_set(daemon_recipes, kept, keeper.recipe);
+    else DaemonRecipeArray_push(daemon_recipes, keeper.recipe);
+}
+
+// Takes a request off a connection that has one coming, and starts a worker
+// for it
+void daemon_start(int connection, uint64_t deadline) {
+    uint32_t header[3];
+    int fds[3] = { -1, -1, -1 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = header, .iov_len = sizeof(header) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t n;
+    while ((n = recvmsg(connection, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT)) < 0 && errno == EINTR) {}
+    struct cmsghdr* cmsg = n == (ssize_t) sizeof(header) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+    char* body = NULL;
+    bool valid = fds[0] >= 0 && header[0] <= DAEMON_MAX_REQUEST && (body = malloc(header[0] + 1)) != NULL && daemon_read_until(connection, body, header[0], deadline);
+    // Every string has to be there, each ending in a NUL
+    char** strings = valid ? malloc(sizeof(char*) * ((size_t) header[1] + header[2] + 2)) : NULL;
+    size_t count = 0, expected = (size_t) header[1] + 1 + header[2];
+    for (size_t at = 0; strings != NULL && at < header[0] && count < expected; count++) {
+        strings[count] = body + at;
+        char* end = memchr(body + at, 0, header[0] - at);
+        if (end == NULL) break;
+        at = end - body + 1;
+    }
+    if (strings == NULL || count != expected || header[1] == 0) {
+        // A connection closed right away is someone checking for a daemon
+        if (n != 0) fprintf(stderr, "DAEMON: dropped a malformed request\n");
+        for (size_t i = 0; i < 3; i++) if (fds[i] >= 0) close(fds[i]);
+        free(body);
+        free(strings);
+        close(connection);
+        return;
+    }
+
+    int report[2];
+    if (pipe2(report, O_CLOEXEC) < 0) error("could not create a pipe: %s", strerror(errno));
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) error("could not fork: %s", strerror(errno));
+    if (pid == 0) {
+        // Its own process group, so it goes down with its commands if the
+        // caller does
+        setpgid(0, 0);
+        signal(SIGPIPE, SIG_DFL);
+        daemon_close_all();
+        close(report[0]);
+        close(connection);
+        daemon_report = report[1];
+        for (int i = 0; i < 3; i++) {
+            if (dup2(fds[i], i) < 0) _exit(1);
+            close(fds[i]);
+        }
+        char** argv = strings;
+        char* cwd = strings[header[1]];
+        if (chdir(cwd) < 0) error("could not change directory to `%s`: %s", cwd, strerror(errno));
+        clearenv();
+        for (size_t i = header[1] + 1; i < count; i++) putenv(strings[i]);
+
+        Flags flags = {0};
+        String filename = parse_args(header[1], argv, &flags);
+        exit(mako(filename, &flags));
+    }
+
+    for (size_t i = 0; i < 3; i++) close(fds[i]);
+    close(report[1]);
+    free(body);
+    free(strings);
+    DaemonWorkerArray_push(daemon_workers, (DaemonWorker) { .pid = pid, .connection = connection, .report = report[0] });
+}
+
+// The worker is gone: the caller gets its exit code
+void daemon_finish(size_t index) {
+    DaemonWorker worker = DaemonWorkerArray_get(daemon_workers, index);
+    DaemonWorkerArray_set(daemon_workers, index, DaemonWorkerArray_get(daemon_workers, daemon_workers->size-1));
+    DaemonWorkerArray_pop(daemon_workers);
+
+    int status = 0;
+    while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR) {}
+    int32_t code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    daemon_write_all(worker.connection, (char*) &code, sizeof(code));
+    close(worker.connection);
+    close(worker.report);
+    daemon_keep(worker);
+}
+
+void daemon_serve(void) {
+    struct sockaddr_un addr;
+    if (!daemon_address(&addr)) error("no place for the daemon socket: $XDG_RUNTIME_DIR, or /tmp/mako-%d without it, has to be a directory only you can use, with a short enough path", (int) getuid());
+    daemon_listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (daemon_listener < 0) error("could not create a socket: %s", strerror(errno));
+    // A socket left behind by a daemon that's gone is taken over
+    if (connect(daemon_listener, (struct sockaddr*) &addr, sizeof(addr)) == 0) error("a daemon is already running at `%s`", addr.sun_path);
+    close(daemon_listener);
+    unlink(addr.sun_path);
+    daemon_listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(077);
+    if (daemon_listener < 0 || bind(daemon_listener, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(daemon_listener, 64) < 0) {
+        error("could not listen at `%s`: %s", addr.sun_path, strerror(errno));
+    }
+    umask(mask);
+    signal(SIGPIPE, SIG_IGN);
+    daemon_recipes = DaemonRecipeArray_new(&arena);
+    daemon_workers = DaemonWorkerArray_new(&arena);
+    daemon_callers = DaemonCallerArray_new(&arena);
+    daemon_keepers = DaemonKeeperArray_new(&arena);
+    printf("DAEMON: listening at `%s`\n", addr.sun_path);
+    fflush(stdout);
+
+    for (;;) {
+        size_t count = daemon_workers->size, callers = daemon_callers->size, keepers = daemon_keepers->size;
+        struct pollfd* fds = malloc(sizeof(struct pollfd) * (2 * count + callers + keepers + 1));
+        if (fds == NULL) error("out of memory");
+        fds[0] = (struct pollfd) { .fd = daemon_listener, .events = POLLIN };
+        array_foreach(daemon_workers, i) {
+            DaemonWorker worker = DaemonWorkerArray_get(daemon_workers, i);
+            // Callers send nothing after the request: anything more is a hangup
+            fds[1 + 2*i] = (struct pollfd) { .fd = worker.killed ? -1 : worker.connection, .events = POLLIN };
+            fds[2 + 2*i] = (struct pollfd) { .fd = worker.report, .events = POLLIN };
+        }
+        uint64_t now = profile_now(), first = UINT64_MAX;
+        array_foreach(daemon_callers, i) {
+            DaemonCaller caller = DaemonCallerArray_get(daemon_callers, i);
+            fds[1 + 2*count + i] = (struct pollfd) { .fd = caller.connection, .events = POLLIN };
+            if (caller.deadline < first) first = caller.deadline;
+        }
+        // A keeper that sent everything may take a moment to be reaped
+        struct pollfd* kept = fds + 1 + 2*count + callers;
+        array_foreach(daemon_keepers, i) {
+            DaemonKeeper keeper = DaemonKeeperArray_get(daemon_keepers, i);
+            kept[i] = (struct pollfd) { .fd = keeper.fd, .events = POLLIN };
+            if (keeper.fd < 0 && now + 10000000 < first) first = now + 10000000;
+        }
+        int timeout = first == UINT64_MAX ? -1 : first <= now ? 0 : (int) ((first - now) / 1000000 + 1);
+        if (poll(fds, 2 * count + callers + keepers + 1, timeout) < 0) {
+            free(fds);
+            if (errno == EINTR) continue;
+            error("could not poll: %s", strerror(errno));
+        }
+
+        // Backwards, as finished workers are swapped with the last one
+        for (size_t i = count; i > 0; i--) {
+            DaemonWorker worker = DaemonWorkerArray_get(daemon_workers, i-1);
+            if (fds[2*i].revents != 0) {
+                size_t room = sizeof(worker.recipe) - worker.recipe_size;
+                ssize_t n = room > 0 ? read(worker.report, worker.recipe + worker.recipe_size, room) : 0;
+                if (n > 0) {
+                    worker.recipe_size += n;
+                    DaemonWorkerArray_set(daemon_workers, i-1, worker);
+                } else if (n == 0 || errno != EINTR) {
+                    daemon_finish(i-1);
+                }
+                continue;
+            }
+            if (fds[2*i - 1].revents != 0) {
+                kill(-worker.pid, SIGTERM);
+                worker.killed = true;
+                DaemonWorkerArray_set(daemon_workers, i-1, worker);
+            }
+        }
+        for (size_t i = keepers; i > 0; i--) {
+            DaemonKeeper keeper = DaemonKeeperArray_get(daemon_keepers, i-1);
+            if (kept[i-1].revents != 0) daemon_keeper_read(&keeper);
+            DaemonKeeperArray_set(daemon_keepers, i-1, keeper);
+            if (keeper.fd >= 0) continue;
+            int status = 0;
+            pid_t reaped;
+            while ((reaped = waitpid(keeper.pid, &status, WNOHANG)) < 0 && errno == EINTR) {}
+            if (reaped != 0) daemon_kept(i-1, status);
+        }
+        now = profile_now();
+        for (size_t i = callers; i > 0; i--) {
+            DaemonCaller caller = DaemonCallerArray_get(daemon_callers, i-1);
+            bool ready = fds[2*count + i].revents != 0;
+            if (!ready && caller.deadline > now) continue;
+            DaemonCallerArray_set(daemon_callers, i-1, DaemonCallerArray_get(daemon_callers, daemon_callers->size-1));
+            DaemonCallerArray_pop(daemon_callers);
+            if (ready) daemon_start(caller.connection, caller.deadline);
+            else {
+                fprintf(stderr, "DAEMON: dropped a caller that sent no request\n");
+                close(caller.connection);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int connection = accept4(daemon_listener, NULL, NULL, SOCK_CLOEXEC);
+            struct ucred cred;
+            socklen_t size = sizeof(cred);
+            if (connection >= 0 && (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &cred, &size) < 0 || cred.uid != getuid())) {
+                close(connection);
+                connection = -1;
+            }
+            if (connection >= 0) DaemonCallerArray_push(daemon_callers, (DaemonCaller) { connection, now + DAEMON_REQUEST_MS * 1000000ull });
+        }
+        free(fds);
+    }
+}
@@ -0,0 +1,262 @@
+// Dependencies discovered from compiler depfiles are kept in an append-only
+// binary log, loaded once per run. It's a sequence of records, each starting
+// with a u32 holding the payload size, with the top bit set for deps records:
+//   path: path bytes, NUL-padded to 4 bytes, then u32 ~id (as a checksum)
+//   deps: u32 output id, u64 output mtime in ns, u32 input ids...
+#define DEPS_LOG CACHE_DIR"/deps"
+#define DEPS_MAGIC "MAKODEP1"
+#define DEPS_RECORD_DEPS 0x80000000u
+
+typedef struct {
+    bool recorded;
+    int64_t mtime; // of the output, when the record was made
+    size_t start, count; // into `deps_edges`
+} DepsRecord;
+
+array_define(DepsRecordArray, DepsRecord)
+array_implement(DepsRecordArray, DepsRecord)
+
+bool deps_loaded = false;
+StringArray* deps_paths = NULL; // by id
+StringMap deps_ids = {0};
+DepsRecordArray* deps_records = NULL; // by output id
+U32Array* deps_edges = NULL;
+size_t deps_dead_edges = 0; // superseded by later records, dropped on recompaction
+FILE* deps_file = NULL;
+
+int64_t deps_mtime_ns(struct timespec mtime) {
+    return (int64_t) mtime.tv_sec * 1000000000 + mtime.tv_nsec;
+}
+
+uint32_t deps_path_id(String path, bool write) {
+    size_t id;
+    if (StringMap_get(&deps_ids, path, &id)) return id;
+    id = deps_paths->size;
+    if (write) path = scratch_keep(path); // may come from the arena of a command
+    StringArray_push(deps_paths, path);
+    DepsRecordArray_push(deps_records, (DepsRecord) {0});
+    StringMap_set(&deps_ids, path, id);
+
+    if (write) {
+        uint32_t padded = (path.size + 4) & ~3u; // always at least one NUL
+        uint32_t size = padded + 4, checksum = ~(uint32_t) id;
+        char zeros[4] = {0};
+        fwrite(&size, 4, 1, deps_file);
+        fwrite(path.bytes, 1, path.size, deps_file);
+        fwrite(zeros, 1, padded - path.size, deps_file);
+        fwrite(&checksum, 4, 1, deps_file);
+    }
+    return id;
+}
+
+void deps_set(uint32_t output, int64_t mtime, U32Array* inputs, bool write) {
+    DepsRecord record = DepsRecordArray_get(deps_records, output);
+    if (record.recorded) deps_dead_edges += record.count;
+    record = (DepsRecord) { .recorded = true, .mtime = mtime, .start = deps_edges->size, .count = inputs->size };
+    array_foreach(inputs, i) U32Array_push(deps_edges, U32Array_get(inputs, i));
+    DepsRecordArray_set(deps_records, output, record);
+
+    if (write) {
+        uint32_t size = (12 + 4 * inputs->size) | DEPS_RECORD_DEPS;
+        fwrite(&size, 4, 1, deps_file);
+        fwrite(&output, 4, 1, deps_file);
+        fwrite(&mtime, 8, 1, deps_file);
+        array_foreach(inputs, i) {
+            uint32_t id = U32Array_get(inputs, i);
+            fwrite(&id, 4, 1, deps_file);
+        }
+    }
+}
+
+// Writes the whole log anew, keeping only the latest record of every output
+void deps_recompact(void) {
+    if (deps_file != NULL) fclose(deps_file);
+    mkdir(CACHE_DIR, 0755);
+    deps_file = fopen(DEPS_LOG".tmp", "wb");
+    if (deps_file == NULL) error("could not write `"DEPS_LOG".tmp`: %s", strerror(errno));
+    fwrite(DEPS_MAGIC, 1, 8, deps_file);
+
+    StringArray* paths = deps_paths;
+    DepsRecordArray* records = deps_records;
+    U32Array* edges = deps_edges;
+    deps_paths = StringArray_new(&arena);
+    deps_records = DepsRecordArray_new(&arena);
+    deps_edges = U32Array_new(&arena);
+    deps_dead_edges = 0;
+    StringMap_clear(&deps_ids);
+
+    U32Array* inputs = U32Array_new(&arena);
+    array_foreach(records, output) {
+        DepsRecord record = DepsRecordArray_get(records, output);
+        if (!record.recorded) continue;
+        inputs->size = 0;
+        for (size_t i = 0; i < record.count; i++) {
+            String input = StringArray_get(paths, U32Array_get(edges, record.start + i));
+            U32Array_push(inputs, deps_path_id(input, true));
+        }
+        deps_set(deps_path_id(StringArray_get(paths, output), true), record.mtime, inputs, true);
+    }
+
+    fflush(deps_file);
+    if (rename(DEPS_LOG".tmp", DEPS_LOG) < 0) error("could not write `"DEPS_LOG"`: %s", strerror(errno));
+}
+
+void deps_load(void) {
+    if (deps_loaded) return;
+    deps_loaded = true;
+    deps_paths = StringArray_new(&arena);
+    deps_records = DepsRecordArray_new(&arena);
+    deps_edges = U32Array_new(&arena);
+
+    // Paths point straight into the mapping, which stays for the whole run
+    bool valid = false;
+    int fd = open(DEPS_LOG, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= 8) {
+        char* log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        valid = log != MAP_FAILED && memcmp(log, DEPS_MAGIC, 8) == 0;
+        size_t cursor = 8, size = valid ? st.st_size : 0;
+        U32Array* inputs = U32Array_new(&arena);
+        while (valid && cursor < size) {
+            uint32_t header;
+            if (cursor + 4 > size) { valid = false; break; }
+            memcpy(&header, log + cursor, 4);
+            uint32_t record_size = header & ~DEPS_RECORD_DEPS;
+            cursor += 4;
+            if (cursor + record_size > size || record_size % 4 != 0 || record_size < 4) { valid = false; break; }
+            char* record = log + cursor;
+            cursor += record_size;
+
+            if (header & DEPS_RECORD_DEPS) {
+                uint32_t output;
+                int64_t mtime;
+                if (record_size < 12) { valid = false; break; }
+                memcpy(&output, record, 4);
+                memcpy(&mtime, record + 4, 8);
+                inputs->size = 0;
+                for (uint32_t i = 12; i < record_size; i += 4) {
+                    uint32_t id;
+                    memcpy(&id, record + i, 4);
+                    if (id >= deps_paths->size) { valid = false; break; }
+                    U32Array_push(inputs, id);
+                }
+                if (!valid || output >= deps_paths->size) { valid = false; break; }
+                deps_set(output, mtime, inputs, false);
+            } else {
+                uint32_t checksum;
+                memcpy(&checksum, record + record_size - 4, 4);
+                // The path ends in its padding, never past the record
+                size_t length = strnlen(record, record_size - 4);
+                if (checksum != ~(uint32_t) deps_paths->size || length == record_size - 4) { valid = false; break; }
+                deps_path_id(sv_from_bytes(record, length), false);
+            }
+        }
+    }
+    if (fd >= 0) close(fd);
+
+    // A torn or foreign log is dropped along with whatever follows the damage
+    if (!valid || deps_dead_edges > deps_edges->size / 2 + 1024) deps_recompact();
+    else if ((deps_file = fopen(DEPS_LOG, "ab")) == NULL) error("could not write `"DEPS_LOG"`: %s", strerror(errno));
+}
+
+// Parses a Makefile-style depfile, as written by `gcc -MD`/`clang -MD`.
+// Only prerequisites are collected: targets are the outputs themselves, and
+// phony rules from `-MP` have none.
+StringArray* deps_parse(String content, Arena* a) {
+    StringArray* deps = StringArray_new(a);
+    bool after_colon = false;
+    size_t i = 0;
+    while (i < content.size) {
+        char c = sv_index(content, i);
+        if (c == '\n') { after_colon = false; i++; continue; }
+        if (c == ' ' || c == '\t' || c == '\r') { i++; continue; }
+        if (c == '\\' && i + 1 < content.size && (sv_index(content, i+1) == '\n' || sv_index(content, i+1) == '\r')) {
+            i++;
+            while (i < content.size && sv_index(content, i) != '\n') i++;
+            i++;
+            continue;
+        }
+
+        StringBuilder* word = StringBuilder_new(a);
+        while (i < content.size) {
+            c = sv_index(content, i);
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r') break;
+            if (c == '\\' && i + 1 < content.size) {
+                char next = sv_index(content, i+1);
+                if (next == ' ' || next == '#' || next == '\\') { StringBuilder_push(word, next); i += 2; continue; }
+                if (next == '\n' || next == '\r') break;
+            }
+            if (c == '$' && i + 1 < content.size && sv_index(content, i+1) == '$') { StringBuilder_push(word, '$'); i += 2; continue; }
+            StringBuilder_push(word, c);
+            i++;
+        }
+
+        String path = sv_from_sb(word);
+        if (!after_colon && path.size > 0 && sv_index(path, path.size-1) == ':') {
+            after_colon = true;
+            continue;
+        }
+        if (after_colon && path.size > 0) StringArray_push(deps, path);
+    }
+    return deps;
+}
+
+// Called once a command with a depfile succeeds
+void deps_ingest(Command command) {
+    deps_load();
+    char cpath[PATH_MAX];
+    int fd = open(fs_cpath(command.depfile, cpath), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) lexer_error(command.loc, "could not read depfile `"SV_FMT"`: %s", SvFmt(command.depfile), strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) < 0) lexer_error(command.loc, "could not read depfile `"SV_FMT"`: %s", SvFmt(command.depfile), strerror(errno));
+    StringArray* deps = StringArray_new(command.arena);
+    if (st.st_size > 0) {
+        char* content = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (content == MAP_FAILED) lexer_error(command.loc, "could not read depfile `"SV_FMT"`: %s", SvFmt(command.depfile), strerror(errno));
+        deps = deps_parse(sv_from_bytes(content, st.st_size), command.arena);
+        munmap(content, st.st_size);
+    }
+    close(fd);
+
+    fs_depend(deps);
+    String output = StringArray_get(command.outputs, 0);
+    FsStat output_stat = fs_stat(output);
+    if (!output_stat.exists) return;
+
+    U32Array* inputs = U32Array_new(command.arena);
+    array_foreach(deps, i) U32Array_push(inputs, deps_path_id(StringArray_get(deps, i), true));
+    deps_set(deps_path_id(output, true), deps_mtime_ns(output_stat.mtime), inputs, true);
+    fflush(deps_file);
+}
+
+// Recorded dependencies of the first output of a command, or NULL if there's
+// no record. A record older than the output itself doesn't count: the output
+// was changed by something else, so its dependencies may have changed too.
+StringArray* deps_lookup(Command command) {
+    deps_load();
+    String output = StringArray_get(command.outputs, 0);
+    size_t id;
+    if (!StringMap_get(&deps_ids, output, &id)) return NULL;
+    DepsRecord record = DepsRecordArray_get(deps_records, id);
+    if (!record.recorded) return NULL;
+    FsStat output_stat = fs_stat(output);
+    if (!output_stat.exists || deps_mtime_ns(output_stat.mtime) > record.mtime) return NULL;
+
+    StringArray* deps = StringArray_new(command.arena);
+    for (size_t i = 0; i < record.count; i++) {
+        StringArray_push(deps, StringArray_get(deps_paths, U32Array_get(deps_edges, record.start + i)));
+    }
+    return deps;
+}
+
+// Re-records the dependencies of an output after it was replaced by something
+// that didn't change them, like a restore from the cache
+void deps_refresh(Command command, StringArray* deps) {
+    String output = StringArray_get(command.outputs, 0);
+    FsStat output_stat = fs_stat(output);
+    if (!output_stat.exists) return;
+    U32Array* inputs = U32Array_new(command.arena);
+    array_foreach(deps, i) U32Array_push(inputs, deps_path_id(StringArray_get(deps, i), true));
+    deps_set(deps_path_id(output, true), deps_mtime_ns(output_stat.mtime), inputs, true);
+    fflush(deps_file);
+}
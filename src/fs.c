@@ -0,0 +1,506 @@
+typedef struct {
+    bool exists, is_dir;
+    struct timespec mtime;
+} FsStat;
+
+char* fs_cpath(String path, char cpath[PATH_MAX]) {
+    if (path.size >= PATH_MAX) error("path is too long: `"SV_FMT"`", SvFmt(path));
+    memcpy(cpath, path.bytes, path.size);
+    cpath[path.size] = 0;
+    return cpath;
+}
+
+// Hashes the whole content of a file; returns false if it can't be read
+bool fs_hash_file(Hash hash, String path, Hash* result) {
+    char cpath[PATH_MAX];
+    fs_cpath(path, cpath);
+
+    int fd = open(cpath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) { close(fd); return false; }
+    if (st.st_size == 0) {
+        close(fd);
+        *result = hash_bytes(hash, "", 0);
+        return true;
+    }
+    void* content = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (content == MAP_FAILED) return false;
+    *result = hash_bytes(hash, content, st.st_size);
+    munmap(content, st.st_size);
+    return true;
+}
+
+// Maps a whole file into memory for the rest of the run, so the recipe can be
+// lexed in place; files that can't be mapped (pipes and such) are read instead
+String fs_map_file(String path) {
+    char cpath[PATH_MAX];
+    fs_cpath(path, cpath);
+
+    int fd = open(cpath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) error("could not read `%s`: %s", cpath, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) < 0) error("could not read `%s`: %s", cpath, strerror(errno));
+    if (S_ISREG(st.st_mode) && st.st_size == 0) { close(fd); return sv_from_bytes("", 0); }
+    void* content = S_ISREG(st.st_mode) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (content != MAP_FAILED) return sv_from_bytes(content, st.st_size);
+
+    StringBuilder* sb = StringBuilder_new(&arena);
+    FILE* file = fopen(cpath, "rb");
+    if (file == NULL) error("could not read `%s`: %s", cpath, strerror(errno));
+    for (int c; (c = fgetc(file)) != EOF;) StringBuilder_push(sb, c);
+    fclose(file);
+    return sv_from_sb(sb);
+}
+
+FsStat fs_stat_uncached(String path) {
+    char cpath[PATH_MAX];
+    fs_cpath(path, cpath);
+
+    struct stat st;
+    if (stat(cpath, &st) < 0) return (FsStat) {0};
+    return (FsStat) { .exists = true, .is_dir = S_ISDIR(st.st_mode), .mtime = st.st_mtim };
+}
+
+// How a path looked when it was first looked at, so `--watch` can tell that
+// it changed while the run was still going
+typedef struct {
+    bool exists, is_dir;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} FsSeen;
+
+bool fs_seeing = false; // only a run under `--watch` keeps what it saw
+
+FsSeen fs_seen(String path) {
+    char cpath[PATH_MAX];
+    struct stat st;
+    if (stat(fs_cpath(path, cpath), &st) < 0) return (FsSeen) {0};
+    return (FsSeen) { .exists = true, .is_dir = S_ISDIR(st.st_mode), .dev = st.st_dev, .ino = st.st_ino, .size = st.st_size, .mtime = st.st_mtim };
+}
+
+// What the recipe learns about a path is kept for the whole run, as recipes
+// tend to probe the same paths over and over. Anything that may change a path
+// forgets what's known about it, see `fs_invalidate`.
+typedef struct {
+    String path;
+    bool has_stat, has_file_exists, has_dir_exists, has_list;
+    FsStat stat;
+    bool file_exists, dir_exists;
+    StringArray* list; // directory listing, or paths matching a pattern
+    Arena* list_arena; // of `list`, given back once it's forgotten
+    // For `--watch`, and kept when the rest is forgotten: whether it was ever
+    // listed, how it looked at first, and whether the run may have changed it
+    bool listed, has_seen, written;
+    FsSeen seen;
+} FsCacheEntry;
+
+array_define(FsCacheArray, FsCacheEntry)
+array_implement(FsCacheArray, FsCacheEntry)
+
+FsCacheArray* fs_cache = NULL; // by path
+StringMap fs_cache_ids = {0};
+FsCacheArray* fs_patterns = NULL; // by `fnmatch` pattern
+StringMap fs_pattern_ids = {0};
+size_t fs_cache_hits = 0, fs_cache_misses = 0;
+
+// `src/`, `./src` and `src` are all the same entry
+String fs_cache_key(String path) {
+    while (path.size >= 2 && sv_index(path, 0) == '.' && sv_index(path, 1) == '/') path = sv_from_bytes(path.bytes + 2, path.size - 2);
+    while (path.size >= 2 && sv_index(path, path.size-1) == '/') path.size--;
+    if (path.size == 0) return sv(".");
+    return path;
+}
+
+String fs_cache_parent(String key) {
+    for (size_t i = key.size; i > 0; i--) {
+        if (sv_index(key, i-1) == '/') return i == 1 ? sv("/") : sv_from_bytes(key.bytes, i-1);
+    }
+    return sv(".");
+}
+
+size_t fs_cache_lookup(FsCacheArray** cache, StringMap* ids, String key) {
+    if (*cache == NULL) *cache = FsCacheArray_new(&arena);
+    size_t id;
+    if (StringMap_get(ids, key, &id)) return id;
+
+    StringBuilder* sb = StringBuilder_new(&arena);
+    for (size_t i = 0; i < key.size; i++) StringBuilder_push(sb, sv_index(key, i));
+    String copy = sv_from_sb(sb);
+    bool seeing = fs_seeing && cache == &fs_cache;
+    FsCacheArray_push(*cache, (FsCacheEntry) { .path = copy, .has_seen = seeing, .seen = seeing ? fs_seen(copy) : (FsSeen) {0} });
+    StringMap_set(ids, copy, (*cache)->size-1);
+    return (*cache)->size-1;
+}
+
+FsStat fs_stat(String path) {
+    size_t id = fs_cache_lookup(&fs_cache, &fs_cache_ids, fs_cache_key(path));
+    FsCacheEntry entry = FsCacheArray_get(fs_cache, id);
+    if (entry.has_stat) { fs_cache_hits++; return entry.stat; }
+    fs_cache_misses++;
+    entry.stat = fs_stat_uncached(path);
+    entry.has_stat = true;
+    FsCacheArray_set(fs_cache, id, entry);
+    return entry.stat;
+}
+
+bool fs_file_exists(String path) {
+    size_t id = fs_cache_lookup(&fs_cache, &fs_cache_ids, fs_cache_key(path));
+    FsCacheEntry entry = FsCacheArray_get(fs_cache, id);
+    if (entry.has_file_exists) { fs_cache_hits++; return entry.file_exists; }
+    fs_cache_misses++;
+    entry.file_exists = file_exists(path);
+    entry.has_file_exists = true;
+    FsCacheArray_set(fs_cache, id, entry);
+    return entry.file_exists;
+}
+
+bool fs_dir_exists(String path) {
+    size_t id = fs_cache_lookup(&fs_cache, &fs_cache_ids, fs_cache_key(path));
+    FsCacheEntry entry = FsCacheArray_get(fs_cache, id);
+    if (entry.has_dir_exists) { fs_cache_hits++; return entry.dir_exists; }
+    fs_cache_misses++;
+    entry.dir_exists = dir_exists(path);
+    entry.has_dir_exists = true;
+    FsCacheArray_set(fs_cache, id, entry);
+    return entry.dir_exists;
+}
+
+// The returned listing is shared, it must not be changed
+StringArray* fs_list(String path) {
+    size_t id = fs_cache_lookup(&fs_cache, &fs_cache_ids, fs_cache_key(path));
+    FsCacheEntry entry = FsCacheArray_get(fs_cache, id);
+    if (entry.has_list) { fs_cache_hits++; return entry.list; }
+    fs_cache_misses++;
+    entry.list_arena = scratch_new();
+    entry.list = dir_list(path, entry.list_arena);
+    entry.has_list = true;
+    entry.listed = true;
+    FsCacheArray_set(fs_cache, id, entry);
+    return entry.list;
+}
+
+StringArray* fs_fnmatch(String pattern, StringArray* excludes) {
+    // Keyed by the pattern and its excludes, which can't contain newlines
+    Arena* scratch = scratch_begin();
+    StringBuilder* sb = StringBuilder_new(scratch);
+    for (size_t i = 0; i < pattern.size; i++) StringBuilder_push(sb, sv_index(pattern, i));
+    array_foreach(excludes, i) {
+        String exclude = StringArray_get(excludes, i);
+        StringBuilder_push(sb, '\n');
+        for (size_t j = 0; j < exclude.size; j++) StringBuilder_push(sb, sv_index(exclude, j));
+    }
+    size_t id = fs_cache_lookup(&fs_patterns, &fs_pattern_ids, sv_from_sb(sb));
+    scratch_end(scratch);
+    FsCacheEntry entry = FsCacheArray_get(fs_patterns, id);
+    if (entry.has_list) { fs_cache_hits++; return entry.list; }
+    fs_cache_misses++;
+    entry.list_arena = scratch_new();
+    entry.list = glob_match(pattern, excludes, entry.list_arena);
+    entry.has_list = true;
+    FsCacheArray_set(fs_patterns, id, entry);
+    return entry.list;
+}
+
+// A path is forgotten when the run may have changed it itself
+void fs_forget(size_t id) {
+    FsCacheEntry entry = FsCacheArray_get(fs_cache, id);
+    scratch_free(entry.list_arena);
+    FsCacheArray_set(fs_cache, id, (FsCacheEntry) { .path = entry.path, .listed = entry.listed, .has_seen = entry.has_seen, .written = true, .seen = entry.seen });
+}
+
+void fs_forget_patterns(void) {
+    if (fs_patterns == NULL) return;
+    array_foreach(fs_patterns, i) {
+        FsCacheEntry entry = FsCacheArray_get(fs_patterns, i);
+        scratch_free(entry.list_arena);
+        FsCacheArray_set(fs_patterns, i, (FsCacheEntry) { .path = entry.path });
+    }
+}
+
+// Notes paths the run depends on without looking at them, like inputs of a
+// command that is run anyway, so that `--watch` knows about them too
+void fs_depend(StringArray* paths) {
+    array_foreach(paths, i) fs_cache_lookup(&fs_cache, &fs_cache_ids, fs_cache_key(StringArray_get(paths, i)));
+}
+
+void fs_invalidate_all(void) {
+    if (fs_cache != NULL) array_foreach(fs_cache, i) fs_forget(i);
+    fs_forget_patterns();
+}
+
+// Forgets a path, everything under it, and the listing of its directory.
+// Absolute paths may alias relative ones, so they're always forgotten.
+void fs_invalidate(String path) {
+    String key = fs_cache_key(path);
+    if (sv_compare(key, sv(".")) || sv_index(key, 0) == '/') { fs_invalidate_all(); return; }
+    if (fs_cache != NULL) array_foreach(fs_cache, i) {
+        String cached = FsCacheArray_get(fs_cache, i).path;
+        bool under = cached.size > key.size && sv_compare_at(cached, key, 0) && sv_index(cached, key.size) == '/';
+        if (sv_compare(cached, key) || under || sv_index(cached, 0) == '/') fs_forget(i);
+    }
+    size_t parent;
+    if (StringMap_get(&fs_cache_ids, fs_cache_parent(key), &parent)) fs_forget(parent);
+    fs_forget_patterns();
+}
+
+// Called around commands: only declared outputs are expected to change, and
+// a command that declares none may change anything
+void fs_invalidate_outputs(StringArray* outputs) {
+    if (outputs->size == 0) fs_invalidate_all();
+    array_foreach(outputs, i) fs_invalidate(StringArray_get(outputs, i));
+}
+
+void fs_print_stats(void) {
+    size_t total = fs_cache_hits + fs_cache_misses;
+    printf("STATS: filesystem cache: %zu hits, %zu misses (%zu%% hit rate)\n", fs_cache_hits, fs_cache_misses, total > 0 ? fs_cache_hits * 100 / total : 0);
+}
+
+int fs_mtime_compare(struct timespec a, struct timespec b) {
+    if (a.tv_sec != b.tv_sec) return a.tv_sec < b.tv_sec ? -1 : 1;
+    if (a.tv_nsec != b.tv_nsec) return a.tv_nsec < b.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// `a` exists and is strictly newer than `b`, or `b` doesn't exist
+bool fs_newer(String a, String b) {
+    FsStat sa = fs_stat(a);
+    if (!sa.exists) return false;
+    FsStat sb = fs_stat(b);
+    if (!sb.exists) return true;
+    return fs_mtime_compare(sa.mtime, sb.mtime) > 0;
+}
+
+// Every output exists and none of them is older than any of the inputs.
+// A missing input makes outputs out of date, so the command gets to report it.
+bool fs_uptodate(StringArray* outputs, StringArray* inputs) {
+    if (outputs->size == 0) return false;
+    struct timespec oldest_output = {0};
+    array_foreach(outputs, i) {
+        FsStat st = fs_stat(StringArray_get(outputs, i));
+        if (!st.exists) return false;
+        if (i == 0 || fs_mtime_compare(st.mtime, oldest_output) < 0) oldest_output = st.mtime;
+    }
+    array_foreach(inputs, i) {
+        FsStat st = fs_stat(StringArray_get(inputs, i));
+        if (!st.exists) return false;
+        if (fs_mtime_compare(st.mtime, oldest_output) > 0) return false;
+    }
+    return true;
+}
+
+// Copies a regular file, sharing its extents (reflink) when the filesystem
+// can, and falling back to copying in the kernel. `to` is replaced atomically.
+bool fs_copy_cfile(const char* cfrom, const char* cto) {
+    char ctmp[PATH_MAX];
+    if (snprintf(ctmp, sizeof(ctmp), "%s.tmp.%d", cto, (int) getpid()) >= (int) sizeof(ctmp)) return false;
+
+    int in = open(cfrom, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    struct stat st;
+    if (fstat(in, &st) < 0 || !S_ISREG(st.st_mode)) { close(in); return false; }
+    int out = open(ctmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+    if (out < 0) { close(in); return false; }
+
+    bool ok = ioctl(out, FICLONE, in) == 0;
+    off_t left = st.st_size;
+    while (!ok && left > 0) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, left, 0);
+        if (n <= 0) break;
+        left -= n;
+        if (left == 0) ok = true;
+    }
+    while (!ok && left > 0) {
+        ssize_t n = sendfile(out, in, NULL, left);
+        if (n <= 0) break;
+        left -= n;
+        if (left == 0) ok = true;
+    }
+    if (st.st_size == 0) ok = true;
+    if (ok) fchmod(out, st.st_mode & 07777);
+
+    close(in);
+    if (close(out) < 0) ok = false;
+    if (ok && rename(ctmp, cto) < 0) ok = false;
+    if (!ok) unlink(ctmp);
+    return ok;
+}
+
+// Recreates a symlink as it is, pointing at the same path. `to` is replaced
+// atomically.
+bool fs_copy_clink(const char* cfrom, const char* cto) {
+    char target[PATH_MAX], ctmp[PATH_MAX];
+    if (snprintf(ctmp, sizeof(ctmp), "%s.tmp.%d", cto, (int) getpid()) >= (int) sizeof(ctmp)) return false;
+    ssize_t size = readlink(cfrom, target, sizeof(target) - 1);
+    if (size < 0) return false;
+    target[size] = 0;
+    if (symlink(target, ctmp) < 0) return false;
+    if (rename(ctmp, cto) == 0) return true;
+    unlink(ctmp);
+    return false;
+}
+
+bool fs_copy_file(String from, String to) {
+    char cfrom[PATH_MAX], cto[PATH_MAX];
+    return fs_copy_cfile(fs_cpath(from, cfrom), fs_cpath(to, cto));
+}
+
+// nftw() callbacks don't take an argument, so the tree being copied is here
+const char* fs_copy_tree_to = NULL;
+size_t fs_copy_tree_prefix = 0;
+
+int fs_copy_tree_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void) ftw;
+    char to[PATH_MAX];
+    if (snprintf(to, sizeof(to), "%s%s", fs_copy_tree_to, path + fs_copy_tree_prefix) >= (int) sizeof(to)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (flag == FTW_D) {
+        if (mkdir(to, st->st_mode & 07777) < 0 && errno != EEXIST) return -1;
+        return 0;
+    }
+    if (flag == FTW_SL) return fs_copy_clink(path, to) ? 0 : -1;
+    if (flag != FTW_F) {
+        errno = EACCES;
+        return -1;
+    }
+    return fs_copy_cfile(path, to) ? 0 : -1;
+}
+
+// Copies a directory with everything in it, like `cp -r`. Symlinks are copied
+// as they are, and files are copied the same way `fs_copy_file` does.
+bool fs_copy_tree(String from, String to) {
+    char cfrom[PATH_MAX], cto[PATH_MAX];
+    fs_cpath(from, cfrom);
+    fs_copy_tree_to = fs_cpath(to, cto);
+    fs_copy_tree_prefix = strlen(cfrom);
+    while (fs_copy_tree_prefix > 1 && cfrom[fs_copy_tree_prefix-1] == '/') cfrom[--fs_copy_tree_prefix] = 0;
+    return nftw(cfrom, fs_copy_tree_entry, 64, FTW_PHYS) == 0;
+}
+
+int fs_remove_tree_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void) st; (void) ftw;
+    return (flag == FTW_DP ? rmdir(path) : unlink(path)) < 0 && errno != ENOENT ? -1 : 0;
+}
+
+// Removes a path with everything under it, like `rm -rf`. A missing path is
+// not an error.
+bool fs_remove_tree(String path) {
+    char cpath[PATH_MAX];
+    fs_cpath(path, cpath);
+    struct stat st;
+    if (lstat(cpath, &st) < 0) return errno == ENOENT;
+    if (!S_ISDIR(st.st_mode)) return unlink(cpath) == 0;
+    return nftw(cpath, fs_remove_tree_entry, 64, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+// Removes a file, like `rm -f`
+bool fs_remove(String path) {
+    char cpath[PATH_MAX];
+    return unlink(fs_cpath(path, cpath)) == 0 || errno == ENOENT;
+}
+
+// Renames a path, copying and removing it if it's moved across filesystems.
+// A symlink is moved as a symlink, not as what it points to.
+bool fs_rename(String from, String to) {
+    char cfrom[PATH_MAX], cto[PATH_MAX];
+    if (rename(fs_cpath(from, cfrom), fs_cpath(to, cto)) == 0) return true;
+    if (errno != EXDEV) return false;
+    struct stat st;
+    if (lstat(cfrom, &st) < 0) return false;
+    bool copied = S_ISDIR(st.st_mode) ? fs_copy_tree(from, to)
+        : S_ISLNK(st.st_mode) ? fs_copy_clink(cfrom, cto)
+        : fs_copy_file(from, to);
+    return copied && fs_remove_tree(from);
+}
+
+// Creates a file or updates its modification time, like `touch`
+bool fs_touch(String path) {
+    char cpath[PATH_MAX];
+    int fd = open(fs_cpath(path, cpath), O_WRONLY | O_CREAT | O_NOCTTY | O_CLOEXEC, 0666);
+    if (fd < 0) return false;
+    bool ok = futimens(fd, NULL) == 0;
+    close(fd);
+    return ok;
+}
+
+// Reads a whole file into `a`; false if it can't be read
+bool fs_read_file(String path, String* content, Arena* a) {
+    char cpath[PATH_MAX];
+    int fd = open(fs_cpath(path, cpath), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    StringBuilder* sb = StringBuilder_new(a);
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { close(fd); return false; }
+        for (ssize_t i = 0; i < n; i++) StringBuilder_push(sb, buffer[i]);
+    }
+    close(fd);
+    *content = sv_from_sb(sb);
+    return true;
+}
+
+// Writes `content` to a file, unless it already has exactly that content, so
+// whatever depends on the file isn't rebuilt for nothing. `to` is replaced
+// atomically, keeping its mode; a symlink has its target replaced instead.
+// Sets `changed` to whether the file was written.
+bool fs_write_if_changed(String path, String content, bool* changed) {
+    char cpath[PATH_MAX], ctmp[PATH_MAX], resolved[PATH_MAX];
+    fs_cpath(path, cpath);
+    *changed = false;
+
+    // A symlink to nowhere yet is written through, as there's nothing to
+    // replace
+    struct stat st;
+    bool in_place = false;
+    if (lstat(cpath, &st) == 0 && S_ISLNK(st.st_mode)) {
+        if (realpath(cpath, resolved) != NULL) strcpy(cpath, resolved);
+        else in_place = errno == ENOENT;
+    }
+
+    // The mode is kept even if the file can't be read, only then it can't
+    // be compared either
+    bool existed = stat(cpath, &st) == 0 && S_ISREG(st.st_mode);
+    int fd = existed ? open(cpath, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd >= 0 && (size_t) st.st_size == content.size) {
+        bool same = content.size == 0;
+        void* old = content.size > 0 ? mmap(NULL, content.size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        if (old != MAP_FAILED) {
+            same = memcmp(old, content.bytes, content.size) == 0;
+            munmap(old, content.size);
+        }
+        if (same) { close(fd); return true; }
+    }
+    if (fd >= 0) close(fd);
+
+    if (snprintf(ctmp, sizeof(ctmp), "%s.tmp.%d", cpath, (int) getpid()) >= (int) sizeof(ctmp)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    if (in_place) strcpy(ctmp, cpath);
+    fd = open(ctmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return false;
+    bool ok = !existed || fchmod(fd, st.st_mode & 07777) == 0;
+    for (size_t written = 0; ok && written < content.size;) {
+        ssize_t n = write(fd, content.bytes + written, content.size - written);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) written += n;
+    }
+    if (close(fd) < 0) ok = false;
+    if (ok && !in_place && rename(ctmp, cpath) < 0) ok = false;
+    if (!ok && !in_place) {
+        int saved = errno;
+        unlink(ctmp);
+        errno = saved;
+    }
+    *changed = ok;
+    return ok;
+}
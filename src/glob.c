@@ -0,0 +1,460 @@
+// Patterns of `fnmatch`: shell wildcards in each path component, `**` for any
+// number of directories, and `{a,b}` for alternatives. Trees are walked by a
+// pool of threads, each taking directories from its own queue and stealing
+// from the others' once it runs dry. The pool is only started once enough
+// directories are waiting, so the usual small walk never leaves the calling
+// thread. Matches are sorted at the end, so they don't depend on which thread
+// found what. Threads of the pool never end the process: running out of
+// memory stops the walk, and the calling thread reports it.
+#define GLOB_MAX_COMPONENTS 64
+#define GLOB_MAX_THREADS 16
+#define GLOB_MAX_PENDING 512 // directories queued with an fd; the rest are opened when visited
+#define GLOB_THREADS_AT 16 // directories queued before the pool is started
+#define GLOB_MAX_EXPANSIONS 4096
+
+typedef struct {
+    char** items;
+    size_t size, capacity;
+} GlobList;
+
+// False if there's no memory for it, and then the list is as it was
+bool glob_list_add(GlobList* list, char* item) {
+    if (item == NULL) return false;
+    if (list->size == list->capacity) {
+        size_t capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        char** items = realloc(list->items, sizeof(char*) * capacity);
+        if (items == NULL) return false;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->size++] = item;
+    return true;
+}
+
+void glob_list_push(GlobList* list, char* item) {
+    if (!glob_list_add(list, item)) error("out of memory");
+}
+
+void glob_list_free(GlobList* list) {
+    for (size_t i = 0; i < list->size; i++) free(list->items[i]);
+    free(list->items);
+    *list = (GlobList) {0};
+}
+
+char* glob_strndup(const char* s, size_t size) {
+    char* copy = strndup(s, size);
+    if (copy == NULL) error("out of memory");
+    return copy;
+}
+
+// Expands the first `{...}` of a pattern, and then whatever is left of it
+void glob_expand_braces(const char* pattern, GlobList* out) {
+    const char *open = NULL, *close = NULL;
+    size_t depth = 0;
+    for (const char* c = pattern; *c && close == NULL; c++) {
+        if (*c == '\\' && c[1] != 0) c++;
+        else if (*c == '{' && depth++ == 0) open = c;
+        else if (*c == '}' && depth > 0 && --depth == 0) close = c;
+    }
+    if (close == NULL) {
+        glob_list_push(out, glob_strndup(pattern, strlen(pattern)));
+        return;
+    }
+
+    // Alternatives are split by commas that aren't in nested braces
+    const char* alternative = open + 1;
+    for (const char* c = open + 1; c <= close; c++) {
+        if (*c == '\\' && c + 1 < close) { c++; continue; }
+        if (*c == '{') depth++;
+        else if (*c == '}' && c != close) depth--;
+        else if ((*c == ',' && depth == 0) || c == close) {
+            size_t prefix = open - pattern, middle = c - alternative;
+            char* expanded = malloc(prefix + middle + strlen(close + 1) + 1);
+            if (expanded == NULL) error("out of memory");
+            memcpy(expanded, pattern, prefix);
+            memcpy(expanded + prefix, alternative, middle);
+            strcpy(expanded + prefix + middle, close + 1);
+            if (out->size < GLOB_MAX_EXPANSIONS) glob_expand_braces(expanded, out);
+            free(expanded);
+            alternative = c + 1;
+        }
+    }
+}
+
+typedef struct {
+    char* components[GLOB_MAX_COMPONENTS];
+    size_t count;
+    size_t first_wild; // components before it are plain names
+    bool absolute, dirs_only;
+} GlobPattern;
+
+bool glob_is_wild(const char* component) {
+    return strpbrk(component, "*?[\\") != NULL;
+}
+
+bool glob_is_globstar(const char* component) {
+    return strcmp(component, "**") == 0;
+}
+
+void glob_pattern_free(GlobPattern* p) {
+    for (size_t i = 0; i < p->count; i++) free(p->components[i]);
+    p->count = 0;
+}
+
+// Splits a pattern into components; false if it has too many of them
+bool glob_parse(const char* pattern, GlobPattern* p) {
+    *p = (GlobPattern) { .absolute = pattern[0] == '/' };
+    size_t size = strlen(pattern);
+    p->dirs_only = size > 1 && pattern[size-1] == '/';
+    for (const char* c = pattern; *c;) {
+        const char* slash = strchr(c, '/');
+        size_t length = slash ? (size_t) (slash - c) : strlen(c);
+        if (length > 0) {
+            if (p->count == GLOB_MAX_COMPONENTS) {
+                glob_pattern_free(p);
+                return false;
+            }
+            p->components[p->count++] = glob_strndup(c, length);
+        }
+        c += length;
+        if (*c == '/') c++;
+    }
+    while (p->first_wild < p->count && !glob_is_wild(p->components[p->first_wild])) p->first_wild++;
+    return true;
+}
+
+bool glob_match_components(char** components, size_t count, const char* path) {
+    if (count == 0) return *path == 0;
+    if (glob_is_globstar(components[0])) {
+        if (count == 1) return true;
+        if (glob_match_components(components + 1, count - 1, path)) return true;
+        for (const char* c = path; *c; c++) {
+            if (*c == '/' && glob_match_components(components + 1, count - 1, c + 1)) return true;
+        }
+        return false;
+    }
+    const char* slash = strchr(path, '/');
+    size_t length = slash ? (size_t) (slash - path) : strlen(path);
+    char name[NAME_MAX + 1];
+    if (length > NAME_MAX) return false;
+    memcpy(name, path, length);
+    name[length] = 0;
+    if (fnmatch(components[0], name, FNM_PERIOD) != 0) return false;
+    if (count == 1) return slash == NULL;
+    return slash != NULL && glob_match_components(components + 1, count - 1, slash + 1);
+}
+
+typedef struct {
+    int fd; // of the directory, owned by the task
+    char* path; // the directory as matches are printed, "" for the current one
+    uint64_t states; // components that entries of this directory are matched against
+} GlobTask;
+
+typedef struct {
+    pthread_mutex_t lock;
+    GlobTask* tasks;
+    size_t head, size, capacity; // the owner works at the back, thieves at the front
+    GlobList matches;
+} GlobWorker;
+
+typedef struct GlobWalk GlobWalk;
+
+typedef struct {
+    GlobWalk* walk;
+    size_t index;
+} GlobThread;
+
+struct GlobWalk {
+    GlobPattern* pattern;
+    GlobPattern* excludes;
+    size_t excludes_count;
+    GlobWorker workers[GLOB_MAX_THREADS];
+    size_t workers_count;
+    size_t pending; // queued or being visited
+    // Only the calling thread, the first worker, starts and joins the others
+    GlobThread threads[GLOB_MAX_THREADS];
+    pthread_t ids[GLOB_MAX_THREADS];
+    size_t started;
+    bool failed; // out of memory, atomically
+};
+
+uint64_t glob_closure(GlobPattern* p, uint64_t states) {
+    // `**` may match no directories at all
+    for (size_t i = 0; i + 1 < p->count; i++) {
+        if ((states & (1ull << i)) && glob_is_globstar(p->components[i])) states |= 1ull << (i + 1);
+    }
+    return states;
+}
+
+bool glob_excluded(GlobWalk* walk, const char* path) {
+    while (strncmp(path, "./", 2) == 0) path += 2;
+    for (size_t i = 0; i < walk->excludes_count; i++) {
+        GlobPattern* ex = &walk->excludes[i];
+        if (glob_match_components(ex->components, ex->count, path)) return true;
+    }
+    return false;
+}
+
+// NULL if there's no memory for it
+char* glob_join(const char* dir, const char* name) {
+    size_t dir_size = strlen(dir), name_size = strlen(name);
+    bool slash = dir_size > 0 && dir[dir_size-1] != '/';
+    char* path = malloc(dir_size + slash + name_size + 2);
+    if (path == NULL) return NULL;
+    memcpy(path, dir, dir_size);
+    if (slash) path[dir_size] = '/';
+    memcpy(path + dir_size + slash, name, name_size + 1);
+    return path;
+}
+
+bool glob_queue(GlobWorker* worker, GlobTask task) {
+    pthread_mutex_lock(&worker->lock);
+    if (worker->head > 0 && worker->head == worker->size) worker->head = worker->size = 0;
+    bool ok = true;
+    if (worker->size == worker->capacity) {
+        size_t capacity = worker->capacity == 0 ? 64 : worker->capacity * 2;
+        GlobTask* tasks = realloc(worker->tasks, sizeof(GlobTask) * capacity);
+        ok = tasks != NULL;
+        if (ok) {
+            worker->tasks = tasks;
+            worker->capacity = capacity;
+        }
+    }
+    if (ok) worker->tasks[worker->size++] = task;
+    pthread_mutex_unlock(&worker->lock);
+    return ok;
+}
+
+bool glob_take(GlobWorker* worker, GlobTask* task, bool steal) {
+    pthread_mutex_lock(&worker->lock);
+    bool taken = worker->head < worker->size;
+    if (taken) *task = steal ? worker->tasks[worker->head++] : worker->tasks[--worker->size];
+    pthread_mutex_unlock(&worker->lock);
+    return taken;
+}
+
+struct glob_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+void* glob_worker(void* arg);
+
+void glob_start(GlobWalk* walk) {
+    for (size_t i = 1; i < walk->workers_count; i++) {
+        if (pthread_create(&walk->ids[i], NULL, glob_worker, &walk->threads[i]) != 0) break;
+        walk->started++;
+    }
+}
+
+void glob_visit(GlobWalk* walk, GlobWorker* worker, GlobTask task) {
+    GlobPattern* p = walk->pattern;
+    char buffer[32 * 1024];
+    if (task.fd < 0) task.fd = open(task.path[0] ? task.path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool failed = false;
+    while (task.fd >= 0 && !failed && !__atomic_load_n(&walk->failed, __ATOMIC_SEQ_CST)) {
+        long n = syscall(SYS_getdents64, task.fd, buffer, sizeof(buffer));
+        if (n <= 0) break;
+        for (long offset = 0; !failed && offset < n;) {
+            struct glob_dirent64* entry = (struct glob_dirent64*) (buffer + offset);
+            offset += entry->d_reclen;
+            char* name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+            bool is_dir = entry->d_type == DT_DIR, is_link = entry->d_type == DT_LNK;
+            if (entry->d_type == DT_UNKNOWN || is_link) {
+                struct stat st;
+                if (entry->d_type == DT_UNKNOWN && fstatat(task.fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) is_link = S_ISLNK(st.st_mode);
+                is_dir = fstatat(task.fd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+            }
+
+            uint64_t children = 0;
+            bool matched = false;
+            for (size_t i = 0; i < p->count; i++) {
+                if (!(task.states & (1ull << i))) continue;
+                char* component = p->components[i];
+                if (glob_is_globstar(component)) {
+                    // Hidden entries are only matched by name, and symlinks
+                    // aren't followed, so walks always end
+                    if (name[0] == '.') continue;
+                    if (is_dir && !is_link) children |= 1ull << i;
+                    if (i + 1 == p->count) matched = true;
+                } else if (fnmatch(component, name, FNM_PERIOD) == 0) {
+                    if (i + 1 == p->count) matched = true;
+                    else if (is_dir) children |= 1ull << (i + 1);
+                }
+            }
+            if (!matched && children == 0) continue;
+
+            char* path = glob_join(task.path, name);
+            if (path == NULL) { failed = true; break; }
+            if (glob_excluded(walk, path)) { free(path); continue; }
+            if (matched && (!p->dirs_only || is_dir)) {
+                char* match = p->dirs_only ? glob_join(path, "") : strdup(path);
+                if (!glob_list_add(&worker->matches, match)) {
+                    free(match);
+                    free(path);
+                    failed = true;
+                    break;
+                }
+            }
+            if (children == 0) { free(path); continue; }
+
+            // Past GLOB_MAX_PENDING, the directory is opened once it's visited
+            size_t pending = __atomic_add_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST);
+            int fd = pending <= GLOB_MAX_PENDING ? openat(task.fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+            GlobTask child = { .fd = fd, .path = path, .states = glob_closure(p, children) };
+            bool gone = pending <= GLOB_MAX_PENDING && fd < 0;
+            if (gone || !glob_queue(worker, child)) {
+                failed = !gone;
+                __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST);
+                if (fd >= 0) close(fd);
+                free(path);
+                continue;
+            }
+            // Only the calling thread, which owns `started`, starts the pool
+            if (worker == &walk->workers[0] && pending > GLOB_THREADS_AT && walk->started == 1) glob_start(walk);
+        }
+    }
+    if (failed) __atomic_store_n(&walk->failed, true, __ATOMIC_SEQ_CST);
+    if (task.fd >= 0) close(task.fd);
+    free(task.path);
+}
+
+void* glob_worker(void* arg) {
+    GlobThread* thread = arg;
+    GlobWalk* walk = thread->walk;
+    GlobWorker* self = &walk->workers[thread->index];
+    for (;;) {
+        if (__atomic_load_n(&walk->failed, __ATOMIC_SEQ_CST)) return NULL;
+        GlobTask task;
+        bool taken = glob_take(self, &task, false);
+        for (size_t i = 1; !taken && i < walk->workers_count; i++) {
+            taken = glob_take(&walk->workers[(thread->index + i) % walk->workers_count], &task, true);
+        }
+        if (taken) {
+            glob_visit(walk, self, task);
+            __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST);
+        } else if (__atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) == 0) {
+            return NULL;
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+// Appends what matches a single (brace-free) pattern to `matches`
+void glob_walk(GlobPattern* p, GlobPattern* excludes, size_t excludes_count, GlobList* matches) {
+    // Plain leading components are just a directory to start in
+    size_t base_size = p->absolute ? 1 : 0;
+    for (size_t i = 0; i < p->first_wild; i++) base_size += strlen(p->components[i]) + 1;
+    char* base = calloc(base_size + 1, 1);
+    if (base == NULL) error("out of memory");
+    if (p->absolute) strcat(base, "/");
+    for (size_t i = 0; i < p->first_wild; i++) {
+        if (i > 0) strcat(base, "/");
+        strcat(base, p->components[i]);
+    }
+
+    struct stat st;
+    if (p->first_wild == p->count) {
+        if ((p->count > 0 || p->absolute) && stat(base, &st) == 0 && (!p->dirs_only || S_ISDIR(st.st_mode))) {
+            glob_list_push(matches, p->dirs_only ? glob_join(base, "") : glob_strndup(base, strlen(base)));
+        }
+        free(base);
+        return;
+    }
+    int fd = open(base_size > 0 ? base : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) { free(base); return; }
+
+    GlobWalk* walk = calloc(1, sizeof(GlobWalk));
+    if (walk == NULL) error("out of memory");
+    walk->pattern = p;
+    walk->excludes = excludes;
+    walk->excludes_count = excludes_count;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    walk->workers_count = cpus < 1 ? 1 : cpus > GLOB_MAX_THREADS ? GLOB_MAX_THREADS : (size_t) cpus;
+    for (size_t i = 0; i < walk->workers_count; i++) pthread_mutex_init(&walk->workers[i].lock, NULL);
+
+    walk->pending = 1;
+    glob_queue(&walk->workers[0], (GlobTask) { .fd = fd, .path = base, .states = glob_closure(p, 1ull << p->first_wild) });
+
+    // The calling thread is the first worker, and the only one until the
+    // walk turns out to be big
+    for (size_t i = 0; i < walk->workers_count; i++) walk->threads[i] = (GlobThread) { walk, i };
+    walk->started = 1;
+    glob_worker(&walk->threads[0]);
+    for (size_t i = 1; i < walk->started; i++) pthread_join(walk->ids[i], NULL);
+
+    // A walk that failed may leave directories queued
+    for (size_t i = 0; i < walk->workers_count; i++) {
+        GlobWorker* worker = &walk->workers[i];
+        for (size_t j = worker->head; j < worker->size; j++) {
+            if (worker->tasks[j].fd >= 0) close(worker->tasks[j].fd);
+            free(worker->tasks[j].path);
+        }
+        if (!walk->failed) for (size_t j = 0; j < worker->matches.size; j++) glob_list_push(matches, worker->matches.items[j]);
+        else glob_list_free(&worker->matches);
+        free(worker->matches.items);
+        free(worker->tasks);
+        pthread_mutex_destroy(&worker->lock);
+    }
+    bool failed = walk->failed;
+    free(walk);
+    if (failed) error("out of memory");
+}
+
+int glob_compare(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+// Paths matching `pattern` and none of `excludes`, sorted and without repeats
+StringArray* glob_match(String pattern, StringArray* excludes, Arena* a) {
+    GlobList patterns = {0}, exclude_patterns = {0}, matches = {0};
+    char* cpattern = glob_strndup(pattern.bytes, pattern.size);
+    glob_expand_braces(cpattern, &patterns);
+    free(cpattern);
+    array_foreach(excludes, i) {
+        String exclude = StringArray_get(excludes, i);
+        char* cexclude = glob_strndup(exclude.bytes, exclude.size);
+        glob_expand_braces(cexclude, &exclude_patterns);
+        free(cexclude);
+    }
+
+    GlobPattern* parsed_excludes = calloc(exclude_patterns.size + 1, sizeof(GlobPattern));
+    if (parsed_excludes == NULL) error("out of memory");
+    size_t excludes_count = 0;
+    for (size_t i = 0; i < exclude_patterns.size; i++) {
+        GlobPattern* ex = &parsed_excludes[excludes_count];
+        if (!glob_parse(exclude_patterns.items[i], ex)) continue;
+        // Matched paths are compared without a leading `./`
+        while (ex->count > 0 && strcmp(ex->components[0], ".") == 0) {
+            free(ex->components[0]);
+            memmove(ex->components, ex->components + 1, sizeof(char*) * --ex->count);
+        }
+        excludes_count++;
+    }
+    for (size_t i = 0; i < patterns.size; i++) {
+        GlobPattern p;
+        if (glob_parse(patterns.items[i], &p)) glob_walk(&p, parsed_excludes, excludes_count, &matches);
+        glob_pattern_free(&p);
+    }
+    for (size_t i = 0; i < excludes_count; i++) glob_pattern_free(&parsed_excludes[i]);
+    free(parsed_excludes);
+
+    qsort(matches.items, matches.size, sizeof(char*), glob_compare);
+    StringArray* result = StringArray_new(a);
+    for (size_t i = 0; i < matches.size; i++) {
+        if (i > 0 && strcmp(matches.items[i], matches.items[i-1]) == 0) continue;
+        StringBuilder* sb = StringBuilder_new(a);
+        for (char* c = matches.items[i]; *c; c++) StringBuilder_push(sb, *c);
+        StringArray_push(result, sv_from_sb(sb));
+    }
+    glob_list_free(&matches);
+    glob_list_free(&patterns);
+    glob_list_free(&exclude_patterns);
+    return result;
+}
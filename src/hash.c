@@ -0,0 +1,89 @@
+typedef uint64_t Hash;
+
+#define HASH_SEED 0x6d616b6f2d763031ull // "mako-v01"
+#define HASH_HEX_SIZE 16
+
+Hash hash_mix(Hash x) {
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27; x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+Hash hash_bytes(Hash hash, const void* bytes, size_t size) {
+    const unsigned char* p = bytes;
+    hash ^= size * 0x9e3779b97f4a7c15ull;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        hash = hash_mix(hash ^ word) + 0x9e3779b97f4a7c15ull;
+        p += 8;
+        size -= 8;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p, size);
+    return hash_mix(hash ^ tail);
+}
+
+Hash hash_string(Hash hash, String string) {
+    return hash_bytes(hash, string.bytes, string.size);
+}
+
+void hash_hex(Hash hash, char hex[HASH_HEX_SIZE + 1]) {
+    snprintf(hex, HASH_HEX_SIZE + 1, "%016llx", (unsigned long long) hash);
+}
+
+// Open addressing map from strings to indices. Keys aren't copied, they have
+// to outlive the map.
+typedef struct {
+    String key;
+    Hash hash;
+    size_t value;
+    bool used;
+} StringMapSlot;
+
+typedef struct {
+    StringMapSlot* slots;
+    size_t size, capacity;
+} StringMap;
+
+StringMapSlot* StringMap_find(StringMap* map, String key, Hash hash) {
+    size_t mask = map->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        StringMapSlot* slot = &map->slots[i];
+        if (!slot->used) return slot;
+        if (slot->hash == hash && sv_compare(slot->key, key)) return slot;
+    }
+}
+
+bool StringMap_get(StringMap* map, String key, size_t* value) {
+    if (map->size == 0) return false;
+    StringMapSlot* slot = StringMap_find(map, key, hash_string(HASH_SEED, key));
+    if (!slot->used) return false;
+    *value = slot->value;
+    return true;
+}
+
+void StringMap_set(StringMap* map, String key, size_t value) {
+    if ((map->size + 1) * 4 > map->capacity * 3) {
+        StringMap grown = { .capacity = map->capacity == 0 ? 64 : map->capacity * 2 };
+        grown.slots = calloc(grown.capacity, sizeof(StringMapSlot));
+        if (grown.slots == NULL) error("out of memory");
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (!map->slots[i].used) continue;
+            *StringMap_find(&grown, map->slots[i].key, map->slots[i].hash) = map->slots[i];
+            grown.size++;
+        }
+        free(map->slots);
+        *map = grown;
+    }
+    Hash hash = hash_string(HASH_SEED, key);
+    StringMapSlot* slot = StringMap_find(map, key, hash);
+    if (!slot->used) map->size++;
+    *slot = (StringMapSlot) { .key = key, .hash = hash, .value = value, .used = true };
+}
+
+void StringMap_clear(StringMap* map) {
+    free(map->slots);
+    *map = (StringMap) {0};
+}
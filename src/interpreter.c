@@ -4,258 +4,786 @@ typedef enum {
     STACK_ITEM_BOOL,
     STACK_ITEM_INT,
     STACK_ITEM_CMD_MARKER,
+    STACK_ITEM_INPUT,
+    STACK_ITEM_OUTPUT,
+    STACK_ITEM_DEPFILE,
+    STACK_ITEM_EXCLUDE,
     
     COUNT_STACK_ITEMS
 } StackItemType;
 
+// Items are kept to 16 bytes, so that moving them around the stack is cheap:
+// strings are ids of interned strings, and locations are only found through
+// the instruction that pushed the item when an error is reported
 typedef struct {
-    StackItemType type;
-    String string;
-    int number;
-    Location loc;
+    uint32_t type;
+    int32_t number;
+    uint32_t string; // see `interpret_intern`
+    uint32_t origin; // the instruction that pushed it, for error locations
 } StackItem;
 
 array_define(Stack, StackItem)
 array_implement(Stack, StackItem)
 
-void interpret_bytecode(Bytecode* bc) {
-    Stack* stack = Stack_new(&arena);
-    
-    array_foreach(bc, pc) {
-        Operation op = Bytecode_get(bc, pc);
-        if (op.type == OP_PUSH_STRING) Stack_push(stack, (StackItem) { .type = STACK_ITEM_STRING, .string = op.operand, .loc = op.loc });
-        else if (op.type == OP_PUSH_INT) Stack_push(stack, (StackItem) { .type = STACK_ITEM_INT, .number = op.value, .loc = op.loc });
-        else if (op.type == OP_PUSH_BOOL) Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = op.value, .loc = op.loc });
-        else if (op.type == OP_DEBUG) {
-            fprintf(stderr, "DEBUG CRASH\nINITIATED AT "LOC_FMT"\nStack state: %zu items\n", LocFmt(op.loc), stack->size);
-            array_foreach(stack, i) {
-                StackItem si = Stack_get(stack, i);
-                if (si.type == STACK_ITEM_STRING) fprintf(stderr, " `"SV_FMT"` ", SvFmt(si.string));
-                if (si.type == STACK_ITEM_INT) fprintf(stderr, " %d ", si.number);
-                if (si.type == STACK_ITEM_BOOL) fprintf(stderr, " %s ", si.number ? "true" : "false");
-                if (si.type == STACK_ITEM_CMD_MARKER) fprintf(stderr, " CMD MARKER ");
-                fprintf(stderr, "\n");
-            }
-            fprintf(stderr, "STACK ^ TOP\n");
-            exit(2);
-        } else if (op.type == OP_CMD) Stack_push(stack, (StackItem) { .type = STACK_ITEM_CMD_MARKER, .loc = op.loc });
-        else if (op.type == OP_RUN) {
-            if (stack->size == 0) lexer_error(op.loc, "the stack is empty");
-            int cmd_location = 0;
-            for (int i = (int) stack->size-1; i > -1; i--) {
-                StackItem si = Stack_get(stack, i);
-                if (si.type == STACK_ITEM_CMD_MARKER) { cmd_location = i + 1; break; }
-            }
-            StringArray* arguments = StringArray_new(&arena);
-            for (size_t i = cmd_location + 1; i < stack->size; i++) {
-                StackItem si = Stack_get(stack, i);
-                if (si.type != STACK_ITEM_STRING) lexer_error(si.loc, "use of a non-string as an argument");
-                StringArray_push(arguments, si.string);
-            }
-            StackItem si = Stack_get(stack, cmd_location);
-            if (si.type != STACK_ITEM_STRING) lexer_error(si.loc, "use of a non-string as an program name");
-            String program = si.string;
-            stack->size = cmd_location;
-            StringBuilder* cmd = shell_render_command(&arena, program, arguments);
-            printf("CMD: "SV_FMT"\n", SvFmt(sv_from_sb(cmd)));
-            exitcode_t exitcode = shell_run_program(&arena, program, arguments);
-            if (exitcode != 0) error("command exited with non-zero exitcode");
-        } else if (op.type == OP_JUMP) pc = op.location-1;
-        else if (op.type == OP_JUMPZ) {
-            if (stack->size == 0) lexer_error(op.loc, "expected a boolean on the stack, got nothing");
-            StackItem si = Stack_get(stack, stack->size-1);
-            Stack_pop(stack);
-            if (si.type != STACK_ITEM_BOOL) lexer_error(si.loc, "expected a boolean on the stack, got a non-boolean");
-            if (si.number == 0) pc = op.location-1;
-        } else if (op.type == OP_JUMPNZ) {
-            if (stack->size == 0) lexer_error(op.loc, "expected a boolean on the stack, got nothing");
-            StackItem si = Stack_get(stack, stack->size-1);
-            Stack_pop(stack);
-            if (si.type != STACK_ITEM_BOOL) lexer_error(si.loc, "expected a boolean on the stack");
-            if (si.number != 0) pc = op.location-1;
-        } else if (op.type == OP_DUP) {
-            if (stack->size == 0) lexer_error(op.loc, "expected stack to not be empty");
-            StackItem si = Stack_get(stack, stack->size-1);
-            Stack_push(stack, si);
-        } else if (op.type == OP_DROP) {
-            if (stack->size == 0) lexer_error(op.loc, "expected stack to not be empty");
-            Stack_pop(stack);
-        } else if (op.type == OP_SWAP) {
-            if (stack->size <= 1) lexer_error(op.loc, "expected stack to have at least 2 items");
-            StackItem a = Stack_get(stack, stack->size-1);
-            StackItem b = Stack_get(stack, stack->size-2);
-            Stack_pop(stack);
-            Stack_pop(stack);
-            Stack_push(stack, a);
-            Stack_push(stack, b);
-        } else if (op.type == OP_OVER) {
-            if (stack->size <= 1) lexer_error(op.loc, "expected stack to have at least 2 items");
-            StackItem si = Stack_get(stack, stack->size-2);
-            Stack_push(stack, si);
-        } else if (op.type == OP_ROT) {
-            if (stack->size <= 2) lexer_error(op.loc, "expected stack to have at least 3 items");
-            StackItem a = Stack_get(stack, stack->size-1);
-            StackItem b = Stack_get(stack, stack->size-2);
-            StackItem c = Stack_get(stack, stack->size-3);
-            stack->size -= 3;
-            Stack_push(stack, c);
-            Stack_push(stack, a);
-            Stack_push(stack, b);
-        } else if (op.type == OP_NOT) {
-            if (stack->size == 0) lexer_error(op.loc, "expected stack to not be empty");
-            StackItem si = Stack_get(stack, stack->size-1);
-            if (si.type != STACK_ITEM_BOOL) lexer_error(op.loc, "expected a boolean on the stack");
-            Stack_pop(stack);
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = !si.number, .loc = op.loc });
-        } else if (op.type == OP_GTEQ) {
-            if (stack->size <= 1) lexer_error(op.loc, "expected stack to have at least 2 items");
-            StackItem b = Stack_get(stack, stack->size-1);
-            StackItem a = Stack_get(stack, stack->size-2);
-            if (a.type != STACK_ITEM_INT || b.type != STACK_ITEM_INT) lexer_error(op.loc, "expected both values to be integers");
-            Stack_pop(stack);
-            Stack_pop(stack);
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = a.number >= b.number, .loc = op.loc });
-        } else if (op.type == OP_LTEQ) {
-            if (stack->size <= 1) lexer_error(op.loc, "expected stack to have at least 2 items");
-            StackItem b = Stack_get(stack, stack->size-1);
-            StackItem a = Stack_get(stack, stack->size-2);
-            if (a.type != STACK_ITEM_INT || b.type != STACK_ITEM_INT) lexer_error(op.loc, "expected both values to be integers");
-            Stack_pop(stack);
-            Stack_pop(stack);
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = a.number <= b.number, .loc = op.loc });
-        } else if (op.type == OP_GT) {
-            if (stack->size <= 1) lexer_error(op.loc, "expected stack to have at least 2 items");
-            StackItem b = Stack_get(stack, stack->size-1);
-            StackItem a = Stack_get(stack, stack->size-2);
-            if (a.type != STACK_ITEM_INT || b.type != STACK_ITEM_INT) lexer_error(op.loc, "expected both values to be integers");
-            Stack_pop(stack);
-            Stack_pop(stack);
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = a.number > b.number, .loc = op.loc });
-        } else if (op.type == OP_LT) {
-            if (stack->size <= 1) lexer_error(op.loc, "expected stack to have at least 2 items");
-            StackItem b = Stack_get(stack, stack->size-1);
-            StackItem a = Stack_get(stack, stack->size-2);
-            if (a.type != STACK_ITEM_INT || b.type != STACK_ITEM_INT) lexer_error(op.loc, "expected both values to be integers");
-            Stack_pop(stack);
-            Stack_pop(stack);
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = a.number < b.number, .loc = op.loc });
-        } else if (op.type == OP_EQ) {
-            if (stack->size <= 1) lexer_error(op.loc, "expected stack to have at least 2 items");
-            StackItem b = Stack_get(stack, stack->size-1);
-            StackItem a = Stack_get(stack, stack->size-2);
-            if (a.type != STACK_ITEM_INT || b.type != STACK_ITEM_INT) lexer_error(op.loc, "expected both values to be integers");
-            Stack_pop(stack);
-            Stack_pop(stack);
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = a.number == b.number, .loc = op.loc });
-        } else if (op.type == OP_ADD) {
-            if (stack->size <= 1) lexer_error(op.loc, "expected stack to have at least 2 items");
-            StackItem b = Stack_get(stack, stack->size-1);
-            StackItem a = Stack_get(stack, stack->size-2);
-            if (a.type != STACK_ITEM_INT || b.type != STACK_ITEM_INT) lexer_error(op.loc, "expected both values to be integers");
-            Stack_pop(stack);
-            Stack_pop(stack);
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_INT, .number = a.number + b.number, .loc = op.loc });
-        } else if (op.type == OP_SUB) {
-            if (stack->size <= 1) lexer_error(op.loc, "expected stack to have at least 2 items");
-            StackItem b = Stack_get(stack, stack->size-1);
-            StackItem a = Stack_get(stack, stack->size-2);
-            if (a.type != STACK_ITEM_INT || b.type != STACK_ITEM_INT) lexer_error(op.loc, "expected both values to be integers");
-            Stack_pop(stack);
-            Stack_pop(stack);
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_INT, .number = a.number - b.number, .loc = op.loc });
-        } else if (op.type == OP_MUL) {
-            if (stack->size <= 1) lexer_error(op.loc, "expected stack to have at least 2 items");
-            StackItem b = Stack_get(stack, stack->size-1);
-            StackItem a = Stack_get(stack, stack->size-2);
-            if (a.type != STACK_ITEM_INT || b.type != STACK_ITEM_INT) lexer_error(op.loc, "expected both values to be integers");
-            Stack_pop(stack);
-            Stack_pop(stack);
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_INT, .number = a.number * b.number, .loc = op.loc });
-        } else if (op.type == OP_DIV) {
-            if (stack->size <= 1) lexer_error(op.loc, "expected stack to have at least 2 items");
-            StackItem b = Stack_get(stack, stack->size-1);
-            StackItem a = Stack_get(stack, stack->size-2);
-            if (a.type != STACK_ITEM_INT || b.type != STACK_ITEM_INT) lexer_error(op.loc, "expected both values to be integers");
-            Stack_pop(stack);
-            Stack_pop(stack);
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_INT, .number = a.number / b.number, .loc = op.loc });
-        } else if (op.type == OP_FILEEXISTS) {
-            if (stack->size == 0) lexer_error(op.loc, "expected stack to not be empty");
-            StackItem si = Stack_get(stack, stack->size-1);
-            if (si.type != STACK_ITEM_STRING) lexer_error(op.loc, "expected a string on the stack");
-            bool exists = file_exists(si.string);
-            Stack_pop(stack);
-            printf("FILEIO: file `"SV_FMT"` %s\n", SvFmt(si.string), exists ? "exists" : "doesn't exist");
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = exists, .loc = op.loc });
-        } else if (op.type == OP_DIREXISTS) {
-            if (stack->size == 0) lexer_error(op.loc, "expected stack to not be empty");
-            StackItem si = Stack_get(stack, stack->size-1);
-            if (si.type != STACK_ITEM_STRING) lexer_error(op.loc, "expected a string on the stack");
-            bool exists = dir_exists(si.string);
-            Stack_pop(stack);
-            printf("FILEIO: directory `"SV_FMT"` %s\n", SvFmt(si.string), exists ? "exists" : "doesn't exist");
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = exists, .loc = op.loc });
-        } else if (op.type == OP_MKDIR) {
-            if (stack->size == 0) lexer_error(op.loc, "expected stack to not be empty");
-            StackItem si = Stack_get(stack, stack->size-1);
-            if (si.type != STACK_ITEM_STRING) lexer_error(op.loc, "expected a string on the stack");
-            dir_make_directory(si.string);
-            Stack_pop(stack);
-            printf("FILEIO: created directory `"SV_FMT"`\n", SvFmt(si.string));
-        } else if (op.type == OP_CD) {
-            if (stack->size == 0) lexer_error(op.loc, "expected stack to not be empty");
-            StackItem si = Stack_get(stack, stack->size-1);
-            if (si.type != STACK_ITEM_STRING) lexer_error(op.loc, "expected a string on the stack");
-            dir_change_cwd(si.string);
-            Stack_pop(stack);
-            printf("FILEIO: changed cwd to `"SV_FMT"`\n", SvFmt(si.string));
-        } else if (op.type == OP_GETCWD) {
-            String cwd = dir_get_cwd(&arena);
-            Stack_pop(stack);
-            printf("FILEIO: cwd = `"SV_FMT"`\n", SvFmt(cwd));
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_STRING, .string = cwd, .loc = op.loc });
-        } else if (op.type == OP_LISTDIR) {
-            if (stack->size == 0) lexer_error(op.loc, "expected stack to not be empty");
+// Strings made while running share an id when they are equal, so a loop
+// pushing the same string over and over doesn't grow the table; they are
+// copied out with `scratch_keep`, as what made them is usually temporary.
+// Operands of the program get an id each up front, without hashing them.
+StringArray* interpret_strings = NULL;
+StringMap interpret_string_ids = {0};
+
+uint32_t interpret_add_string(String string) {
+    if (interpret_strings == NULL) interpret_strings = StringArray_new(&arena);
+    if (interpret_strings->size >= INT32_MAX) error("too many strings");
+    StringArray_push(interpret_strings, string);
+    return interpret_strings->size - 1;
+}
+
+uint32_t interpret_intern(String string) {
+    size_t id;
+    if (StringMap_get(&interpret_string_ids, string, &id)) return id;
+    string = scratch_keep(string);
+    id = interpret_add_string(string);
+    StringMap_set(&interpret_string_ids, string, id);
+    return id;
+}
+
+String interpret_string(StackItem si) {
+    return StringArray_get(interpret_strings, si.string);
+}
+
+// Bytecode is run from a compact copy of it: everything an instruction needs
+// on every step fits in `Instruction`, while operands and locations live in
+// side tables, read only by the few ops that push strings and on errors.
+typedef struct {
+    uint16_t type;
+    bool verified; // operands were proven to be fine, see `verify_program`
+    int32_t value; // for `OP_PUSH_STRING`, the id of its operand
+    uint32_t location;
+} Instruction;
+
+typedef struct {
+    Instruction* code;
+    String* operands;
+    Location* locs;
+    size_t size;
+} Program;
+
+Program interpret_compile(Bytecode* bc) {
+    if (bc->size > UINT32_MAX) error("the recipe is too big");
+    Program p = {
+        .code = malloc(sizeof(Instruction) * (bc->size + 1)),
+        .operands = malloc(sizeof(String) * (bc->size + 1)),
+        .locs = malloc(sizeof(Location) * (bc->size + 1)),
+        .size = bc->size,
+    };
+    if (p.code == NULL || p.operands == NULL || p.locs == NULL) error("out of memory");
+    array_foreach(bc, i) {
+        Operation op = Bytecode_get(bc, i);
+        p.code[i] = (Instruction) { .type = op.type, .value = op.value, .location = op.location };
+        if (op.type == OP_PUSH_STRING) p.code[i].value = interpret_add_string(op.operand);
+        p.operands[i] = op.operand;
+        p.locs[i] = op.loc;
+    }
+    return p;
+}
+
+Command interpret_pop_command(Program* p, Stack* stack, size_t pc) {
+    Location loc = p->locs[pc];
+    if (stack->size == 0) lexer_error(loc, "the stack is empty");
+    size_t cmd_location = 0;
+    for (size_t i = stack->size; i > 0; i--) {
+        StackItem si = Stack_get(stack, i-1);
+        if (si.type == STACK_ITEM_CMD_MARKER) { cmd_location = i; break; }
+    }
+    if (cmd_location == stack->size) lexer_error(loc, "expected a program name after `cmd`");
+    Arena* scratch = scratch_new();
+    Command command = {
+        .arguments = StringArray_new(scratch),
+        .inputs = StringArray_new(scratch),
+        .outputs = StringArray_new(scratch),
+        .loc = loc,
+        .arena = scratch,
+    };
+    for (size_t i = cmd_location + 1; i < stack->size; i++) {
+        StackItem si = Stack_get(stack, i);
+        if (si.type == STACK_ITEM_INPUT) StringArray_push(command.inputs, interpret_string(si));
+        else if (si.type == STACK_ITEM_OUTPUT) StringArray_push(command.outputs, interpret_string(si));
+        else if (si.type == STACK_ITEM_DEPFILE) {
+            if (command.depfile.size > 0) lexer_error(p->locs[si.origin], "a command can only have one depfile");
+            command.depfile = interpret_string(si);
+        }
+        else if (si.type != STACK_ITEM_STRING) lexer_error(p->locs[si.origin], "use of a non-string as an argument");
+        StringArray_push(command.arguments, interpret_string(si));
+    }
+    StackItem si = Stack_get(stack, cmd_location);
+    if (si.type != STACK_ITEM_STRING) lexer_error(p->locs[si.origin], "use of a non-string as an program name");
+    command.program = interpret_string(si);
+    CommandKind kind = cmd_location > 0 ? Stack_get(stack, cmd_location-1).number : COMMAND_CMD;
+    command.memo = kind == COMMAND_MEMO;
+    command.remote = kind == COMMAND_REMOTE;
+    command.macro = p->operands[pc];
+    if (command.depfile.size > 0 && command.outputs->size == 0) lexer_error(loc, "a command with a depfile has to declare an output");
+    stack->size = cmd_location > 0 ? cmd_location - 1 : 0;
+    return command;
+}
+
+typedef struct {
+    Stack* stack;
+    size_t pc;
+    U32Array* returns; // return addresses of macro calls
+    U32Array* jobs; // spawned by this interpreter, some may have finished already
+    size_t waiting_for; // a job that has to finish before resuming, 0 if none
+    bool waiting_all; // all of `jobs` have to finish before resuming
+    bool in_target, done;
+} Interpreter;
+
+Interpreter interpret_new(size_t pc, bool in_target) {
+    return (Interpreter) {
+        .stack = Stack_new(&arena),
+        .pc = pc,
+        .returns = U32Array_new(&arena),
+        .jobs = U32Array_new(&arena),
+        .in_target = in_target,
+    };
+}
+
+bool interpret_jobs_running(Interpreter* in) {
+    size_t running = 0;
+    array_foreach(in->jobs, i) {
+        uint32_t id = U32Array_get(in->jobs, i);
+        if (jobs_is_running(id)) U32Array_set(in->jobs, running++, id);
+    }
+    in->jobs->size = running;
+    return running > 0;
+}
+
+bool interpret_blocked(Interpreter* in) {
+    if (in->waiting_for != 0 && jobs_is_running(in->waiting_for)) return true;
+    if (in->waiting_all && interpret_jobs_running(in)) return true;
+    return false;
+}
+
+typedef enum {
+    TARGET_IDLE = 0,
+    TARGET_VISITING,
+    TARGET_WANTED,
+    TARGET_RUNNING,
+    TARGET_DONE,
+} TargetState;
+
+typedef struct {
+    String name;
+    size_t deps, deps_count; // dependency names are operands of `deps_count` instructions at `deps`
+    Location loc;
+    TargetState state;
+    Interpreter in;
+} Target;
+
+array_define(TargetArray, Target)
+array_implement(TargetArray, Target)
+
+TargetArray* targets = NULL;
+StringMap target_ids = {0};
+
+// With GCC and clang, every handler jumps straight to the next one through a
+// table of label addresses instead of going back to a shared switch
+#if defined(__GNUC__) && !defined(MAKO_NO_THREADED_DISPATCH)
+#define INTERPRET_THREADED
+#endif
+
+#ifdef INTERPRET_THREADED
+#define INTERPRET_OP(type) label_##type
+#define INTERPRET_NEXT() do { if (++pc >= size) goto end; goto *dispatch[code[pc].type]; } while (0)
+#else
+#define INTERPRET_OP(type) case type
+#define INTERPRET_NEXT() continue
+#endif
+
+// Integer operations replace their two operands with the result in place
+#define INTERPRET_BINARY(op, result_type, result) \
+    INTERPRET_OP(op): { \
+        if (!code[pc].verified && stack->size <= 1) lexer_error(locs[pc], "expected stack to have at least 2 items"); \
+        StackItem b = Stack_get(stack, stack->size-1); \
+        StackItem a = Stack_get(stack, stack->size-2); \
+        if (!code[pc].verified && (a.type != STACK_ITEM_INT || b.type != STACK_ITEM_INT)) lexer_error(locs[pc], "expected both values to be integers"); \
+        stack->size--; \
+        Stack_set(stack, stack->size-1, (StackItem) { .type = result_type, .number = result, .origin = pc }); \
+        INTERPRET_NEXT(); \
+    }
+
+#ifdef INTERPRET_THREADED
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// Runs until the end of the program or of a target, or until it has to wait
+// for a job to finish. Waiting is up to the caller, see `interpret_blocked`.
+void interpret(Interpreter* in, Program* p) {
+#ifdef INTERPRET_THREADED
+    static void* labels[COUNT_OPS] = {
+        [OP_NOP] = &&label_OP_NOP,
+        [OP_PUSH_STRING] = &&label_OP_PUSH_STRING,
+        [OP_PUSH_INT] = &&label_OP_PUSH_INT,
+        [OP_PUSH_BOOL] = &&label_OP_PUSH_BOOL,
+        [OP_DEBUG] = &&label_OP_DEBUG,
+        [OP_CMD] = &&label_OP_CMD,
+        [OP_MEMO] = &&label_OP_MEMO,
+        [OP_REMOTE] = &&label_OP_REMOTE,
+        [OP_RUN] = &&label_OP_RUN,
+        [OP_SPAWN] = &&label_OP_SPAWN,
+        [OP_CAPTURE] = &&label_OP_CAPTURE,
+        [OP_CAPTUREWORDS] = &&label_OP_CAPTUREWORDS,
+        [OP_WAIT] = &&label_OP_WAIT,
+        [OP_WAITALL] = &&label_OP_WAITALL,
+        [OP_JUMP] = &&label_OP_JUMP,
+        [OP_JUMPZ] = &&label_OP_JUMPZ,
+        [OP_JUMPNZ] = &&label_OP_JUMPNZ,
+        [OP_TARGET] = &&label_OP_TARGET,
+        [OP_CALL] = &&label_OP_CALL,
+        [OP_RET] = &&label_OP_RET,
+        [OP_GTEQ] = &&label_OP_GTEQ,
+        [OP_LTEQ] = &&label_OP_LTEQ,
+        [OP_GT] = &&label_OP_GT,
+        [OP_LT] = &&label_OP_LT,
+        [OP_EQ] = &&label_OP_EQ,
+        [OP_ADD] = &&label_OP_ADD,
+        [OP_SUB] = &&label_OP_SUB,
+        [OP_MUL] = &&label_OP_MUL,
+        [OP_DIV] = &&label_OP_DIV,
+        [OP_DUP] = &&label_OP_DUP,
+        [OP_DROP] = &&label_OP_DROP,
+        [OP_SWAP] = &&label_OP_SWAP,
+        [OP_OVER] = &&label_OP_OVER,
+        [OP_ROT] = &&label_OP_ROT,
+        [OP_NOT] = &&label_OP_NOT,
+        [OP_FILEEXISTS] = &&label_OP_FILEEXISTS,
+        [OP_DIREXISTS] = &&label_OP_DIREXISTS,
+        [OP_MKDIR] = &&label_OP_MKDIR,
+        [OP_CD] = &&label_OP_CD,
+        [OP_GETCWD] = &&label_OP_GETCWD,
+        [OP_LISTDIR] = &&label_OP_LISTDIR,
+        [OP_FNMATCH] = &&label_OP_FNMATCH,
+        [OP_NEWER] = &&label_OP_NEWER,
+        [OP_UPTODATE] = &&label_OP_UPTODATE,
+        [OP_INPUT] = &&label_OP_INPUT,
+        [OP_OUTPUT] = &&label_OP_OUTPUT,
+        [OP_DEPFILE] = &&label_OP_DEPFILE,
+        [OP_EXCLUDE] = &&label_OP_EXCLUDE,
+        [OP_COPY] = &&label_OP_COPY,
+        [OP_COPYDIR] = &&label_OP_COPYDIR,
+        [OP_REMOVE] = &&label_OP_REMOVE,
+        [OP_REMOVEDIR] = &&label_OP_REMOVEDIR,
+        [OP_RENAME] = &&label_OP_RENAME,
+        [OP_TOUCH] = &&label_OP_TOUCH,
+        [OP_WRITE] = &&label_OP_WRITE,
+        [OP_LOG] = &&label_OP_LOG,
+        [OP_ERROR] = &&label_OP_ERROR,
+        [OP_PRINT] = &&label_OP_PRINT,
+    };
+    // With `--profile`, every operation is counted on its way to the handler
+    static void* counted[COUNT_OPS] = { [0 ... COUNT_OPS-1] = &&label_profile };
+    void** dispatch = profile_ops != NULL ? counted : labels;
+#endif
+    Stack* stack = in->stack;
+    Instruction* code = p->code;
+    Location* locs = p->locs;
+    size_t size = p->size;
+    size_t pc = in->pc;
+    in->waiting_for = 0;
+    in->waiting_all = false;
+
+#ifdef INTERPRET_THREADED
+    if (pc >= size) goto end;
+    goto *dispatch[code[pc].type];
+label_profile:
+    profile_ops[code[pc].type]++;
+    goto *labels[code[pc].type];
+#else
+    for (;; pc++) {
+        if (pc >= size) goto end;
+        if (profile_ops != NULL) profile_ops[code[pc].type]++;
+        switch (code[pc].type) {
+#endif
+
+    INTERPRET_OP(OP_NOP):
+        INTERPRET_NEXT();
+    INTERPRET_OP(OP_PUSH_STRING):
+        Stack_push(stack, (StackItem) { .type = STACK_ITEM_STRING, .string = code[pc].value, .origin = pc });
+        INTERPRET_NEXT();
+    INTERPRET_OP(OP_PUSH_INT):
+        Stack_push(stack, (StackItem) { .type = STACK_ITEM_INT, .number = code[pc].value, .origin = pc });
+        INTERPRET_NEXT();
+    INTERPRET_OP(OP_PUSH_BOOL):
+        Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = code[pc].value, .origin = pc });
+        INTERPRET_NEXT();
+    INTERPRET_OP(OP_DEBUG):
+        fprintf(stderr, "DEBUG CRASH\nINITIATED AT "LOC_FMT"\nStack state: %zu items\n", LocFmt(locs[pc]), stack->size);
+        array_foreach(stack, i) {
+            StackItem si = Stack_get(stack, i);
+            if (si.type == STACK_ITEM_STRING) fprintf(stderr, " `"SV_FMT"` ", SvFmt(interpret_string(si)));
+            if (si.type == STACK_ITEM_INT) fprintf(stderr, " %d ", si.number);
+            if (si.type == STACK_ITEM_BOOL) fprintf(stderr, " %s ", si.number ? "true" : "false");
+            if (si.type == STACK_ITEM_CMD_MARKER) fprintf(stderr, si.number == COMMAND_MEMO ? " MEMO MARKER " : si.number == COMMAND_REMOTE ? " REMOTE MARKER " : " CMD MARKER ");
+            if (si.type == STACK_ITEM_INPUT) fprintf(stderr, " input `"SV_FMT"` ", SvFmt(interpret_string(si)));
+            if (si.type == STACK_ITEM_OUTPUT) fprintf(stderr, " output `"SV_FMT"` ", SvFmt(interpret_string(si)));
+            if (si.type == STACK_ITEM_DEPFILE) fprintf(stderr, " depfile `"SV_FMT"` ", SvFmt(interpret_string(si)));
+            if (si.type == STACK_ITEM_EXCLUDE) fprintf(stderr, " exclude `"SV_FMT"` ", SvFmt(interpret_string(si)));
+            fprintf(stderr, "\n");
+        }
+        fprintf(stderr, "STACK ^ TOP\n");
+        jobs_kill_all();
+        exit(2);
+    INTERPRET_OP(OP_CMD):
+    INTERPRET_OP(OP_MEMO):
+    INTERPRET_OP(OP_REMOTE): {
+        // A `memo` marker is a `cmd` marker that lets `capture` remember
+        // output, and a `remote` one lets the command run on a worker
+        CommandKind kind = code[pc].type == OP_MEMO ? COMMAND_MEMO : code[pc].type == OP_REMOTE ? COMMAND_REMOTE : COMMAND_CMD;
+        Stack_push(stack, (StackItem) { .type = STACK_ITEM_CMD_MARKER, .number = kind, .origin = pc });
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_RUN): {
+        Command command = interpret_pop_command(p, stack, pc);
+        if (command.memo) lexer_error(locs[pc], "only the output of a command can be memoized, use `capture`");
+        size_t id = jobs_spawn(command);
+        U32Array_push(in->jobs, id);
+        if (jobs_is_running(id)) {
+            in->waiting_for = id;
+            in->pc = pc + 1;
+            return;
+        }
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_SPAWN): {
+        Command command = interpret_pop_command(p, stack, pc);
+        if (command.memo) lexer_error(locs[pc], "only the output of a command can be memoized, use `capture`");
+        size_t id = jobs_spawn(command);
+        U32Array_push(in->jobs, id);
+        Stack_push(stack, (StackItem) { .type = STACK_ITEM_INT, .number = id, .origin = pc });
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_CAPTURE):
+    INTERPRET_OP(OP_CAPTUREWORDS): {
+        Command command = interpret_pop_command(p, stack, pc);
+        String cmd = command_render(command);
+        String output;
+        // Only declared inputs are part of the key: nothing is recorded from a depfile of a capture
+        if (command.memo && command.depfile.size > 0) lexer_error(locs[pc], "a memoized command can't have a depfile, declare its inputs with `input`");
+        if (command.memo && cache_enabled && cache_capture_load(command, cmd, &output, command.arena)) {
+            printf("CMD: "SV_FMT" (memoized)\n", SvFmt(cmd));
+        } else {
+            output = jobs_capture(command, cmd);
+            if (command.memo && cache_enabled) cache_capture_store(command, cmd, output);
+        }
+        if (code[pc].type == OP_CAPTURE) {
+            // Like `$(...)` in a shell, trailing newlines are dropped
+            while (output.size > 0 && sv_index(output, output.size-1) == '\n') output.size--;
+            Stack_push(stack, (StackItem) { .type = STACK_ITEM_STRING, .string = interpret_intern(output), .origin = pc });
+            scratch_free(command.arena);
+            INTERPRET_NEXT();
+        }
+        int words = 0;
+        for (size_t i = 0; i < output.size;) {
+            while (i < output.size && isspace((unsigned char) sv_index(output, i))) i++;
+            size_t start = i;
+            while (i < output.size && !isspace((unsigned char) sv_index(output, i))) i++;
+            if (i == start) break;
+            Stack_push(stack, (StackItem) { .type = STACK_ITEM_STRING, .string = interpret_intern(sv_from_bytes(output.bytes + start, i - start)), .origin = pc });
+            words++;
+        }
+        Stack_push(stack, (StackItem) { .type = STACK_ITEM_INT, .number = words, .origin = pc });
+        scratch_free(command.arena);
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_WAIT): {
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        StackItem si = Stack_get(stack, stack->size-1);
+        if (!code[pc].verified && si.type != STACK_ITEM_INT) lexer_error(locs[pc], "expected a job handle on the stack");
+        if (si.number <= 0 || (size_t) si.number >= jobs_next_id) lexer_error(locs[si.origin], "no such job as %d", si.number);
+        Stack_pop(stack);
+        if (jobs_is_running(si.number)) {
+            in->waiting_for = si.number;
+            in->pc = pc + 1;
+            return;
+        }
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_WAITALL):
+        if (interpret_jobs_running(in)) {
+            in->waiting_all = true;
+            in->pc = pc + 1;
+            return;
+        }
+        INTERPRET_NEXT();
+    INTERPRET_OP(OP_CALL):
+        U32Array_push(in->returns, pc + 1);
+        pc = code[pc].location-1;
+        INTERPRET_NEXT();
+    INTERPRET_OP(OP_RET):
+        if (in->returns->size > 0) {
+            pc = U32Array_get(in->returns, in->returns->size-1) - 1;
+            U32Array_pop(in->returns);
+            INTERPRET_NEXT();
+        }
+        // End of a target; it's only done once everything it spawned is
+        in->pc = pc;
+        if (interpret_jobs_running(in)) in->waiting_all = true;
+        else in->done = true;
+        return;
+    INTERPRET_OP(OP_TARGET): {
+        if (in->in_target) lexer_error(locs[pc], "targets can't be defined inside other targets");
+        size_t existing;
+        if (StringMap_get(&target_ids, p->operands[pc], &existing)) lexer_error(locs[pc], "target redefinition");
+        StringMap_set(&target_ids, p->operands[pc], targets->size);
+        TargetArray_push(targets, (Target) { .name = p->operands[pc], .deps = pc + 1, .deps_count = code[pc].value, .loc = locs[pc] });
+        pc = code[pc].location-1;
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_JUMP):
+        pc = code[pc].location-1;
+        INTERPRET_NEXT();
+    INTERPRET_OP(OP_JUMPZ): {
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected a boolean on the stack, got nothing");
+        StackItem si = Stack_get(stack, stack->size-1);
+        Stack_pop(stack);
+        if (!code[pc].verified && si.type != STACK_ITEM_BOOL) lexer_error(locs[si.origin], "expected a boolean on the stack, got a non-boolean");
+        if (si.number == 0) pc = code[pc].location-1;
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_JUMPNZ): {
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected a boolean on the stack, got nothing");
+        StackItem si = Stack_get(stack, stack->size-1);
+        Stack_pop(stack);
+        if (!code[pc].verified && si.type != STACK_ITEM_BOOL) lexer_error(locs[si.origin], "expected a boolean on the stack");
+        if (si.number != 0) pc = code[pc].location-1;
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_DUP):
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        Stack_push(stack, Stack_get(stack, stack->size-1));
+        INTERPRET_NEXT();
+    INTERPRET_OP(OP_DROP):
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        Stack_pop(stack);
+        INTERPRET_NEXT();
+    INTERPRET_OP(OP_SWAP): {
+        if (!code[pc].verified && stack->size <= 1) lexer_error(locs[pc], "expected stack to have at least 2 items");
+        StackItem a = Stack_get(stack, stack->size-1);
+        StackItem b = Stack_get(stack, stack->size-2);
+        Stack_set(stack, stack->size-1, b);
+        Stack_set(stack, stack->size-2, a);
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_OVER):
+        if (!code[pc].verified && stack->size <= 1) lexer_error(locs[pc], "expected stack to have at least 2 items");
+        Stack_push(stack, Stack_get(stack, stack->size-2));
+        INTERPRET_NEXT();
+    INTERPRET_OP(OP_ROT): {
+        if (!code[pc].verified && stack->size <= 2) lexer_error(locs[pc], "expected stack to have at least 3 items");
+        StackItem a = Stack_get(stack, stack->size-1);
+        StackItem b = Stack_get(stack, stack->size-2);
+        StackItem c = Stack_get(stack, stack->size-3);
+        Stack_set(stack, stack->size-3, c);
+        Stack_set(stack, stack->size-2, a);
+        Stack_set(stack, stack->size-1, b);
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_NOT): {
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        StackItem si = Stack_get(stack, stack->size-1);
+        if (!code[pc].verified && si.type != STACK_ITEM_BOOL) lexer_error(locs[pc], "expected a boolean on the stack");
+        Stack_set(stack, stack->size-1, (StackItem) { .type = STACK_ITEM_BOOL, .number = !si.number, .origin = pc });
+        INTERPRET_NEXT();
+    }
+    INTERPRET_BINARY(OP_GTEQ, STACK_ITEM_BOOL, a.number >= b.number)
+    INTERPRET_BINARY(OP_LTEQ, STACK_ITEM_BOOL, a.number <= b.number)
+    INTERPRET_BINARY(OP_GT, STACK_ITEM_BOOL, a.number > b.number)
+    INTERPRET_BINARY(OP_LT, STACK_ITEM_BOOL, a.number < b.number)
+    INTERPRET_BINARY(OP_EQ, STACK_ITEM_BOOL, a.number == b.number)
+    INTERPRET_BINARY(OP_ADD, STACK_ITEM_INT, a.number + b.number)
+    INTERPRET_BINARY(OP_SUB, STACK_ITEM_INT, a.number - b.number)
+    INTERPRET_BINARY(OP_MUL, STACK_ITEM_INT, a.number * b.number)
+    INTERPRET_BINARY(OP_DIV, STACK_ITEM_INT, a.number / b.number)
+    INTERPRET_OP(OP_FILEEXISTS): {
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        StackItem si = Stack_get(stack, stack->size-1);
+        if (!code[pc].verified && si.type != STACK_ITEM_STRING) lexer_error(locs[pc], "expected a string on the stack");
+        String string = interpret_string(si);
+        bool exists = fs_file_exists(string);
+        Stack_pop(stack);
+        printf("FILEIO: file `"SV_FMT"` %s\n", SvFmt(string), exists ? "exists" : "doesn't exist");
+        Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = exists, .origin = pc });
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_DIREXISTS): {
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        StackItem si = Stack_get(stack, stack->size-1);
+        if (!code[pc].verified && si.type != STACK_ITEM_STRING) lexer_error(locs[pc], "expected a string on the stack");
+        String string = interpret_string(si);
+        bool exists = fs_dir_exists(string);
+        Stack_pop(stack);
+        printf("FILEIO: directory `"SV_FMT"` %s\n", SvFmt(string), exists ? "exists" : "doesn't exist");
+        Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = exists, .origin = pc });
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_MKDIR): {
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        StackItem si = Stack_get(stack, stack->size-1);
+        if (!code[pc].verified && si.type != STACK_ITEM_STRING) lexer_error(locs[pc], "expected a string on the stack");
+        String string = interpret_string(si);
+        dir_make_directory(string);
+        fs_invalidate(string);
+        Stack_pop(stack);
+        printf("FILEIO: created directory `"SV_FMT"`\n", SvFmt(string));
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_CD): {
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        StackItem si = Stack_get(stack, stack->size-1);
+        if (!code[pc].verified && si.type != STACK_ITEM_STRING) lexer_error(locs[pc], "expected a string on the stack");
+        String string = interpret_string(si);
+        dir_change_cwd(string);
+        fs_invalidate_all(); // relative paths mean something else now
+        fs_seeing = false; // and `--watch` would look for them in the wrong place
+        Stack_pop(stack);
+        printf("FILEIO: changed cwd to `"SV_FMT"`\n", SvFmt(string));
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_GETCWD): {
+        Arena* scratch = scratch_begin();
+        String cwd = dir_get_cwd(scratch);
+        printf("FILEIO: cwd = `"SV_FMT"`\n", SvFmt(cwd));
+        Stack_push(stack, (StackItem) { .type = STACK_ITEM_STRING, .string = interpret_intern(cwd), .origin = pc });
+        scratch_end(scratch);
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_LISTDIR):
+    INTERPRET_OP(OP_FNMATCH): {
+        bool listdir = code[pc].type == OP_LISTDIR;
+        // `fnmatch` takes the patterns marked with `exclude` above its own
+        Arena* scratch = scratch_begin();
+        StringArray* excludes = StringArray_new(scratch);
+        while (!listdir && stack->size > 0 && Stack_get(stack, stack->size-1).type == STACK_ITEM_EXCLUDE) {
+            StringArray_push(excludes, interpret_string(Stack_get(stack, stack->size-1)));
+            Stack_pop(stack);
+        }
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        StackItem si = Stack_get(stack, stack->size-1);
+        if (!code[pc].verified && si.type != STACK_ITEM_STRING) lexer_error(locs[pc], "expected a string on the stack");
+        String string = interpret_string(si);
+        Stack_pop(stack);
+        StringArray* content = listdir ? fs_list(string) : fs_fnmatch(string, excludes);
+        printf("FILEIO: %s `"SV_FMT"`\n", listdir ? "listed" : "fnmatched", SvFmt(string));
+        array_foreach(content, i) {
+            String dir = StringArray_get(content, i);
+            Stack_push(stack, (StackItem) { .type = STACK_ITEM_STRING, .string = interpret_intern(dir), .origin = pc });
+        }
+        Stack_push(stack, (StackItem) { .type = STACK_ITEM_INT, .number = content->size, .origin = pc });
+        scratch_end(scratch);
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_NEWER): {
+        if (!code[pc].verified && stack->size <= 1) lexer_error(locs[pc], "expected stack to have at least 2 items");
+        StackItem b = Stack_get(stack, stack->size-1);
+        StackItem a = Stack_get(stack, stack->size-2);
+        if (!code[pc].verified && (a.type != STACK_ITEM_STRING || b.type != STACK_ITEM_STRING)) lexer_error(locs[pc], "expected both values to be strings");
+        String first = interpret_string(a), second = interpret_string(b);
+        Stack_pop(stack);
+        Stack_pop(stack);
+        bool newer = fs_newer(first, second);
+        printf("FILEIO: `"SV_FMT"` is %s than `"SV_FMT"`\n", SvFmt(first), newer ? "newer" : "not newer", SvFmt(second));
+        Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = newer, .origin = pc });
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_UPTODATE): {
+        if (stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        StackItem n = Stack_get(stack, stack->size-1);
+        if (n.type != STACK_ITEM_INT) lexer_error(locs[pc], "expected an input count on the stack");
+        if (n.number < 0 || (size_t) n.number + 2 > stack->size) lexer_error(locs[pc], "expected stack to have at least %d items", n.number + 2);
+        Stack_pop(stack);
+        Arena* scratch = scratch_begin();
+        StringArray* inputs = StringArray_new(scratch);
+        for (int i = 0; i < n.number; i++) {
             StackItem si = Stack_get(stack, stack->size-1);
-            if (si.type != STACK_ITEM_STRING) lexer_error(op.loc, "expected a string on the stack");
-            Stack_pop(stack);
-            StringArray* content = dir_list(si.string, &arena);
-            printf("FILEIO: listed `"SV_FMT"`\n", SvFmt(si.string));
-            array_foreach(content, i) {
-                String dir = StringArray_get(content, i);
-                Stack_push(stack, (StackItem) { .type = STACK_ITEM_STRING, .string = dir, .loc = op.loc });
+            if (si.type != STACK_ITEM_STRING) lexer_error(locs[si.origin], "expected a string on the stack");
+            StringArray_push(inputs, interpret_string(si));
+            Stack_pop(stack);
+        }
+        StackItem output = Stack_get(stack, stack->size-1);
+        if (output.type != STACK_ITEM_STRING) lexer_error(locs[output.origin], "expected a string on the stack");
+        Stack_pop(stack);
+        StringArray* outputs = StringArray_new(scratch);
+        StringArray_push(outputs, interpret_string(output));
+        bool uptodate = fs_uptodate(outputs, inputs);
+        printf("FILEIO: `"SV_FMT"` is %s\n", SvFmt(interpret_string(output)), uptodate ? "up to date" : "out of date");
+        scratch_end(scratch);
+        Stack_push(stack, (StackItem) { .type = STACK_ITEM_BOOL, .number = uptodate, .origin = pc });
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_INPUT):
+    INTERPRET_OP(OP_OUTPUT):
+    INTERPRET_OP(OP_DEPFILE):
+    INTERPRET_OP(OP_EXCLUDE): {
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        StackItem si = Stack_get(stack, stack->size-1);
+        if (!code[pc].verified && si.type != STACK_ITEM_STRING) lexer_error(locs[pc], "expected a string on the stack");
+        if (code[pc].type == OP_INPUT) si.type = STACK_ITEM_INPUT;
+        else if (code[pc].type == OP_OUTPUT) si.type = STACK_ITEM_OUTPUT;
+        else if (code[pc].type == OP_DEPFILE) si.type = STACK_ITEM_DEPFILE;
+        else si.type = STACK_ITEM_EXCLUDE;
+        Stack_set(stack, stack->size-1, si);
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_COPY):
+    INTERPRET_OP(OP_COPYDIR):
+    INTERPRET_OP(OP_RENAME):
+    INTERPRET_OP(OP_WRITE): {
+        if (!code[pc].verified && stack->size <= 1) lexer_error(locs[pc], "expected stack to have at least 2 items");
+        StackItem b = Stack_get(stack, stack->size-1);
+        StackItem a = Stack_get(stack, stack->size-2);
+        if (!code[pc].verified && (a.type != STACK_ITEM_STRING || b.type != STACK_ITEM_STRING)) lexer_error(locs[pc], "expected both values to be strings");
+        String first = interpret_string(a), second = interpret_string(b);
+        Stack_pop(stack);
+        Stack_pop(stack);
+        if (code[pc].type == OP_WRITE) {
+            bool changed;
+            if (!fs_write_if_changed(second, first, &changed)) lexer_error(locs[pc], "could not write `"SV_FMT"`: %s", SvFmt(second), strerror(errno));
+            fs_invalidate(second);
+            printf("FILEIO: %s `"SV_FMT"`\n", changed ? "wrote" : "left unchanged", SvFmt(second));
+            INTERPRET_NEXT();
+        }
+        bool ok = code[pc].type == OP_COPY ? fs_copy_file(first, second)
+            : code[pc].type == OP_COPYDIR ? fs_copy_tree(first, second)
+            : fs_rename(first, second);
+        char* done = code[pc].type == OP_RENAME ? "renamed" : "copied";
+        if (!ok) lexer_error(locs[pc], "could not %s `"SV_FMT"` to `"SV_FMT"`: %s", code[pc].type == OP_RENAME ? "rename" : "copy", SvFmt(first), SvFmt(second), strerror(errno));
+        if (code[pc].type == OP_RENAME) fs_invalidate(first);
+        fs_invalidate(second);
+        printf("FILEIO: %s `"SV_FMT"` to `"SV_FMT"`\n", done, SvFmt(first), SvFmt(second));
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_REMOVE):
+    INTERPRET_OP(OP_REMOVEDIR):
+    INTERPRET_OP(OP_TOUCH): {
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        StackItem si = Stack_get(stack, stack->size-1);
+        if (!code[pc].verified && si.type != STACK_ITEM_STRING) lexer_error(locs[pc], "expected a string on the stack");
+        String string = interpret_string(si);
+        Stack_pop(stack);
+        bool touch = code[pc].type == OP_TOUCH;
+        bool ok = touch ? fs_touch(string) : code[pc].type == OP_REMOVE ? fs_remove(string) : fs_remove_tree(string);
+        if (!ok) lexer_error(locs[pc], "could not %s `"SV_FMT"`: %s", touch ? "touch" : "remove", SvFmt(string), strerror(errno));
+        fs_invalidate(string);
+        printf("FILEIO: %s `"SV_FMT"`\n", touch ? "touched" : "removed", SvFmt(string));
+        INTERPRET_NEXT();
+    }
+    INTERPRET_OP(OP_LOG):
+    INTERPRET_OP(OP_ERROR):
+    INTERPRET_OP(OP_PRINT): {
+        if (!code[pc].verified && stack->size == 0) lexer_error(locs[pc], "expected stack to not be empty");
+        StackItem si = Stack_get(stack, stack->size-1);
+        if (!code[pc].verified && si.type != STACK_ITEM_STRING) lexer_error(locs[pc], "expected a string on the stack");
+        String string = interpret_string(si);
+        Stack_pop(stack);
+        if (code[pc].type == OP_LOG) printf("INFO: "SV_FMT"\n", SvFmt(string));
+        else if (code[pc].type == OP_ERROR) error(SV_FMT, SvFmt(string));
+        else printf(SV_FMT, SvFmt(string));
+        INTERPRET_NEXT();
+    }
+
+#ifndef INTERPRET_THREADED
+        default: lexer_error(locs[pc], "intrinsic %d is not implemented", code[pc].type);
+        }
+    }
+#endif
+
+end:
+    in->pc = pc;
+    if (interpret_jobs_running(in)) in->waiting_all = true;
+    else in->done = true;
+}
+
+#ifdef INTERPRET_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+void interpret_want_target(Program* p, size_t index) {
+    Target target = TargetArray_get(targets, index);
+    if (target.state == TARGET_WANTED) return;
+    if (target.state == TARGET_VISITING) lexer_error(target.loc, "target `"SV_FMT"` depends on itself", SvFmt(target.name));
+    target.state = TARGET_VISITING;
+    TargetArray_set(targets, index, target);
+
+    for (size_t i = 0; i < target.deps_count; i++) {
+        String dep = p->operands[target.deps + i];
+        size_t t;
+        if (StringMap_get(&target_ids, dep, &t)) interpret_want_target(p, t);
+        else lexer_error(p->locs[target.deps + i], "no such target as `"SV_FMT"`", SvFmt(dep));
+    }
+
+    target.state = TARGET_WANTED;
+    TargetArray_set(targets, index, target);
+}
+
+bool interpret_target_ready(Program* p, Target target) {
+    for (size_t i = 0; i < target.deps_count; i++) {
+        size_t t = 0; // every dependency was resolved by `interpret_want_target`
+        StringMap_get(&target_ids, p->operands[target.deps + i], &t);
+        if (TargetArray_get(targets, t).state != TARGET_DONE) return false;
+    }
+    return true;
+}
+
+// Builds the requested targets (or the first one defined) and everything they
+// depend on. Targets run side by side: while one waits for a command, the
+// others keep going, as far as the `-j` job pool allows.
+void interpret_targets(Program* p, StringArray* requested) {
+    if (targets->size == 0) {
+        if (requested->size > 0) error("no targets are defined");
+        return;
+    }
+    if (requested->size == 0) interpret_want_target(p, 0);
+    array_foreach(requested, r) {
+        String name = StringArray_get(requested, r);
+        size_t t;
+        if (StringMap_get(&target_ids, name, &t)) interpret_want_target(p, t);
+        else error("no such target as `"SV_FMT"`", SvFmt(name));
+    }
+
+    for (;;) {
+        bool finished = true, progressed = false;
+        array_foreach(targets, t) {
+            Target target = TargetArray_get(targets, t);
+            if (target.state == TARGET_WANTED && interpret_target_ready(p, target)) {
+                printf("TARGET: "SV_FMT"\n", SvFmt(target.name));
+                target.in = interpret_new(target.deps + target.deps_count, true);
+                target.state = TARGET_RUNNING;
             }
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_INT, .number = content->size });
-        } else if (op.type == OP_FNMATCH) {
-            if (stack->size == 0) lexer_error(op.loc, "expected stack to not be empty");
-            StackItem si = Stack_get(stack, stack->size-1);
-            if (si.type != STACK_ITEM_STRING) lexer_error(op.loc, "expected a string on the stack");
-            Stack_pop(stack);
-            StringArray* content = dir_fnmatch(si.string, &arena);
-            printf("FILEIO: fnmatched `"SV_FMT"`\n", SvFmt(si.string));
-            array_foreach(content, i) {
-                String dir = StringArray_get(content, i);
-                Stack_push(stack, (StackItem) { .type = STACK_ITEM_STRING, .string = dir, .loc = op.loc });
+            if (target.state == TARGET_RUNNING && !interpret_blocked(&target.in)) {
+                interpret(&target.in, p);
+                if (target.in.done) target.state = TARGET_DONE;
+                progressed = true;
             }
-            Stack_push(stack, (StackItem) { .type = STACK_ITEM_INT, .number = content->size });
-        } else if (op.type == OP_LOG) {
-            if (stack->size == 0) lexer_error(op.loc, "expected stack to not be empty");
-            StackItem si = Stack_get(stack, stack->size-1);
-            if (si.type != STACK_ITEM_STRING) lexer_error(op.loc, "expected a string on the stack");
-            Stack_pop(stack);
-            printf("INFO: "SV_FMT"\n", SvFmt(si.string));
-        } else if (op.type == OP_ERROR) {
-            if (stack->size == 0) lexer_error(op.loc, "expected stack to not be empty");
-            StackItem si = Stack_get(stack, stack->size-1);
-            if (si.type != STACK_ITEM_STRING) lexer_error(op.loc, "expected a string on the stack");
-            Stack_pop(stack);
-            error(SV_FMT, SvFmt(si.string));
-        } else if (op.type == OP_PRINT) {
-            if (stack->size == 0) lexer_error(op.loc, "expected stack to not be empty");
-            StackItem si = Stack_get(stack, stack->size-1);
-            if (si.type != STACK_ITEM_STRING) lexer_error(op.loc, "expected a string on the stack");
-            Stack_pop(stack);
-            printf(SV_FMT, SvFmt(si.string));
-        } else lexer_error(op.loc, "intrinsic %d is not implemented", op.type);
+            if (target.state != TARGET_IDLE && target.state != TARGET_DONE) finished = false;
+            TargetArray_set(targets, t, target);
+        }
+        if (finished) break;
+        if (!progressed) {
+            if (jobs_running->size == 0) error("targets can't make any progress");
+            jobs_wait_any();
+        }
+    }
+}
+
+void interpret_program(Program* p, StringArray* requested) {
+    targets = TargetArray_new(&arena);
+
+    Interpreter in = interpret_new(0, false);
+    while (!in.done) {
+        interpret(&in, p);
+        while (interpret_blocked(&in)) jobs_wait_any();
     }
+
+    interpret_targets(p, requested);
 }
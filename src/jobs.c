@@ -0,0 +1,447 @@
+typedef struct {
+    size_t id;
+    pid_t pid;
+    int fd; // read end of the output pipe, or the connection to the worker; -1 if the job writes to our stdout
+    bool remote;
+    size_t worker; // that runs the job, if it's remote
+    char* output; // malloc'd, so it can be given back once the job is flushed
+    size_t output_size, output_capacity;
+    String cmd;
+    uint64_t started; // for `--profile`
+    Command command;
+    char cache_key[CACHE_KEY_SIZE + 1]; // empty if the outputs aren't cached
+} Job;
+
+array_define(JobArray, Job)
+array_implement(JobArray, Job)
+
+#define JOBS_KILL_MS 2000 // for killed jobs to go before they're killed for good
+
+size_t jobs_max = 1;
+size_t jobs_next_id = 1;
+JobArray* jobs_running = NULL;
+
+void jobs_init(size_t max) {
+    if (max == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max = cpus > 0 ? (size_t) cpus : 1;
+    }
+    jobs_max = max;
+    jobs_running = JobArray_new(&arena);
+}
+
+// Programs are looked up in PATH once per run. Only absolute results are
+// remembered, as relative ones change meaning with `cd`.
+StringMap jobs_paths = {0};
+
+char* jobs_resolve(String program, char resolved[PATH_MAX]) {
+    fs_cpath(program, resolved);
+    if (memchr(program.bytes, '/', program.size) != NULL) return resolved;
+    size_t cached;
+    if (StringMap_get(&jobs_paths, program, &cached)) return (char*) cached;
+
+    const char* path = getenv("PATH");
+    if (path == NULL) path = "/usr/local/bin:/usr/bin:/bin";
+    for (const char* dir = path;; dir++) {
+        const char* end = strchr(dir, ':');
+        size_t size = end ? (size_t) (end - dir) : strlen(dir);
+        char candidate[PATH_MAX];
+        struct stat st;
+        int n = size == 0 ? snprintf(candidate, sizeof(candidate), "%s", resolved) : snprintf(candidate, sizeof(candidate), "%.*s/%s", (int) size, dir, resolved);
+        if (n < (int) sizeof(candidate) && stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            if (candidate[0] != '/') return strcpy(resolved, candidate);
+            char* copy = strdup(candidate);
+            char* key = strdup(resolved);
+            if (copy == NULL || key == NULL) error("out of memory");
+            StringMap_set(&jobs_paths, sv_from_bytes(key, program.size), (size_t) copy);
+            return copy;
+        }
+        if (end == NULL) break;
+        dir = end;
+    }
+    return resolved; // left for posix_spawn to report
+}
+
+// The program and arguments, as a NULL-terminated vector pointing into a
+// single block, so each string is copied once. Both are freed by the caller.
+char** jobs_argv(Command command, char** block) {
+    size_t size = command.program.size + 1;
+    array_foreach(command.arguments, i) size += StringArray_get(command.arguments, i).size + 1;
+    char** argv = malloc(sizeof(char*) * (command.arguments->size + 2));
+    *block = malloc(size);
+    if (argv == NULL || *block == NULL) error("out of memory");
+
+    char* at = *block;
+    for (size_t i = 0; i <= command.arguments->size; i++) {
+        String arg = i == 0 ? command.program : StringArray_get(command.arguments, i-1);
+        memcpy(at, arg.bytes, arg.size);
+        at[arg.size] = 0;
+        argv[i] = at;
+        at += arg.size + 1;
+    }
+    argv[command.arguments->size+1] = NULL;
+    return argv;
+}
+
+void jobs_reserve(Job* job, size_t room) {
+    if (job->output_capacity - job->output_size >= room) return;
+    while (job->output_capacity - job->output_size < room) job->output_capacity = job->output_capacity == 0 ? 8192 : job->output_capacity * 2;
+    job->output = realloc(job->output, job->output_capacity);
+    if (job->output == NULL) error("out of memory");
+}
+
+void jobs_write_out(const char* bytes, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(STDOUT_FILENO, bytes, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        bytes += n;
+        size -= n;
+    }
+}
+
+// However a run ends, no job outlives it: `error` and the like call this on
+// their way out. A worker kills a job once its connection is closed. What a
+// killed job wrote so far is shown, and outputs it may have half written are
+// removed, so they can't look up to date the next time. As it's on the way
+// out already, nothing here can fail or wait for long.
+void jobs_kill_all(void) {
+    JobArray* running = jobs_running;
+    if (running == NULL) return;
+    jobs_running = NULL;
+    fflush(stdout);
+    array_foreach(running, i) {
+        Job job = JobArray_get(running, i);
+        if (!job.remote) kill(job.pid, SIGTERM);
+    }
+    uint64_t deadline = profile_now() + JOBS_KILL_MS * 1000000ull;
+    array_foreach(running, i) {
+        Job job = JobArray_get(running, i);
+        if (job.remote) remote_done(job.worker);
+        else {
+            while (waitpid(job.pid, NULL, WNOHANG) == 0) {
+                if (profile_now() >= deadline) {
+                    kill(job.pid, SIGKILL);
+                    waitpid(job.pid, NULL, 0);
+                    break;
+                }
+                nanosleep(&(struct timespec) { .tv_nsec = 10000000 }, NULL);
+            }
+            if (job.output_size > 0) jobs_write_out(job.output, job.output_size);
+            // Whatever it started may still hold the pipe open
+            if (job.fd >= 0) fcntl(job.fd, F_SETFL, O_NONBLOCK);
+            char buffer[4096];
+            for (ssize_t n = 1; job.fd >= 0 && n > 0;) {
+                n = read(job.fd, buffer, sizeof(buffer));
+                if (n > 0) jobs_write_out(buffer, n);
+            }
+            array_foreach(job.command.outputs, j) {
+                char path[PATH_MAX];
+                unlink(fs_cpath(StringArray_get(job.command.outputs, j), path));
+            }
+        }
+        if (job.fd >= 0) close(job.fd);
+        if (job.remote && job.output_size > 0) jobs_write_out(job.output, job.output_size);
+        free(job.output);
+        scratch_free(job.command.arena);
+    }
+}
+
+// posix_spawn, with what execvp does for a file it can't execute: a script
+// without a `#!` line is run by /bin/sh instead
+int jobs_posix_spawn(pid_t* pid, char* path, posix_spawn_file_actions_t* actions, posix_spawnattr_t* attr, char** argv) {
+    int result = posix_spawn(pid, path, actions, attr, argv, environ);
+    if (result != ENOEXEC) return result;
+    size_t argc = 0;
+    while (argv[argc] != NULL) argc++;
+    char** sh = malloc(sizeof(char*) * (argc + 2));
+    if (sh == NULL) return ENOMEM;
+    sh[0] = "/bin/sh";
+    sh[1] = path;
+    memcpy(sh + 2, argv + 1, sizeof(char*) * argc);
+    result = posix_spawn(pid, "/bin/sh", actions, attr, sh, environ);
+    free(sh);
+    return result;
+}
+
+// Starts a command with its stdout and stderr sent to `out` and `err`, or
+// left as ours if -1
+pid_t jobs_launch(Command command, int out, int err) {
+    char* block;
+    char** argv = jobs_argv(command, &block);
+    char program[PATH_MAX];
+    char* path = jobs_resolve(command.program, program);
+
+    // posix_spawn doesn't copy our address space the way fork does, which
+    // matters once the arena has grown
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (out >= 0) posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    if (err >= 0) posix_spawn_file_actions_adddup2(&actions, err, STDERR_FILENO);
+    pid_t pid;
+    int result = jobs_posix_spawn(&pid, path, &actions, NULL, argv);
+    posix_spawn_file_actions_destroy(&actions);
+    free(argv);
+    free(block);
+    if (result != 0) {
+        lexer_error(command.loc, "could not execute `"SV_FMT"`: %s", SvFmt(command.program), strerror(result));
+    }
+    return pid;
+}
+
+void jobs_finish(size_t index, int exitcode, struct rusage* usage) {
+    Job job = JobArray_get(jobs_running, index);
+    JobArray_set(jobs_running, index, JobArray_get(jobs_running, jobs_running->size-1));
+    JobArray_pop(jobs_running);
+    fs_invalidate_outputs(job.command.outputs);
+    profile_command(job.command, job.cmd, job.started, usage);
+
+    // The whole output of a job is written at once, so jobs never interleave
+    if (job.output_size > 0) {
+        fwrite(job.output, 1, job.output_size, stdout);
+        fflush(stdout);
+    }
+    free(job.output);
+
+    if (exitcode != 0) {
+        jobs_kill_all();
+        lexer_error(job.command.loc, "command `"SV_FMT"` exited with non-zero exitcode %d", SvFmt(job.cmd), exitcode);
+    }
+    if (job.command.depfile.size > 0) deps_ingest(job.command);
+    if (job.cache_key[0] != 0) cache_store(job.command, job.cache_key);
+    scratch_free(job.command.arena);
+}
+
+int jobs_exitcode(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Takes a frame off a remote job; true once the job's done. If the worker
+// goes away, the job is started again here.
+bool jobs_receive(Job* job, int* exitcode) {
+    RemoteFrame type;
+    size_t size;
+    char* payload = remote_receive(job->fd, &type, &size);
+    if (payload == NULL) {
+        close(job->fd);
+        remote_done(job->worker);
+        remote_lost(job->worker);
+        printf("CMD: "SV_FMT" (again, here)\n", SvFmt(job->cmd));
+        fflush(stdout);
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) < 0) error("could not create a pipe: %s", strerror(errno));
+        job->pid = jobs_launch(job->command, pipefd[1], pipefd[1]);
+        close(pipefd[1]);
+        job->fd = pipefd[0];
+        job->remote = false;
+        job->output_size = 0;
+        return false;
+    }
+    bool done = false;
+    if (type == REMOTE_OUTPUT) {
+        jobs_reserve(job, size);
+        memcpy(job->output + job->output_size, payload, size);
+        job->output_size += size;
+    } else if (type == REMOTE_FILE && !remote_write_output(job->command, payload, size)) {
+        free(payload);
+        jobs_kill_all();
+        lexer_error(job->command.loc, "could not put an output of `"SV_FMT"` in place: %s", SvFmt(job->cmd), strerror(errno));
+    } else if (type == REMOTE_EXIT && size == sizeof(int32_t)) {
+        int32_t code;
+        memcpy(&code, payload, sizeof(code));
+        *exitcode = (int32_t) ntohl(code);
+        close(job->fd);
+        job->fd = -1;
+        remote_done(job->worker);
+        done = true;
+    }
+    free(payload);
+    return done;
+}
+
+void jobs_wait_any(void) {
+    if (jobs_running->size == 0) return;
+
+    // Unbuffered jobs are only started when nothing else is running
+    Job first = JobArray_get(jobs_running, 0);
+    if (first.fd < 0) {
+        int status = 0;
+        struct rusage usage;
+        if (wait4(first.pid, &status, 0, &usage) < 0) error("could not wait for a child process: %s", strerror(errno));
+        jobs_finish(0, jobs_exitcode(status), &usage);
+        return;
+    }
+
+    struct pollfd* fds = malloc(sizeof(struct pollfd) * jobs_running->size);
+    if (fds == NULL) error("out of memory");
+    for (;;) {
+        array_foreach(jobs_running, i) {
+            fds[i] = (struct pollfd) { .fd = JobArray_get(jobs_running, i).fd, .events = POLLIN };
+        }
+        if (poll(fds, jobs_running->size, -1) < 0) {
+            if (errno == EINTR) continue;
+            error("could not poll child processes: %s", strerror(errno));
+        }
+        array_foreach(jobs_running, i) {
+            if (fds[i].revents == 0) continue;
+            Job job = JobArray_get(jobs_running, i);
+            if (job.remote) {
+                // CPU time of remote jobs isn't known here
+                int exitcode = 0;
+                bool done = jobs_receive(&job, &exitcode);
+                JobArray_set(jobs_running, i, job);
+                if (!done) continue;
+                free(fds);
+                jobs_finish(i, exitcode, &(struct rusage) {0});
+                return;
+            }
+            jobs_reserve(&job, 4096);
+            ssize_t n = read(job.fd, job.output + job.output_size, job.output_capacity - job.output_size);
+            if (n < 0 && errno == EINTR) { JobArray_set(jobs_running, i, job); continue; }
+            if (n > 0) {
+                job.output_size += n;
+                JobArray_set(jobs_running, i, job);
+                continue;
+            }
+            // EOF: the child closed its end, reap it
+            close(job.fd);
+            job.fd = -1;
+            JobArray_set(jobs_running, i, job);
+            int status = 0;
+            struct rusage usage;
+            if (wait4(job.pid, &status, 0, &usage) < 0) error("could not wait for a child process: %s", strerror(errno));
+            free(fds);
+            jobs_finish(i, jobs_exitcode(status), &usage);
+            return;
+        }
+    }
+}
+
+size_t jobs_local(void) {
+    size_t local = 0;
+    array_foreach(jobs_running, i) local += !JobArray_get(jobs_running, i).remote;
+    return local;
+}
+
+bool jobs_is_running(size_t id) {
+    array_foreach(jobs_running, i) {
+        if (JobArray_get(jobs_running, i).id == id) return true;
+    }
+    return false;
+}
+
+void jobs_wait(size_t id) {
+    while (jobs_is_running(id)) jobs_wait_any();
+}
+
+void jobs_wait_all(void) {
+    while (jobs_running->size > 0) jobs_wait_any();
+}
+
+// Takes over the arena of the command
+size_t jobs_spawn(Command command) {
+    String cmd = command_render(command);
+    fs_depend(command.inputs);
+    if (command.remote) remote_check(command);
+
+    // A command with declared outputs newer than its inputs (and everything
+    // its depfile listed last time) is not run at all, it just gets a handle
+    // of an already finished job
+    bool has_depfile = command.depfile.size > 0;
+    StringArray* deps = has_depfile ? deps_lookup(command) : NULL;
+    bool known_deps = !has_depfile || deps != NULL;
+    if (known_deps && fs_uptodate(command.outputs, command.inputs) && (deps == NULL || fs_uptodate(command.outputs, deps))) {
+        printf("CMD: "SV_FMT" (up to date)\n", SvFmt(cmd));
+        scratch_free(command.arena);
+        return jobs_next_id++;
+    }
+
+    Job job = { .cmd = cmd, .command = command };
+    if (cache_enabled && known_deps && command.outputs->size > 0 && cache_key(command, cmd, deps, job.cache_key)) {
+        if (cache_restore(command, job.cache_key)) {
+            fs_invalidate_outputs(command.outputs);
+            if (has_depfile) deps_refresh(command, deps);
+            printf("CMD: "SV_FMT" (cached)\n", SvFmt(cmd));
+            scratch_free(command.arena);
+            return jobs_next_id++;
+        }
+    }
+
+    // `-j` is for jobs run here; remote ones go wherever there's room. Until
+    // its depfile has been read once, a worker wouldn't know what to send
+    // along, e.g. headers, so the command runs here.
+    ssize_t worker = -1;
+    if (command.remote && known_deps) {
+        while ((worker = remote_pick(jobs_local(), jobs_max)) == -2) jobs_wait_any();
+    } else {
+        while (jobs_local() >= jobs_max) jobs_wait_any();
+    }
+
+    fs_invalidate_outputs(command.outputs);
+    job.started = profile_now();
+    job.id = jobs_next_id++;
+    if (worker >= 0 && (job.fd = remote_start(worker, command, deps)) >= 0) {
+        printf("CMD: "SV_FMT" (on %s)\n", SvFmt(cmd), RemoteWorkerArray_get(remote_workers, worker).address);
+        job.remote = true;
+        job.worker = worker;
+        JobArray_push(jobs_running, job);
+        return job.id;
+    }
+
+    printf("CMD: "SV_FMT"\n", SvFmt(cmd));
+    fflush(stdout);
+
+    // A lone job talks to the terminal directly; concurrent ones are buffered
+    bool buffered = jobs_running->size > 0 || jobs_max > 1;
+    int pipefd[2] = { -1, -1 };
+    if (buffered && pipe2(pipefd, O_CLOEXEC) < 0) error("could not create a pipe: %s", strerror(errno));
+    pid_t pid = jobs_launch(command, pipefd[1], pipefd[1]);
+    if (buffered) close(pipefd[1]);
+
+    job.pid = pid;
+    job.fd = pipefd[0];
+    JobArray_push(jobs_running, job);
+    return job.id;
+}
+
+// Runs a command to completion and returns what it wrote to stdout; stderr is
+// passed through. It waits for a free slot like any other job; other jobs
+// keep running meanwhile, but nothing new starts. The output is in the arena
+// of the command.
+String jobs_capture(Command command, String cmd) {
+    fs_depend(command.inputs);
+    while (jobs_local() >= jobs_max) jobs_wait_any();
+    printf("CMD: "SV_FMT"\n", SvFmt(cmd));
+    fflush(stdout);
+    fs_invalidate_outputs(command.outputs);
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) error("could not create a pipe: %s", strerror(errno));
+    uint64_t started = profile_now();
+    pid_t pid = jobs_launch(command, pipefd[1], -1);
+    close(pipefd[1]);
+
+    StringBuilder* sb = StringBuilder_new(command.arena);
+    char buffer[4096];
+    for (;;) {
+        ssize_t n = read(pipefd[0], buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        for (ssize_t i = 0; i < n; i++) StringBuilder_push(sb, buffer[i]);
+    }
+    close(pipefd[0]);
+
+    int status = 0;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) error("could not wait for a child process: %s", strerror(errno));
+    }
+    fs_invalidate_outputs(command.outputs);
+    profile_command(command, cmd, started, &usage);
+    int exitcode = jobs_exitcode(status);
+    if (exitcode != 0) {
+        jobs_kill_all();
+        lexer_error(command.loc, "command `"SV_FMT"` exited with non-zero exitcode %d", SvFmt(cmd), exitcode);
+    }
+    return sv_from_sb(sb);
+}
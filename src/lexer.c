@@ -1,16 +1,10 @@
 
 typedef struct {
     String filename, content;
-    size_t cursor, l, c;
+    size_t cursor;
+    Arena* arena; // for tokens and strings with escapes
 } Lexer;
 
-Lexer lexer_new(String filename, String content) {
-    return (Lexer) {
-        .filename = filename,
-        .content = content,
-    };
-}
-
 typedef enum {
     TOKEN_EOF = 0,
 
@@ -42,11 +36,20 @@ typedef enum {
     
     TOKEN_MACRO,
     TOKEN_CMD,
+    TOKEN_MEMO,
+    TOKEN_REMOTE,
     TOKEN_RUN,
+    TOKEN_SPAWN,
+    TOKEN_CAPTURE,
+    TOKEN_CAPTUREWORDS,
+    TOKEN_WAIT,
+    TOKEN_WAITALL,
 
     TOKEN_IF,
     TOKEN_WHILE,
     TOKEN_ELSE,
+    TOKEN_TARGET,
+    TOKEN_INCLUDE,
 
     TOKEN_DUP,
     TOKEN_DROP,
@@ -61,6 +64,19 @@ typedef enum {
     TOKEN_GETCWD,
     TOKEN_LISTDIR,
     TOKEN_FNMATCH,
+    TOKEN_NEWER,
+    TOKEN_UPTODATE,
+    TOKEN_INPUT,
+    TOKEN_OUTPUT,
+    TOKEN_DEPFILE,
+    TOKEN_EXCLUDE,
+    TOKEN_COPY,
+    TOKEN_COPYDIR,
+    TOKEN_REMOVE,
+    TOKEN_REMOVEDIR,
+    TOKEN_RENAME,
+    TOKEN_TOUCH,
+    TOKEN_WRITE,
     
     TOKEN_LOG,
     TOKEN_ERROR,
@@ -86,19 +102,106 @@ typedef enum {
 
 typedef struct {
     String filename;
-    size_t l, c;
+    size_t offset;
 } Location;
 
+// Locations are just offsets; lines and columns are only worked out when a
+// diagnostic is printed, from the source the location points into
+typedef struct {
+    String filename, content;
+    size_t* lines; // offsets where lines start, found on first use
+    size_t lines_count;
+} LexerSource;
+
+array_define(LexerSourceArray, LexerSource)
+array_implement(LexerSourceArray, LexerSource)
+
+// Files of a recipe are lexed on threads of their own, see `module_load`
+LexerSourceArray* lexer_sources = NULL;
+pthread_mutex_t lexer_sources_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t lexer_error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void lexer_add_source(String filename, String content) {
+    pthread_mutex_lock(&lexer_sources_lock);
+    if (lexer_sources == NULL) lexer_sources = LexerSourceArray_new(&arena);
+    bool found = false;
+    array_foreach(lexer_sources, i) {
+        if (sv_compare(LexerSourceArray_get(lexer_sources, i).filename, filename)) {
+            LexerSourceArray_set(lexer_sources, i, (LexerSource) { .filename = filename, .content = content });
+            found = true;
+            break;
+        }
+    }
+    if (!found) LexerSourceArray_push(lexer_sources, (LexerSource) { .filename = filename, .content = content });
+    pthread_mutex_unlock(&lexer_sources_lock);
+}
+
+// Both are counted from 0; an unknown source has everything on the first line
+void lexer_line_column(Location loc, size_t* line, size_t* column) {
+    *line = 0;
+    *column = loc.offset;
+    pthread_mutex_lock(&lexer_sources_lock);
+    if (lexer_sources != NULL) array_foreach(lexer_sources, i) {
+        LexerSource source = LexerSourceArray_get(lexer_sources, i);
+        if (!sv_compare(source.filename, loc.filename)) continue;
+        if (source.lines == NULL) {
+            size_t count = 1;
+            for (const char* c = source.content.bytes; (c = memchr(c, '\n', source.content.bytes + source.content.size - c)) != NULL; c++) count++;
+            source.lines = malloc(sizeof(size_t) * count);
+            if (source.lines == NULL) error("out of memory");
+            source.lines[source.lines_count++] = 0;
+            for (const char* c = source.content.bytes; (c = memchr(c, '\n', source.content.bytes + source.content.size - c)) != NULL; c++) {
+                source.lines[source.lines_count++] = c - source.content.bytes + 1;
+            }
+            LexerSourceArray_set(lexer_sources, i, source);
+        }
+        size_t low = 0, high = source.lines_count;
+        while (high - low > 1) {
+            size_t middle = (low + high) / 2;
+            if (source.lines[middle] <= loc.offset) low = middle;
+            else high = middle;
+        }
+        *line = low;
+        *column = loc.offset - source.lines[low];
+        break;
+    }
+    pthread_mutex_unlock(&lexer_sources_lock);
+}
+
+size_t lexer_line(Location loc) {
+    size_t line, column;
+    lexer_line_column(loc, &line, &column);
+    return line;
+}
+
+size_t lexer_column(Location loc) {
+    size_t line, column;
+    lexer_line_column(loc, &line, &column);
+    return column;
+}
+
 #define LOC_FMT SV_FMT":%zu:%zu"
-#define LocFmt(loc) SvFmt((loc).filename), (loc).l+1, (loc).c+1
+#define LocFmt(loc) SvFmt((loc).filename), lexer_line(loc)+1, lexer_column(loc)+1
+
+Lexer lexer_new(String filename, String content) {
+    lexer_add_source(filename, content);
+    return (Lexer) {
+        .filename = filename,
+        .content = content,
+        .arena = &arena,
+    };
+}
 
 void lexer_error(Location loc, char* fmt, ...) {
+    // Another thread may be failing at the same time; it never gets past this
+    pthread_mutex_lock(&lexer_error_lock);
     fprintf(stderr, LOC_FMT": ERROR: ", LocFmt(loc));
     va_list args;
     va_start(args, fmt);
     vfprintf(stderr, fmt, args);
     va_end(args);
     fprintf(stderr, "\n");
+    jobs_kill_all();
     exit(1);
 }
 
@@ -108,8 +211,86 @@ typedef struct {
     int value;
     Location loc;
     size_t corresponding;
+    size_t symbol; // for words, an id shared by all tokens with the same content
 } Token;
 
+typedef struct {
+    char* name;
+    MakoTokenType type;
+} Keyword;
+
+// Keywords are interned first, so their symbols are indices into this table
+Keyword keywords[] = {
+    { "true", TOKEN_TRUE },
+    { "false", TOKEN_FALSE },
+    { "debug", TOKEN_DEBUG },
+    { "macro", TOKEN_MACRO },
+    { "cmd", TOKEN_CMD },
+    { "run", TOKEN_RUN },
+    { "spawn", TOKEN_SPAWN },
+    { "memo", TOKEN_MEMO },
+    { "remote", TOKEN_REMOTE },
+    { "capture", TOKEN_CAPTURE },
+    { "capturewords", TOKEN_CAPTUREWORDS },
+    { "wait", TOKEN_WAIT },
+    { "waitall", TOKEN_WAITALL },
+    { "if", TOKEN_IF },
+    { "while", TOKEN_WHILE },
+    { "else", TOKEN_ELSE },
+    { "target", TOKEN_TARGET },
+    { "include", TOKEN_INCLUDE },
+    { "dup", TOKEN_DUP },
+    { "drop", TOKEN_DROP },
+    { "swap", TOKEN_SWAP },
+    { "over", TOKEN_OVER },
+    { "rot", TOKEN_ROT },
+    { "fileexists", TOKEN_FILEEXISTS },
+    { "direxists", TOKEN_DIREXISTS },
+    { "mkdir", TOKEN_MKDIR },
+    { "cd", TOKEN_CD },
+    { "getcwd", TOKEN_GETCWD },
+    { "listdir", TOKEN_LISTDIR },
+    { "fnmatch", TOKEN_FNMATCH },
+    { "newer", TOKEN_NEWER },
+    { "uptodate", TOKEN_UPTODATE },
+    { "input", TOKEN_INPUT },
+    { "output", TOKEN_OUTPUT },
+    { "depfile", TOKEN_DEPFILE },
+    { "exclude", TOKEN_EXCLUDE },
+    { "copy", TOKEN_COPY },
+    { "copydir", TOKEN_COPYDIR },
+    { "remove", TOKEN_REMOVE },
+    { "removedir", TOKEN_REMOVEDIR },
+    { "rename", TOKEN_RENAME },
+    { "touch", TOKEN_TOUCH },
+    { "write", TOKEN_WRITE },
+    { "log", TOKEN_LOG },
+    { "error", TOKEN_ERROR },
+    { "print", TOKEN_PRINT },
+};
+
+#define KEYWORDS_COUNT (sizeof(keywords)/sizeof(keywords[0]))
+
+// Per thread, as symbols are only compared within the file they come from
+__thread StringArray* symbols = NULL; // names by symbol
+__thread StringMap symbol_ids = {0};
+
+size_t lexer_intern(Lexer* lexer, String name) {
+    if (symbols == NULL) {
+        symbols = StringArray_new(lexer->arena);
+        for (size_t i = 0; i < KEYWORDS_COUNT; i++) {
+            StringArray_push(symbols, sv(keywords[i].name));
+            StringMap_set(&symbol_ids, sv(keywords[i].name), i);
+        }
+    }
+    size_t symbol;
+    if (StringMap_get(&symbol_ids, name, &symbol)) return symbol;
+    symbol = symbols->size;
+    StringArray_push(symbols, name);
+    StringMap_set(&symbol_ids, name, symbol);
+    return symbol;
+}
+
 bool lexer_done(Lexer* lexer) {
     return lexer->cursor >= lexer->content.size;
 }
@@ -119,21 +300,73 @@ char lexer_char(Lexer* lexer) {
     return sv_index(lexer->content, lexer->cursor);
 }
 
-char lexer_chop_char(Lexer* lexer) {
-    if (lexer_done(lexer)) return 0;
-    char charachter = sv_index(lexer->content, lexer->cursor);
-    if (charachter == '\n') { lexer->l++; lexer->c = 0; }
-    else lexer->c++;
-    lexer->cursor++;
-    return charachter;
+// Whitespace, comments and string bodies are scanned 32 (AVX2) or 16 (SSE2)
+// bytes at a time, finishing off the tail one byte at a time
+#if defined(__AVX2__) && !defined(MAKO_NO_SIMD)
+#define LEXER_VECTOR 32
+#define LEXER_VECTOR_FULL 0xffffffffu
+typedef __m256i LexerVector;
+#define lexer_vector_load(p) _mm256_loadu_si256((const __m256i*) (p))
+#define lexer_vector_set(c) _mm256_set1_epi8(c)
+#define lexer_vector_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define lexer_vector_or(a, b) _mm256_or_si256(a, b)
+#define lexer_vector_sub(a, b) _mm256_sub_epi8(a, b)
+#define lexer_vector_min(a, b) _mm256_min_epu8(a, b)
+#define lexer_vector_mask(a) ((uint32_t) _mm256_movemask_epi8(a))
+#elif defined(__SSE2__) && !defined(MAKO_NO_SIMD)
+#define LEXER_VECTOR 16
+#define LEXER_VECTOR_FULL 0xffffu
+typedef __m128i LexerVector;
+#define lexer_vector_load(p) _mm_loadu_si128((const __m128i*) (p))
+#define lexer_vector_set(c) _mm_set1_epi8(c)
+#define lexer_vector_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define lexer_vector_or(a, b) _mm_or_si128(a, b)
+#define lexer_vector_sub(a, b) _mm_sub_epi8(a, b)
+#define lexer_vector_min(a, b) _mm_min_epu8(a, b)
+#define lexer_vector_mask(a) ((uint32_t) _mm_movemask_epi8(a))
+#endif
+
+// Length of the whitespace `p` starts with
+size_t lexer_span_spaces(const char* p, size_t size) {
+    size_t i = 0;
+#ifdef LEXER_VECTOR
+    LexerVector space = lexer_vector_set(' '), tab = lexer_vector_set('\t'), four = lexer_vector_set(4);
+    for (; i + LEXER_VECTOR <= size; i += LEXER_VECTOR) {
+        LexerVector v = lexer_vector_load(p + i);
+        LexerVector control = lexer_vector_sub(v, tab); // `\t` to `\r` become 0 to 4
+        LexerVector spaces = lexer_vector_or(lexer_vector_eq(v, space), lexer_vector_eq(lexer_vector_min(control, four), control));
+        uint32_t others = ~lexer_vector_mask(spaces) & LEXER_VECTOR_FULL;
+        if (others != 0) return i + __builtin_ctz(others);
+    }
+#endif
+    while (i < size && isspace((unsigned char) p[i])) i++;
+    return i;
+}
+
+// Length of the part of a string literal body `p` starts with that can be
+// taken as is: up to the closing quote, an escape or a newline
+size_t lexer_span_string(const char* p, size_t size, char quote) {
+    size_t i = 0;
+#ifdef LEXER_VECTOR
+    LexerVector q = lexer_vector_set(quote), backslash = lexer_vector_set('\\'), newline = lexer_vector_set('\n');
+    for (; i + LEXER_VECTOR <= size; i += LEXER_VECTOR) {
+        LexerVector v = lexer_vector_load(p + i);
+        LexerVector stops = lexer_vector_or(lexer_vector_eq(v, q), lexer_vector_or(lexer_vector_eq(v, backslash), lexer_vector_eq(v, newline)));
+        uint32_t mask = lexer_vector_mask(stops);
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+#endif
+    while (i < size && p[i] != quote && p[i] != '\\' && p[i] != '\n') i++;
+    return i;
 }
 
 void lexer_strip_whitespace(Lexer* lexer) {
-    while (!lexer_done(lexer) && isspace(lexer_char(lexer))) lexer_chop_char(lexer);
+    if (lexer_done(lexer)) return;
+    lexer->cursor += lexer_span_spaces(lexer->content.bytes + lexer->cursor, lexer->content.size - lexer->cursor);
 }
 
 Location lexer_loc(Lexer* lexer) {
-    return (Location) { lexer->filename, lexer->l, lexer->c };
+    return (Location) { lexer->filename, lexer->cursor };
 }
 
 bool lexer_startswith(Lexer* lexer, String str) {
@@ -141,8 +374,9 @@ bool lexer_startswith(Lexer* lexer, String str) {
 }
 
 void lexer_drop_line(Lexer* lexer) {
-    while (!lexer_done(lexer) && lexer_char(lexer) != '\n') lexer_chop_char(lexer);
-    if (!lexer_done(lexer)) lexer_chop_char(lexer);
+    const char* rest = lexer->content.bytes + lexer->cursor;
+    const char* newline = memchr(rest, '\n', lexer->content.size - lexer->cursor);
+    lexer->cursor = newline == NULL ? lexer->content.size : (size_t) (newline - lexer->content.bytes) + 1;
 }
 
 #define literal_token(token, token_type) \
@@ -151,7 +385,7 @@ void lexer_drop_line(Lexer* lexer) {
         String content = lexer->content; \
         content.bytes += lexer->cursor; \
         content.size = (token).size; \
-        for (size_t i = 0; i < (token).size; i++) lexer_chop_char(lexer); \
+        lexer->cursor += (token).size; \
         return (Token) { .type = (token_type), .content = content, .loc = loc }; \
     }
 
@@ -181,46 +415,35 @@ Token lexer_next_token(Lexer* lexer) {
     else if (isalpha(lexer_char(lexer)) || lexer_char(lexer) == '_') {
         Location loc = lexer_loc(lexer);
         String string = sv_from_bytes(lexer->content.bytes + lexer->cursor, 0);
-        while (!lexer_done(lexer) && (isalnum(lexer_char(lexer)) || lexer_char(lexer) == '_')) { string.size++; lexer_chop_char(lexer); }
+        while (!lexer_done(lexer) && (isalnum(lexer_char(lexer)) || lexer_char(lexer) == '_')) { string.size++; lexer->cursor++; }
         
-        MakoTokenType token_type = TOKEN_WORD;
-        if (sv_compare(string, sv("true"))) token_type = TOKEN_TRUE;
-        if (sv_compare(string, sv("false"))) token_type = TOKEN_FALSE;
-        if (sv_compare(string, sv("debug"))) token_type = TOKEN_DEBUG;
-        if (sv_compare(string, sv("macro"))) token_type = TOKEN_MACRO;
-        if (sv_compare(string, sv("cmd"))) token_type = TOKEN_CMD;
-        if (sv_compare(string, sv("run"))) token_type = TOKEN_RUN;
-        if (sv_compare(string, sv("if"))) token_type = TOKEN_IF;
-        if (sv_compare(string, sv("while"))) token_type = TOKEN_WHILE;
-        if (sv_compare(string, sv("else"))) token_type = TOKEN_ELSE;
-        if (sv_compare(string, sv("dup"))) token_type = TOKEN_DUP;
-        if (sv_compare(string, sv("drop"))) token_type = TOKEN_DROP;
-        if (sv_compare(string, sv("swap"))) token_type = TOKEN_SWAP;
-        if (sv_compare(string, sv("over"))) token_type = TOKEN_OVER;
-        if (sv_compare(string, sv("rot"))) token_type = TOKEN_ROT;
-        if (sv_compare(string, sv("fileexists"))) token_type = TOKEN_FILEEXISTS;
-        if (sv_compare(string, sv("direxists"))) token_type = TOKEN_DIREXISTS;
-        if (sv_compare(string, sv("mkdir"))) token_type = TOKEN_MKDIR;
-        if (sv_compare(string, sv("listdir"))) token_type = TOKEN_LISTDIR;
-        if (sv_compare(string, sv("fnmatch"))) token_type = TOKEN_FNMATCH;
-        if (sv_compare(string, sv("log"))) token_type = TOKEN_LOG;
-        if (sv_compare(string, sv("error"))) token_type = TOKEN_ERROR;
-        if (sv_compare(string, sv("print"))) token_type = TOKEN_PRINT;
-        return (Token) { .type = token_type, .content = string, .loc = loc };
+        size_t symbol = lexer_intern(lexer, string);
+        MakoTokenType token_type = symbol < KEYWORDS_COUNT ? keywords[symbol].type : TOKEN_WORD;
+        return (Token) { .type = token_type, .content = string, .symbol = symbol, .loc = loc };
     } else if (isdigit(lexer_char(lexer)) || lexer_char(lexer) == '-') {
         Location loc = lexer_loc(lexer);
         String string = sv_from_bytes(lexer->content.bytes + lexer->cursor, 0);
-        while (!lexer_done(lexer) && (isdigit(lexer_char(lexer)) || lexer_char(lexer) == '-')) { string.size++; lexer_chop_char(lexer); }
+        while (!lexer_done(lexer) && (isdigit(lexer_char(lexer)) || lexer_char(lexer) == '-')) { string.size++; lexer->cursor++; }
         return (Token) { .type = TOKEN_INTEGER, .content = string, .value = sv_to_int(string), .loc = loc };
     } else if (lexer_char(lexer) == '"' || lexer_char(lexer) == '\'') {
         char quote = lexer_char(lexer);
-        StringBuilder* str = StringBuilder_new(&arena);
         Location loc = lexer_loc(lexer);
-        lexer_chop_char(lexer);
+        lexer->cursor++;
+
+        // A literal without escapes is just a view into the source
+        String plain = sv_from_bytes(lexer->content.bytes + lexer->cursor, lexer_span_string(lexer->content.bytes + lexer->cursor, lexer->content.size - lexer->cursor, quote));
+        lexer->cursor += plain.size;
+        if (!lexer_done(lexer) && lexer_char(lexer) == quote) {
+            lexer->cursor++;
+            return (Token) { .type = TOKEN_STRING, .content = plain, .loc = loc };
+        }
+
+        StringBuilder* str = StringBuilder_new(lexer->arena);
+        for (size_t i = 0; i < plain.size; i++) StringBuilder_push(str, sv_index(plain, i));
         while (lexer_char(lexer) != quote) {
             if (lexer_done(lexer)) lexer_error(loc, "unclosed string literal");
             if (lexer_char(lexer) == '\\') {
-                lexer_chop_char(lexer);
+                lexer->cursor++;
                 if (lexer_done(lexer)) lexer_error(loc, "expected escape sequence, got EOF");
                 char seq = lexer_char(lexer);
                 if (seq == 'r') StringBuilder_push(str, '\r');
@@ -229,15 +452,16 @@ Token lexer_next_token(Lexer* lexer) {
                 else if (seq == '\"') StringBuilder_push(str, '\"');
                 else if (seq == '\'') StringBuilder_push(str, '\'');
                 else lexer_error(lexer_loc(lexer), "undefined escape sequence");
-                lexer_chop_char(lexer);
+                lexer->cursor++;
             } else if (lexer_char(lexer) == '\n') {
                 lexer_error(lexer_loc(lexer), "unclosed string literal");
             } else {
-                StringBuilder_push(str, lexer_char(lexer));
-                lexer_chop_char(lexer);
+                size_t span = lexer_span_string(lexer->content.bytes + lexer->cursor, lexer->content.size - lexer->cursor, quote);
+                for (size_t i = 0; i < span; i++) StringBuilder_push(str, sv_index(lexer->content, lexer->cursor + i));
+                lexer->cursor += span;
             }
         }
-        lexer_chop_char(lexer);
+        lexer->cursor++;
         return (Token) { .type = TOKEN_STRING, .content = sv_from_sb(str), .loc = loc };
     } else {
         lexer_error(lexer_loc(lexer), "unexpected charachter: `%c`", lexer_char(lexer));
@@ -250,7 +474,7 @@ array_define(TokenArray, Token)
 array_implement(TokenArray, Token)
 
 TokenArray* lexer_tokenize(Lexer* lexer) {
-    TokenArray* ta = TokenArray_new(&arena);
+    TokenArray* ta = TokenArray_new(lexer->arena);
     Token token = lexer_next_token(lexer);
     while (token.type) {
         TokenArray_push(ta, token);
@@ -260,15 +484,16 @@ TokenArray* lexer_tokenize(Lexer* lexer) {
 }
 
 void lexer_crossreference(TokenArray* tokens) {
-    U32Array* stack = U32Array_new(&arena);
-    U32Array* while_stack = U32Array_new(&arena);
+    Arena scratch = {0}; // not a scratch frame: this may run on any thread
+    U32Array* stack = U32Array_new(&scratch);
+    U32Array* while_stack = U32Array_new(&scratch);
     array_foreach(tokens, i) {
         Token token = TokenArray_get(tokens, i);
         if (token.type == TOKEN_WHILE) U32Array_push(while_stack, i);
         if (token.type == TOKEN_OCURLY) {
             U32Array_push(stack, i);
             if (while_stack->size == 0) continue;
-            size_t index = U32Array_get(while_stack, stack->size-1); U32Array_pop(while_stack);
+            size_t index = U32Array_get(while_stack, while_stack->size-1); U32Array_pop(while_stack);
             Token while_token = TokenArray_get(tokens, index);
             while_token.corresponding = i;
             TokenArray_set(tokens, index, while_token);
@@ -285,4 +510,5 @@ void lexer_crossreference(TokenArray* tokens) {
     }
     if (stack->size != 0) lexer_error(TokenArray_get(tokens, U32Array_get(stack, 0)).loc, "stray `{`");
     if (while_stack->size != 0) lexer_error(TokenArray_get(tokens, U32Array_get(while_stack, 0)).loc, "expected `{` after `while`");
+    arena_free(&scratch);
 }
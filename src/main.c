@@ -1,8 +1,44 @@
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/fs.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "stringview.h"
 #include "arena.h"
@@ -12,6 +48,9 @@
 Arena arena = {0};
 
 #define DEFAULT_BUILD_FILE "build.mako"
+#define CACHE_DIR ".mako-cache"
+
+void jobs_kill_all(void); // in jobs.c
 
 void error(char* fmt, ...) {
     fprintf(stderr, "ERROR: ");
@@ -20,6 +59,7 @@ void error(char* fmt, ...) {
     vfprintf(stderr, fmt, args);
     va_end(args);
     fprintf(stderr, "\n");
+    jobs_kill_all();
     exit(1);
 }
 
@@ -41,11 +81,35 @@ typedef enum {
 
 typedef struct {
     ProgramMode mode;
+    size_t jobs;
+    bool no_cache;
+    bool no_bytecode_cache;
+    bool optimize;
+    bool stats;
+    bool profile;
+    bool watch;
+    bool daemon;
+    bool no_daemon;
+    String worker; // to serve at, if any
+    String workers; // to hand remote commands to
+    StringArray* targets;
 } Flags;
 
 void print_help(String program) {
-    printf("USAGE: "SV_FMT" [filename] [--tokenize] [--parse] [--help]\n", SvFmt(program));
-    printf("  filename: defaults to `"DEFAULT_BUILD_FILE"`\n");
+    printf("USAGE: "SV_FMT" [filename.mako] [targets...] [-j N] [--no-cache] [--no-bytecode-cache] [--optimize] [--stats] [--profile] [--watch] [--daemon] [--no-daemon] [--worker ADDRESS] [--workers ADDRESSES] [--tokenize] [--parse] [--help]\n", SvFmt(program));
+    printf("  filename.mako: defaults to `"DEFAULT_BUILD_FILE"`\n");
+    printf("  targets: targets to build; defaults to the first one defined\n");
+    printf("  -j N: run up to N spawned commands at once; 0 means one per CPU (default: 1)\n");
+    printf("  --no-cache: always run commands, even if their outputs are in `"CACHE_DIR"`\n");
+    printf("  --no-bytecode-cache: always parse the recipe, even if it didn't change\n");
+    printf("  --optimize: fold constants, drop dead branches and simplify jumps before running\n");
+    printf("  --stats: report how well caches did once done\n");
+    printf("  --profile: report where time went once done, and write it to `trace.json` for chrome://tracing\n");
+    printf("  --watch: run again whenever a file the recipe looked at changes\n");
+    printf("  --daemon: keep recipes loaded in the background, for other calls to run in\n");
+    printf("  --no-daemon: run here, even if a daemon is running\n");
+    printf("  --worker ADDRESS: run commands marked `remote` for other runs, at `unix:PATH` or `HOST:PORT` (which needs $MAKO_WORKER_TOKEN), with -j slots\n");
+    printf("  --workers ADDRESSES: comma-separated workers to run commands marked `remote` on (default: $MAKO_WORKERS)\n");
     printf("  --tokenize: don't interpret file; just tokenize it instead\n");
     printf("  --parse: don't interpret file; just parse it instead\n");
     printf("  --help: print this and exit\n");
@@ -56,39 +120,102 @@ String parse_args(int argc, char** argv, Flags* flags) {
     
     String filename = {0};
     bool fn_selected = false;
-    *flags = (Flags) {0};
+    *flags = (Flags) { .jobs = 1, .targets = StringArray_new(&arena) };
     while (argc > 0) {
         String arg = shift_args(&argc, &argv);
         if      (sv_compare(arg, sv("--tokenize"))) flags->mode = TOKENIZE;
         else if (sv_compare(arg, sv("--parse"))) flags->mode = PARSE;
+        else if (sv_compare(arg, sv("--no-cache"))) flags->no_cache = true;
+        else if (sv_compare(arg, sv("--no-bytecode-cache"))) flags->no_bytecode_cache = true;
+        else if (sv_compare(arg, sv("--optimize"))) flags->optimize = true;
+        else if (sv_compare(arg, sv("--stats"))) flags->stats = true;
+        else if (sv_compare(arg, sv("--profile"))) flags->profile = true;
+        else if (sv_compare(arg, sv("--watch"))) flags->watch = true;
+        else if (sv_compare(arg, sv("--daemon"))) flags->daemon = true;
+        else if (sv_compare(arg, sv("--no-daemon"))) flags->no_daemon = true;
         else if (sv_compare(arg, sv("--help"))) { print_help(program); exit(0); }
-        else {
+        else if (sv_compare(arg, sv("--worker")) || sv_compare(arg, sv("--workers"))) {
+            String value = shift_args(&argc, &argv);
+            if (value.size == 0) error("expected an address after `"SV_FMT"`", SvFmt(arg));
+            if (sv_compare(arg, sv("--worker"))) flags->worker = value;
+            else flags->workers = value;
+        }
+        else if (sv_compare(arg, sv("-j"))) {
+            String n = shift_args(&argc, &argv);
+            if (n.size == 0 || !isdigit(sv_index(n, 0))) error("expected a number after `-j`");
+            flags->jobs = sv_to_int(n);
+        }
+        else if (arg.size > 5 && sv_compare_at(arg, sv(".mako"), arg.size - 5)) {
             if (fn_selected) error("multiple files at once is not supported yet");
             fn_selected = true;
             filename = arg;
-        }
+        } else StringArray_push(flags->targets, arg);
     }
     
     if (!fn_selected) filename = sv(DEFAULT_BUILD_FILE);
     
-    if (!file_exists(filename)) error("no file named `"SV_FMT"`", SvFmt(filename));
+    if (!flags->daemon && flags->worker.size == 0 && !file_exists(filename)) error("no file named `"SV_FMT"`", SvFmt(filename));
     return filename;
 }
 
+#include "hash.c"
+#include "scratch.c"
+#include "glob.c"
+#include "fs.c"
 #include "lexer.c"
 #include "parser.c"
+#include "bccache.c"
+#include "optimizer.c"
+#include "command.c"
+#include "profile.c"
+#include "module.c"
+#include "deps.c"
+#include "cache.c"
+#include "remote.c"
+#include "jobs.c"
 #include "interpreter.c"
+#include "verify.c"
+#include "watch.c"
+#include "daemon.c"
+#include "worker.c"
 
-int main(int argc, char** argv) {
-    Flags flags = {0};
-    String filename = parse_args(argc, argv, &flags);
-    String content = file_read(filename, &arena);
+// Reads the recipe and the files it includes, or their parsed form from the
+// cache
+Bytecode* load_bytecode(String filename, Flags* flags) {
+    bccache_enabled = !flags->no_bytecode_cache;
+    Bytecode* bytecode = module_load(filename, !flags->watch && !flags->daemon);
+    uint64_t start = profile_now();
+    if (flags->optimize) bytecode = optimize_bytecode(bytecode);
+    if (flags->optimize) profile_phase("optimize", start);
+    return bytecode;
+}
+
+Program load_program(Bytecode* bytecode) {
+    uint64_t start = profile_now();
+    Program program = interpret_compile(bytecode);
+    verify_program(&program);
+    profile_phase("verify", start);
+    return program;
+}
+
+void run_program(Program* program, Flags* flags) {
+    uint64_t start = profile_now();
+    interpret_program(program, flags->targets);
+    // Jobs spawned and never waited for are done before the run is
+    jobs_wait_all();
+    profile_phase("run", start);
+    if (flags->stats) fs_print_stats();
+    profile_report();
+}
 
-    Lexer lexer = lexer_new(filename, content);
-    TokenArray* tokens = lexer_tokenize(&lexer);
-    lexer_crossreference(tokens);
+// Everything but the daemon, which runs this in its workers
+int mako(String filename, Flags* flags) {
+    if (flags->profile) profile_init();
 
-    if (flags.mode == TOKENIZE) {
+    if (flags->mode == TOKENIZE) {
+        Lexer lexer = lexer_new(filename, fs_map_file(filename));
+        TokenArray* tokens = lexer_tokenize(&lexer);
+        lexer_crossreference(tokens);
         array_foreach(tokens, i) {
             Token token = TokenArray_get(tokens, i);
             printf(LOC_FMT": %zu->%zu; `"SV_FMT"`/%d (%d)\n", LocFmt(token.loc), i, token.corresponding, SvFmt(token.content), token.value, token.type);
@@ -96,19 +223,60 @@ int main(int argc, char** argv) {
         return 0;
     }
 
-    Bytecode* bytecode = parse_bytecode(tokens);
-    
-    if (flags.mode == PARSE) {
-        array_foreach(bytecode, i) {
-            Operation op = Bytecode_get(bytecode, i);
-            printf(LOC_FMT": %zu: `"SV_FMT"`/%zu (%d)\n", LocFmt(op.loc), i, SvFmt(op.operand), op.location, op.type);
+    if (flags->watch) {
+        // Even the first load may fail; then the recipe is waited on alone
+        if (watch_fork(true)) { load_program(load_bytecode(filename, flags)); exit(0); }
+        while (watch_status != 0) {
+            watch_wait(filename);
+            if (watch_fork(true)) { load_program(load_bytecode(filename, flags)); exit(0); }
         }
-        return 0;
+    }
+    Program program;
+    if (!daemon_find(filename, flags, &program)) {
+        Bytecode* bytecode = load_bytecode(filename, flags);
+
+        if (flags->mode == PARSE) {
+            array_foreach(bytecode, i) {
+                Operation op = Bytecode_get(bytecode, i);
+                printf(LOC_FMT": %zu: `"SV_FMT"`/%zu (%d)\n", LocFmt(op.loc), i, SvFmt(op.operand), op.location, op.type);
+            }
+            return 0;
+        }
+        program = load_program(bytecode);
+        daemon_loaded(filename, flags);
     }
 
-    interpret_bytecode(bytecode);
+    jobs_init(flags->jobs);
+    remote_init(flags->workers);
+    cache_enabled = !flags->no_cache;
+    if (flags->watch) {
+        for (;;) {
+            if (watch_fork(true)) { run_program(&program, flags); exit(0); }
+            // A recipe that no longer parses is waited on until it does
+            while (watch_wait(filename)) {
+                if (watch_fork(true)) { load_program(load_bytecode(filename, flags)); exit(0); }
+                if (watch_status == 0) { program = load_program(load_bytecode(filename, flags)); break; }
+            }
+        }
+    }
+    run_program(&program, flags);
 
+    jobs_running = NULL; // it goes with the arena
     arena_free(&arena);
     
     return 0;
 }
+
+#ifndef MAKO_NO_MAIN // bench/bench.c has a main of its own
+int main(int argc, char** argv) {
+    Flags flags = {0};
+    String filename = parse_args(argc, argv, &flags);
+    if (flags.worker.size > 0) worker_serve(flags.worker, flags.jobs);
+    if (flags.daemon) daemon_serve();
+    // A running daemon takes plain runs; the rest are quick or long-lived
+    int status;
+    bool plain = flags.mode == DEFAULT && !flags.watch && !flags.no_daemon;
+    if (plain && daemon_forward(argc, argv, &status)) return status;
+    return mako(filename, &flags);
+}
+#endif // MAKO_NO_MAIN
@@ -0,0 +1,269 @@
+// A recipe may be split into files with `include "path"`, the path being
+// relative to the file it's written in. Each file is lexed, parsed and cached
+// on its own, and the files found at the same depth of includes are parsed on
+// threads side by side. `module_link` then puts them together: an include is
+// replaced by the code of the file, the first time that file is included, and
+// macros defined in any file may be used in all of them.
+#define MODULE_MAX_THREADS 64
+
+typedef struct {
+    String filename; // as reached from the current directory
+    String content;
+    Bytecode* bytecode; // of this file alone
+    U32Array* includes; // the modules its OP_INCLUDEs name, in order
+    FsSeen seen; // just before it was read, for `--watch`
+} Module;
+
+array_define(ModuleArray, Module)
+array_implement(ModuleArray, Module)
+
+typedef struct {
+    String name;
+    size_t module, entry, size;
+    Location loc;
+    int state; // while looking for macros that expand to themselves
+} ModuleMacro;
+
+array_define(ModuleMacroArray, ModuleMacro)
+array_implement(ModuleMacroArray, ModuleMacro)
+
+ModuleArray* modules = NULL; // of the recipe loaded last; the first one is the recipe itself
+StringMap module_ids = {0}; // by real path
+
+typedef struct {
+    U32Array* parse; // modules to parse
+    size_t next;
+} ModuleWork;
+
+Bytecode* module_parse(Module module, bool included) {
+    // Tokens go along with the bytecode, which points into them
+    Arena* a = scratch_new();
+    Lexer lexer = lexer_new(module.filename, module.content);
+    lexer.arena = a;
+    TokenArray* tokens = lexer_tokenize(&lexer);
+    lexer_crossreference(tokens);
+    return parse_module(tokens, a, included);
+}
+
+void* module_worker(void* arg) {
+    ModuleWork* work = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+        if (i >= work->parse->size) break;
+        size_t index = U32Array_get(work->parse, i);
+        Module module = ModuleArray_get(modules, index);
+        module.bytecode = module_parse(module, index > 0);
+        ModuleArray_set(modules, index, module);
+    }
+    return NULL;
+}
+
+void module_parse_all(U32Array* parse) {
+    ModuleWork work = { .parse = parse };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = cpus < 1 ? 1 : cpus > MODULE_MAX_THREADS ? MODULE_MAX_THREADS : (size_t) cpus;
+    if (count > parse->size) count = parse->size;
+
+    // The calling thread is the first worker
+    pthread_t ids[MODULE_MAX_THREADS];
+    size_t started = 1;
+    for (size_t i = 1; i < count; i++) {
+        if (pthread_create(&ids[i], NULL, module_worker, &work) != 0) break;
+        started++;
+    }
+    module_worker(&work);
+    for (size_t i = 1; i < started; i++) pthread_join(ids[i], NULL);
+}
+
+// The module for a path, added if it's not there yet
+size_t module_add(String path, Location* loc) {
+    char cpath[PATH_MAX], resolved[PATH_MAX];
+    if (realpath(fs_cpath(path, cpath), resolved) == NULL) {
+        if (loc != NULL) lexer_error(*loc, "no file named `"SV_FMT"`", SvFmt(path));
+        error("no file named `"SV_FMT"`", SvFmt(path));
+    }
+    size_t id;
+    if (StringMap_get(&module_ids, sv(resolved), &id)) return id;
+    StringMap_set(&module_ids, scratch_keep(sv(resolved)), modules->size);
+    ModuleArray_push(modules, (Module) { .filename = path });
+    return modules->size - 1;
+}
+
+// Paths are relative to the file they are written in
+String module_path(String base, String path) {
+    size_t dir = base.size;
+    while (dir > 0 && sv_index(base, dir-1) != '/') dir--;
+    if (dir == 0 || (path.size > 0 && sv_index(path, 0) == '/')) return path;
+    StringBuilder* sb = StringBuilder_new(&arena);
+    for (size_t i = 0; i < dir; i++) StringBuilder_push(sb, sv_index(base, i));
+    for (size_t i = 0; i < path.size; i++) StringBuilder_push(sb, sv_index(path, i));
+    return sv_from_sb(sb);
+}
+
+void module_find_includes(size_t index) {
+    Module module = ModuleArray_get(modules, index);
+    module.includes = U32Array_new(&arena);
+    array_foreach(module.bytecode, i) {
+        Operation op = Bytecode_get(module.bytecode, i);
+        if (op.type != OP_INCLUDE) continue;
+        U32Array_push(module.includes, module_add(module_path(module.filename, op.operand), &op.loc));
+    }
+    ModuleArray_set(modules, index, module);
+}
+
+// Where the ops of a module end up once linked. An OP_INCLUDE is where the
+// code of the file it names starts, or nothing if the file was included before.
+size_t module_place(size_t index, size_t** where, size_t at) {
+    Module module = ModuleArray_get(modules, index);
+    where[index] = malloc(sizeof(size_t) * (module.bytecode->size + 1));
+    if (where[index] == NULL) error("out of memory");
+    size_t include = 0;
+    array_foreach(module.bytecode, i) {
+        Operation op = Bytecode_get(module.bytecode, i);
+        where[index][i] = at;
+        if (op.type == OP_INCLUDE) {
+            size_t included = U32Array_get(module.includes, include++);
+            if (where[included] == NULL) at = module_place(included, where, at);
+        } else if (op.type != OP_MACRO) at++;
+    }
+    where[index][module.bytecode->size] = at;
+    return at;
+}
+
+void module_emit(size_t index, size_t** where, bool* emitted, ModuleMacroArray* macros, StringMap* macro_ids, Bytecode* out) {
+    Module module = ModuleArray_get(modules, index);
+    emitted[index] = true;
+    size_t include = 0;
+    array_foreach(module.bytecode, i) {
+        Operation op = Bytecode_get(module.bytecode, i);
+        bool jumps = op.type == OP_JUMP || op.type == OP_JUMPZ || op.type == OP_JUMPNZ || op.type == OP_TARGET || op.type == OP_CALL;
+        if (op.type == OP_INCLUDE) {
+            size_t included = U32Array_get(module.includes, include++);
+            if (!emitted[included]) module_emit(included, where, emitted, macros, macro_ids, out);
+            continue;
+        }
+        if (op.type == OP_MACRO) continue;
+        if (op.type == OP_EXPAND) {
+            size_t id;
+            if (!StringMap_get(macro_ids, op.operand, &id)) lexer_error(op.loc, "no such macro as `"SV_FMT"`", SvFmt(op.operand));
+            ModuleMacro macro = ModuleMacroArray_get(macros, id);
+            op = (Operation) { .type = OP_CALL, .operand = macro.name, .location = where[macro.module][macro.entry], .loc = op.loc };
+        } else if (jumps) op.location = where[index][op.location];
+        Bytecode_push(out, op);
+    }
+}
+
+// Macros of a single file can't expand to themselves, the parser sees to it,
+// but they still can through macros of other files
+void module_check_macro(ModuleMacroArray* macros, StringMap* macro_ids, size_t id) {
+    ModuleMacro macro = ModuleMacroArray_get(macros, id);
+    if (macro.state == 2) return;
+    macro.state = 1;
+    ModuleMacroArray_set(macros, id, macro);
+    Bytecode* bc = ModuleArray_get(modules, macro.module).bytecode;
+    for (size_t pc = macro.entry; pc < macro.entry + macro.size; pc++) {
+        Operation op = Bytecode_get(bc, pc);
+        size_t callee = macros->size;
+        if (op.type == OP_EXPAND && !StringMap_get(macro_ids, op.operand, &callee)) continue;
+        if (op.type == OP_CALL) array_foreach(macros, m) {
+            ModuleMacro other = ModuleMacroArray_get(macros, m);
+            if (other.module == macro.module && other.entry == op.location) callee = m;
+        }
+        if (callee == macros->size) continue;
+        if (ModuleMacroArray_get(macros, callee).state == 1) lexer_error(op.loc, "macro `"SV_FMT"` expands to itself", SvFmt(op.operand));
+        module_check_macro(macros, macro_ids, callee);
+    }
+    macro = ModuleMacroArray_get(macros, id);
+    macro.state = 2;
+    ModuleMacroArray_set(macros, id, macro);
+}
+
+// Puts the loaded files together into the bytecode of the recipe
+Bytecode* module_link(void) {
+    Bytecode* root = ModuleArray_get(modules, 0).bytecode;
+    bool linked = modules->size == 1;
+    for (size_t i = 0; i < root->size && linked; i++) linked = Bytecode_get(root, i).type < COUNT_OPS;
+    if (linked) return root;
+
+    ModuleMacroArray* macros = ModuleMacroArray_new(&arena);
+    StringMap macro_ids = {0};
+    bool expands = false;
+    array_foreach(modules, m) {
+        Bytecode* bc = ModuleArray_get(modules, m).bytecode;
+        array_foreach(bc, i) {
+            Operation op = Bytecode_get(bc, i);
+            expands = expands || op.type == OP_EXPAND;
+            if (op.type != OP_MACRO) continue;
+            size_t id;
+            if (StringMap_get(&macro_ids, op.operand, &id)) lexer_error(op.loc, "macro redefinition");
+            StringMap_set(&macro_ids, op.operand, macros->size);
+            ModuleMacroArray_push(macros, (ModuleMacro) { .name = op.operand, .module = m, .entry = op.location, .size = op.value, .loc = op.loc });
+        }
+    }
+    if (expands) array_foreach(macros, i) module_check_macro(macros, &macro_ids, i);
+
+    size_t** where = calloc(modules->size, sizeof(size_t*));
+    bool* emitted = calloc(modules->size, sizeof(bool));
+    if (where == NULL || emitted == NULL) error("out of memory");
+    module_place(0, where, 0);
+    Bytecode* bc = Bytecode_new(&arena);
+    module_emit(0, where, emitted, macros, &macro_ids, bc);
+
+    for (size_t i = 0; i < modules->size; i++) free(where[i]);
+    free(where);
+    free(emitted);
+    StringMap_clear(&macro_ids);
+    return bc;
+}
+
+// Loads the recipe and every file it includes, from the cache where possible
+Bytecode* module_load(String filename, bool map) {
+    modules = ModuleArray_new(&arena);
+    StringMap_clear(&module_ids);
+    module_add(filename, NULL);
+
+    for (size_t done = 0; done < modules->size;) {
+        size_t wave = modules->size;
+        uint64_t start = profile_now();
+        for (size_t i = done; i < wave; i++) {
+            Module module = ModuleArray_get(modules, i);
+            module.seen = fs_seen(module.filename);
+            // A mapping would change under the bytecode when the file is edited
+            if (map) module.content = fs_map_file(module.filename);
+            else if (!fs_read_file(module.filename, &module.content, &arena)) error("could not read `"SV_FMT"`: %s", SvFmt(module.filename), strerror(errno));
+            ModuleArray_set(modules, i, module);
+        }
+        profile_phase("read", start);
+
+        start = profile_now();
+        U32Array* parse = U32Array_new(&arena);
+        for (size_t i = done; i < wave; i++) {
+            Module module = ModuleArray_get(modules, i);
+            module.bytecode = bccache_load(module.filename, module.content);
+            if (module.bytecode == NULL) U32Array_push(parse, i);
+            ModuleArray_set(modules, i, module);
+        }
+        profile_phase("load cache", start);
+
+        if (parse->size > 0) {
+            start = profile_now();
+            module_parse_all(parse);
+            profile_phase("lex+parse", start);
+            start = profile_now();
+            array_foreach(parse, i) {
+                Module module = ModuleArray_get(modules, U32Array_get(parse, i));
+                bccache_save(module.filename, module.content, module.bytecode);
+            }
+            profile_phase("save cache", start);
+        }
+
+        // What these include is the next wave
+        for (size_t i = done; i < wave; i++) module_find_includes(i);
+        done = wave;
+    }
+
+    uint64_t start = profile_now();
+    Bytecode* bc = module_link();
+    if (modules->size > 1) profile_phase("link", start);
+    return bc;
+}
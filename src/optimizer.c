@@ -0,0 +1,213 @@
+// Peephole passes over the bytecode, enabled with `--optimize`. They rewrite
+// instructions in place and mark the ones that are gone as dead, over and over
+// until nothing changes; then the bytecode is compacted and jumps remapped.
+typedef struct {
+    Bytecode* bc;
+    bool* dead;
+    bool* entry; // control flow may get here other than from the previous instruction
+    bool* reached;
+    bool changed;
+} Optimizer;
+
+bool optimize_jumps(OpType type) {
+    return type == OP_JUMP || type == OP_JUMPZ || type == OP_JUMPNZ || type == OP_CALL || type == OP_TARGET;
+}
+
+// The first live instruction at or after `pc`
+size_t optimize_live(Optimizer* o, size_t pc) {
+    while (pc < o->bc->size && o->dead[pc]) pc++;
+    return pc;
+}
+
+size_t optimize_next(Optimizer* o, size_t pc) {
+    return optimize_live(o, pc + 1);
+}
+
+// Whether `b` can only be reached by falling through from `a`
+bool optimize_joinable(Optimizer* o, size_t a, size_t b) {
+    if (b >= o->bc->size) return false;
+    for (size_t i = a + 1; i <= b; i++) if (o->entry[i]) return false;
+    return true;
+}
+
+void optimize_kill(Optimizer* o, size_t pc) {
+    o->dead[pc] = true;
+    o->changed = true;
+}
+
+void optimize_set(Optimizer* o, size_t pc, Operation op) {
+    Bytecode_set(o->bc, pc, op);
+    o->changed = true;
+}
+
+void optimize_find_entries(Optimizer* o) {
+    memset(o->entry, 0, o->bc->size + 1);
+    array_foreach(o->bc, pc) {
+        if (o->dead[pc]) continue;
+        Operation op = Bytecode_get(o->bc, pc);
+        if (optimize_jumps(op.type)) o->entry[op.location] = true;
+        if (op.type == OP_CALL) o->entry[pc + 1] = true; // returned to
+        if (op.type == OP_TARGET) {
+            // Dependencies are looked up by their position, and the body
+            // is started on its own
+            for (size_t i = pc + 1; i <= pc + 1 + op.value; i++) o->entry[i] = true;
+        }
+    }
+}
+
+// Folds an integer operation on two constants; false if it can't be folded
+bool optimize_fold(OpType type, int a, int b, Operation* result) {
+    result->type = OP_PUSH_BOOL;
+    switch (type) {
+        case OP_GTEQ: result->value = a >= b; return true;
+        case OP_LTEQ: result->value = a <= b; return true;
+        case OP_GT: result->value = a > b; return true;
+        case OP_LT: result->value = a < b; return true;
+        case OP_EQ: result->value = a == b; return true;
+        default: break;
+    }
+    // What would overflow, or trap, is left for the run to do where it is
+    int64_t value;
+    switch (type) {
+        case OP_ADD: value = (int64_t) a + b; break;
+        case OP_SUB: value = (int64_t) a - b; break;
+        case OP_MUL: value = (int64_t) a * b; break;
+        case OP_DIV: if (b == 0) return false; value = (int64_t) a / b; break;
+        default: return false;
+    }
+    if (value < INT32_MIN || value > INT32_MAX) return false;
+    result->type = OP_PUSH_INT;
+    result->value = value;
+    return true;
+}
+
+void optimize_peephole(Optimizer* o) {
+    optimize_find_entries(o);
+    for (size_t pc = optimize_live(o, 0); pc < o->bc->size; pc = optimize_next(o, pc)) {
+        Operation op = Bytecode_get(o->bc, pc);
+
+        // A jump to a jump goes straight to where the latter goes
+        if (op.type == OP_JUMP || op.type == OP_JUMPZ || op.type == OP_JUMPNZ) {
+            size_t to = optimize_live(o, op.location);
+            for (size_t hops = 0; to < o->bc->size && hops < o->bc->size; hops++) {
+                Operation next = Bytecode_get(o->bc, to);
+                if (next.type != OP_JUMP || next.location == to) break;
+                to = optimize_live(o, next.location);
+            }
+            if (to != op.location) {
+                op.location = to;
+                optimize_set(o, pc, op);
+            }
+        }
+        if (op.type == OP_JUMP && optimize_live(o, op.location) == optimize_next(o, pc)) {
+            optimize_kill(o, pc);
+            continue;
+        }
+
+        size_t b = optimize_next(o, pc);
+        if (!optimize_joinable(o, pc, b)) continue;
+        Operation second = Bytecode_get(o->bc, b);
+
+        if ((op.type == OP_PUSH_STRING || op.type == OP_PUSH_INT || op.type == OP_PUSH_BOOL || op.type == OP_DUP) && second.type == OP_DROP) {
+            optimize_kill(o, pc);
+            optimize_kill(o, b);
+        } else if (op.type == OP_PUSH_BOOL && second.type == OP_NOT) {
+            op.value = !op.value;
+            optimize_set(o, pc, op);
+            optimize_kill(o, b);
+        } else if (op.type == OP_NOT && second.type == OP_NOT) {
+            optimize_kill(o, pc);
+            optimize_kill(o, b);
+        } else if (op.type == OP_NOT && (second.type == OP_JUMPZ || second.type == OP_JUMPNZ)) {
+            second.type = second.type == OP_JUMPZ ? OP_JUMPNZ : OP_JUMPZ;
+            optimize_set(o, b, second);
+            optimize_kill(o, pc);
+        } else if (op.type == OP_PUSH_BOOL && (second.type == OP_JUMPZ || second.type == OP_JUMPNZ)) {
+            // A branch on a constant either always jumps or never does
+            bool jumps = second.type == OP_JUMPZ ? op.value == 0 : op.value != 0;
+            if (jumps) {
+                second.type = OP_JUMP;
+                optimize_set(o, b, second);
+                optimize_kill(o, pc);
+            } else {
+                optimize_kill(o, pc);
+                optimize_kill(o, b);
+            }
+        } else if (op.type == OP_PUSH_INT && second.type == OP_PUSH_INT) {
+            size_t c = optimize_next(o, b);
+            if (!optimize_joinable(o, b, c)) continue;
+            Operation result = op;
+            if (!optimize_fold(Bytecode_get(o->bc, c).type, op.value, second.value, &result)) continue;
+            optimize_set(o, pc, result);
+            optimize_kill(o, b);
+            optimize_kill(o, c);
+        }
+    }
+}
+
+void optimize_reach(Optimizer* o, U32Array* worklist, size_t pc) {
+    pc = optimize_live(o, pc);
+    if (pc >= o->bc->size || o->reached[pc]) return;
+    o->reached[pc] = true;
+    U32Array_push(worklist, pc);
+}
+
+// Drops whatever can't be reached from the start, like branches on constants
+void optimize_unreachable(Optimizer* o) {
+    memset(o->reached, 0, o->bc->size + 1);
+    U32Array* worklist = U32Array_new(&arena);
+    optimize_reach(o, worklist, 0);
+    while (worklist->size > 0) {
+        size_t pc = U32Array_get(worklist, worklist->size-1);
+        U32Array_pop(worklist);
+        Operation op = Bytecode_get(o->bc, pc);
+        if (optimize_jumps(op.type)) optimize_reach(o, worklist, op.location);
+        if (op.type == OP_TARGET) {
+            for (size_t i = pc + 1; i <= pc + op.value; i++) o->reached[i] = true;
+            optimize_reach(o, worklist, pc + 1 + op.value);
+        } else if (op.type != OP_JUMP && op.type != OP_RET && op.type != OP_ERROR && op.type != OP_DEBUG) {
+            optimize_reach(o, worklist, pc + 1);
+        }
+    }
+    array_foreach(o->bc, pc) {
+        if (!o->dead[pc] && !o->reached[pc]) optimize_kill(o, pc);
+    }
+}
+
+Bytecode* optimize_bytecode(Bytecode* bc) {
+    Optimizer o = {
+        .bc = bc,
+        .dead = calloc(bc->size + 1, sizeof(bool)),
+        .entry = calloc(bc->size + 1, sizeof(bool)),
+        .reached = calloc(bc->size + 1, sizeof(bool)),
+        .changed = true,
+    };
+    if (o.dead == NULL || o.entry == NULL || o.reached == NULL) error("out of memory");
+    while (o.changed) {
+        o.changed = false;
+        optimize_peephole(&o);
+        optimize_unreachable(&o);
+    }
+
+    // Every location maps to the first live instruction at or after it
+    size_t* remap = malloc(sizeof(size_t) * (bc->size + 1));
+    if (remap == NULL) error("out of memory");
+    size_t live = 0;
+    for (size_t pc = 0; pc <= bc->size; pc++) {
+        remap[pc] = live;
+        if (pc < bc->size && !o.dead[pc]) live++;
+    }
+    Bytecode* optimized = Bytecode_new(&arena);
+    array_foreach(bc, pc) {
+        if (o.dead[pc]) continue;
+        Operation op = Bytecode_get(bc, pc);
+        if (optimize_jumps(op.type)) op.location = remap[op.location];
+        Bytecode_push(optimized, op);
+    }
+
+    free(remap);
+    free(o.dead);
+    free(o.entry);
+    free(o.reached);
+    return optimized;
+}
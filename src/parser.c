@@ -6,10 +6,20 @@ typedef enum {
     OP_PUSH_BOOL,
     OP_DEBUG,
     OP_CMD,
+    OP_MEMO,
+    OP_REMOTE,
     OP_RUN,
+    OP_SPAWN,
+    OP_CAPTURE,
+    OP_CAPTUREWORDS,
+    OP_WAIT,
+    OP_WAITALL,
     OP_JUMP,
     OP_JUMPZ,
     OP_JUMPNZ,
+    OP_TARGET,
+    OP_CALL,
+    OP_RET,
     OP_GTEQ,
     OP_LTEQ,
     OP_GT,
@@ -32,10 +42,30 @@ typedef enum {
     OP_GETCWD,
     OP_LISTDIR,
     OP_FNMATCH,
+    OP_NEWER,
+    OP_UPTODATE,
+    OP_INPUT,
+    OP_OUTPUT,
+    OP_DEPFILE,
+    OP_EXCLUDE,
+    OP_COPY,
+    OP_COPYDIR,
+    OP_REMOVE,
+    OP_REMOVEDIR,
+    OP_RENAME,
+    OP_TOUCH,
+    OP_WRITE,
     OP_LOG,
     OP_ERROR,
     OP_PRINT,
-    COUNT_OPS
+    COUNT_OPS,
+
+    // Only in a file's own bytecode, until `module_link` puts the files of a
+    // recipe together
+    OP_INCLUDE = COUNT_OPS, // the path, as written
+    OP_MACRO, // a macro this file defines: its name, entry and size
+    OP_EXPAND, // a use of a macro this file doesn't define (before the use)
+    COUNT_MODULE_OPS
 } OpType;
 
 typedef struct {
@@ -49,14 +79,63 @@ typedef struct {
 array_define(Bytecode, Operation)
 array_implement(Bytecode, Operation)
 
+typedef enum {
+    MACRO_UNCOMPILED = 0,
+    MACRO_COMPILING,
+    MACRO_COMPILED,
+} MacroState;
+
 typedef struct {
     String name;
-    size_t start, end;
+    size_t start, end; // body tokens
+    bool defined;
+    bool expanded; // before it was defined: `loc` is where
+    MacroState state;
+    size_t entry, size; // compiled body ops, not counting the final OP_RET
+    Location loc;
 } Macro;
 
+// Macros with bodies this small are copied in place instead of being called
+#define MACRO_INLINE_SIZE 3
+
 array_define(MacroArray, Macro)
 array_implement(MacroArray, Macro)
 
+void parse_bytecode_indexed(TokenArray* tokens, size_t start, size_t end, Bytecode* bc, MacroArray* ma, size_t depth);
+
+// The body is compiled once, on first use, as a subroutine that the
+// surrounding code jumps over
+Macro parse_macro(TokenArray* tokens, Bytecode* bc, MacroArray* ma, size_t symbol, Location loc, size_t depth) {
+    Macro macro = MacroArray_get(ma, symbol);
+    macro.state = MACRO_COMPILING;
+    MacroArray_set(ma, symbol, macro);
+    size_t j_index = bc->size;
+    Bytecode_push(bc, (Operation) { .type = OP_JUMP, .loc = loc });
+    size_t entry = bc->size;
+    parse_bytecode_indexed(tokens, macro.start, macro.end, bc, ma, depth+1);
+    Bytecode_push(bc, (Operation) { .type = OP_RET, .operand = macro.name, .loc = TokenArray_get(tokens, macro.end).loc });
+
+    // Commands remember their macro for `--profile`, unless they come from a
+    // macro used inside this one
+    for (size_t m = entry; m < bc->size; m++) {
+        Operation op = Bytecode_get(bc, m);
+        bool command = op.type == OP_RUN || op.type == OP_SPAWN || op.type == OP_CAPTURE || op.type == OP_CAPTUREWORDS;
+        if (!command || op.operand.size > 0) continue;
+        op.operand = macro.name;
+        Bytecode_set(bc, m, op);
+    }
+
+    Operation j = Bytecode_get(bc, j_index);
+    j.location = bc->size;
+    Bytecode_set(bc, j_index, j);
+    macro = MacroArray_get(ma, symbol);
+    macro.state = MACRO_COMPILED;
+    macro.entry = entry;
+    macro.size = bc->size - entry - 1;
+    MacroArray_set(ma, symbol, macro);
+    return macro;
+}
+
 void parse_bytecode_indexed(TokenArray* tokens, size_t start, size_t end, Bytecode* bc, MacroArray* ma, size_t depth) {
     if (depth >= 100) error("exceeded critical parse depth");
     for (size_t i = start; i < end; i++) {
@@ -71,17 +150,13 @@ void parse_bytecode_indexed(TokenArray* tokens, size_t start, size_t end, Byteco
             if (ocurly.type != TOKEN_OCURLY) {
                 lexer_error(ocurly.loc, "expected a `{`, got `"SV_FMT"`", SvFmt(ocurly.content));
             }
-            bool macro_found = false;
-            array_foreach(ma, m) {
-                Macro macro = MacroArray_get(ma, m);
-                if (sv_compare(macro.name, macro_name)) {
-                    macro_found = true;
-                    break;
-                }
-            }
-            if (macro_found) lexer_error(name.loc, "macro redefinition");
-            Macro macro = { macro_name, i + 1, ocurly.corresponding };
-            MacroArray_push(ma, macro);
+            Macro defined = MacroArray_get(ma, name.symbol);
+            if (defined.defined) lexer_error(name.loc, "macro redefinition");
+            // Only names from other files are bound late; in its own file, a
+            // macro has to be defined before it's used, includes or not
+            if (defined.expanded) lexer_error(defined.loc, "no such macro as `"SV_FMT"`", SvFmt(macro_name));
+            Macro macro = { .name = macro_name, .start = i + 1, .end = ocurly.corresponding, .defined = true, .loc = name.loc };
+            MacroArray_set(ma, name.symbol, macro);
             i = ocurly.corresponding;
         } else if (token.type == TOKEN_STRING) Bytecode_push(bc, (Operation) { .type = OP_PUSH_STRING, .operand = token.content, .loc = token.loc });
         else if (token.type == TOKEN_INTEGER) Bytecode_push(bc, (Operation) { .type = OP_PUSH_INT, .value = token.value, .loc = token.loc });
@@ -145,19 +220,70 @@ void parse_bytecode_indexed(TokenArray* tokens, size_t start, size_t end, Byteco
             Bytecode_set(bc, jz, jz_op);
             i = block_end;
             
+        } else if (token.type == TOKEN_TARGET) {
+            // Lowered to OP_TARGET (jumps over the rest), one OP_NOP per
+            // dependency carrying its name, then the body ending in OP_RET
+            i++; Token name = TokenArray_get(tokens, i);
+            if (name.type != TOKEN_WORD && name.type != TOKEN_STRING) {
+                lexer_error(name.loc, "expected a target name, got `"SV_FMT"`", SvFmt(name.content));
+            }
+            size_t target_index = bc->size;
+            Bytecode_push(bc, (Operation) { .type = OP_TARGET, .operand = name.content, .loc = token.loc });
+
+            int deps = 0;
+            for (i++; i < end; i++) {
+                Token dep = TokenArray_get(tokens, i);
+                if (dep.type == TOKEN_OCURLY) break;
+                if (dep.type != TOKEN_WORD && dep.type != TOKEN_STRING) {
+                    lexer_error(dep.loc, "expected a target name or a `{`, got `"SV_FMT"`", SvFmt(dep.content));
+                }
+                Bytecode_push(bc, (Operation) { .type = OP_NOP, .operand = dep.content, .loc = dep.loc });
+                deps++;
+            }
+            if (i >= end) lexer_error(name.loc, "expected a `{` after the target");
+            Token ocurly = TokenArray_get(tokens, i);
+
+            parse_bytecode_indexed(tokens, i + 1, ocurly.corresponding, bc, ma, depth + 1);
+            Bytecode_push(bc, (Operation) { .type = OP_RET, .loc = TokenArray_get(tokens, ocurly.corresponding).loc });
+
+            Operation target = Bytecode_get(bc, target_index);
+            target.value = deps;
+            target.location = bc->size;
+            Bytecode_set(bc, target_index, target);
+            i = ocurly.corresponding;
+
+        } else if (token.type == TOKEN_INCLUDE) {
+            // Left for `module_load` to find the file, and for `module_link`
+            // to put its code here
+            if (depth > 0) lexer_error(token.loc, "`include` is only allowed at the top level of a file");
+            i++;
+            Token path = i < end ? TokenArray_get(tokens, i) : token;
+            if (path.type != TOKEN_STRING) lexer_error(path.loc, "expected a path after `include`");
+            Bytecode_push(bc, (Operation) { .type = OP_INCLUDE, .operand = path.content, .loc = token.loc });
         } else if (token.type == TOKEN_WORD) {
             // Assume macro expansion
-            bool macro_found = false;
-            Macro macro;
-            array_foreach(ma, m) {
-                macro = MacroArray_get(ma, m);
-                if (sv_compare(macro.name, token.content)) {
-                    macro_found = true;
-                    break;
+            Macro macro = MacroArray_get(ma, token.symbol);
+            if (!macro.defined) {
+                // Another file may define it; if none does, it's reported then
+                if (!macro.expanded) MacroArray_set(ma, token.symbol, (Macro) { .expanded = true, .loc = token.loc });
+                Bytecode_push(bc, (Operation) { .type = OP_EXPAND, .operand = token.content, .loc = token.loc });
+                continue;
+            }
+            if (macro.state == MACRO_COMPILING) lexer_error(token.loc, "macro `"SV_FMT"` expands to itself", SvFmt(token.content));
+            if (macro.state == MACRO_UNCOMPILED) macro = parse_macro(tokens, bc, ma, token.symbol, token.loc, depth);
+            if (macro.size <= MACRO_INLINE_SIZE) {
+                size_t base = bc->size;
+                for (size_t m = macro.entry; m < macro.entry + macro.size; m++) {
+                    Operation op = Bytecode_get(bc, m);
+                    bool jumps = op.type == OP_JUMP || op.type == OP_JUMPZ || op.type == OP_JUMPNZ || op.type == OP_TARGET;
+                    if (jumps && op.location >= macro.entry && op.location <= macro.entry + macro.size) {
+                        op.location = op.location - macro.entry + base;
+                    }
+                    Bytecode_push(bc, op);
                 }
+            } else {
+                Bytecode_push(bc, (Operation) { .type = OP_CALL, .operand = macro.name, .location = macro.entry, .loc = token.loc });
             }
-            if (!macro_found) lexer_error(token.loc, "no such macro as `"SV_FMT"`", SvFmt(token.content));
-            parse_bytecode_indexed(tokens, macro.start, macro.end, bc, ma, depth+1);
         } else if (token.type == TOKEN_BANG) Bytecode_push(bc, (Operation) { .type = OP_NOT, .loc = token.loc });
         else if (token.type == TOKEN_GTEQ) Bytecode_push(bc, (Operation) { .type = OP_GTEQ, .loc = token.loc });
         else if (token.type == TOKEN_LTEQ) Bytecode_push(bc, (Operation) { .type = OP_LTEQ, .loc = token.loc });
@@ -172,7 +298,14 @@ void parse_bytecode_indexed(TokenArray* tokens, size_t start, size_t end, Byteco
             // Intrinsic call
             Operation op = { .loc = token.loc };
             if (token.type == TOKEN_RUN) op.type = OP_RUN;
+            else if (token.type == TOKEN_SPAWN) op.type = OP_SPAWN;
+            else if (token.type == TOKEN_CAPTURE) op.type = OP_CAPTURE;
+            else if (token.type == TOKEN_CAPTUREWORDS) op.type = OP_CAPTUREWORDS;
+            else if (token.type == TOKEN_WAIT) op.type = OP_WAIT;
+            else if (token.type == TOKEN_WAITALL) op.type = OP_WAITALL;
             else if (token.type == TOKEN_CMD) op.type = OP_CMD;
+            else if (token.type == TOKEN_MEMO) op.type = OP_MEMO;
+            else if (token.type == TOKEN_REMOTE) op.type = OP_REMOTE;
             else if (token.type == TOKEN_DUP) op.type = OP_DUP;
             else if (token.type == TOKEN_DROP) op.type = OP_DROP;
             else if (token.type == TOKEN_SWAP) op.type = OP_SWAP;
@@ -185,6 +318,19 @@ void parse_bytecode_indexed(TokenArray* tokens, size_t start, size_t end, Byteco
             else if (token.type == TOKEN_GETCWD) op.type = OP_GETCWD;
             else if (token.type == TOKEN_LISTDIR) op.type = OP_LISTDIR;
             else if (token.type == TOKEN_FNMATCH) op.type = OP_FNMATCH;
+            else if (token.type == TOKEN_NEWER) op.type = OP_NEWER;
+            else if (token.type == TOKEN_UPTODATE) op.type = OP_UPTODATE;
+            else if (token.type == TOKEN_INPUT) op.type = OP_INPUT;
+            else if (token.type == TOKEN_OUTPUT) op.type = OP_OUTPUT;
+            else if (token.type == TOKEN_DEPFILE) op.type = OP_DEPFILE;
+            else if (token.type == TOKEN_EXCLUDE) op.type = OP_EXCLUDE;
+            else if (token.type == TOKEN_COPY) op.type = OP_COPY;
+            else if (token.type == TOKEN_COPYDIR) op.type = OP_COPYDIR;
+            else if (token.type == TOKEN_REMOVE) op.type = OP_REMOVE;
+            else if (token.type == TOKEN_REMOVEDIR) op.type = OP_REMOVEDIR;
+            else if (token.type == TOKEN_RENAME) op.type = OP_RENAME;
+            else if (token.type == TOKEN_TOUCH) op.type = OP_TOUCH;
+            else if (token.type == TOKEN_WRITE) op.type = OP_WRITE;
             else if (token.type == TOKEN_LOG) op.type = OP_LOG;
             else if (token.type == TOKEN_ERROR) op.type = OP_ERROR;
             else if (token.type == TOKEN_PRINT) op.type = OP_PRINT;
@@ -196,9 +342,31 @@ void parse_bytecode_indexed(TokenArray* tokens, size_t start, size_t end, Byteco
     }
 }
 
-Bytecode* parse_bytecode(TokenArray* tokens) {
-    Bytecode* bc = Bytecode_new(&arena);
-    MacroArray* ma = MacroArray_new(&arena);
+// Bytecode of a single file. Macros are shared by all files of a recipe, so a
+// file that is included, or includes others, compiles the macros it didn't use
+// itself too, and lists them all with OP_MACRO at the end.
+Bytecode* parse_module(TokenArray* tokens, Arena* a, bool included) {
+    Bytecode* bc = Bytecode_new(a);
+    // Macros are indexed by symbol of their name
+    MacroArray* ma = MacroArray_new(a);
+    for (size_t i = 0; symbols != NULL && i < symbols->size; i++) MacroArray_push(ma, (Macro) {0});
     parse_bytecode_indexed(tokens, 0, tokens->size, bc, ma, 0);
+
+    bool includes = included;
+    for (size_t i = 0; i < bc->size && !includes; i++) includes = Bytecode_get(bc, i).type == OP_INCLUDE;
+    if (!includes) return bc;
+    array_foreach(ma, i) {
+        Macro macro = MacroArray_get(ma, i);
+        if (macro.defined && macro.state == MACRO_UNCOMPILED) parse_macro(tokens, bc, ma, i, macro.loc, 0);
+    }
+    array_foreach(ma, i) {
+        Macro macro = MacroArray_get(ma, i);
+        if (!macro.defined) continue;
+        Bytecode_push(bc, (Operation) { .type = OP_MACRO, .operand = macro.name, .location = macro.entry, .value = macro.size, .loc = macro.loc });
+    }
     return bc;
 }
+
+Bytecode* parse_bytecode(TokenArray* tokens) {
+    return parse_module(tokens, &arena, false);
+}
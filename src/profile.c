@@ -0,0 +1,235 @@
+// `--profile`: timestamps of the phases of a run, how often each operation
+// was executed, and wall and CPU time of every command. Printed as a table
+// once done, and written as a Chrome trace (chrome://tracing, Perfetto).
+#define PROFILE_TRACE "trace.json"
+#define PROFILE_TOP_COMMANDS 10
+
+typedef struct {
+    String name;
+    bool command;
+    uint64_t start, end; // ns since the start of the run
+    uint64_t cpu_user, cpu_system; // us, of commands
+    Location loc; // of the command
+    String macro; // the command comes from, empty if none
+    size_t lane; // row in the trace, so concurrent commands don't overlap
+} ProfileEvent;
+
+array_define(ProfileArray, ProfileEvent)
+array_implement(ProfileArray, ProfileEvent)
+
+bool profile_enabled = false;
+uint64_t profile_epoch = 0;
+size_t* profile_ops = NULL; // executions by OpType, NULL unless profiling
+ProfileArray* profile_events = NULL;
+char profile_trace_path[PATH_MAX];
+
+char* profile_op_names[COUNT_OPS] = {
+    [OP_NOP] = "nop",
+    [OP_PUSH_STRING] = "push_string",
+    [OP_PUSH_INT] = "push_int",
+    [OP_PUSH_BOOL] = "push_bool",
+    [OP_DEBUG] = "debug",
+    [OP_CMD] = "cmd",
+    [OP_MEMO] = "memo",
+    [OP_REMOTE] = "remote",
+    [OP_RUN] = "run",
+    [OP_SPAWN] = "spawn",
+    [OP_CAPTURE] = "capture",
+    [OP_CAPTUREWORDS] = "capturewords",
+    [OP_WAIT] = "wait",
+    [OP_WAITALL] = "waitall",
+    [OP_JUMP] = "jump",
+    [OP_JUMPZ] = "jumpz",
+    [OP_JUMPNZ] = "jumpnz",
+    [OP_TARGET] = "target",
+    [OP_CALL] = "call",
+    [OP_RET] = "ret",
+    [OP_GTEQ] = "gteq",
+    [OP_LTEQ] = "lteq",
+    [OP_GT] = "gt",
+    [OP_LT] = "lt",
+    [OP_EQ] = "eq",
+    [OP_ADD] = "add",
+    [OP_SUB] = "sub",
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_DUP] = "dup",
+    [OP_DROP] = "drop",
+    [OP_SWAP] = "swap",
+    [OP_OVER] = "over",
+    [OP_ROT] = "rot",
+    [OP_NOT] = "not",
+    [OP_FILEEXISTS] = "fileexists",
+    [OP_DIREXISTS] = "direxists",
+    [OP_MKDIR] = "mkdir",
+    [OP_CD] = "cd",
+    [OP_GETCWD] = "getcwd",
+    [OP_LISTDIR] = "listdir",
+    [OP_FNMATCH] = "fnmatch",
+    [OP_NEWER] = "newer",
+    [OP_UPTODATE] = "uptodate",
+    [OP_INPUT] = "input",
+    [OP_OUTPUT] = "output",
+    [OP_DEPFILE] = "depfile",
+    [OP_EXCLUDE] = "exclude",
+    [OP_COPY] = "copy",
+    [OP_COPYDIR] = "copydir",
+    [OP_REMOVE] = "remove",
+    [OP_REMOVEDIR] = "removedir",
+    [OP_RENAME] = "rename",
+    [OP_TOUCH] = "touch",
+    [OP_WRITE] = "write",
+    [OP_LOG] = "log",
+    [OP_ERROR] = "error",
+    [OP_PRINT] = "print",
+};
+
+uint64_t profile_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec - profile_epoch;
+}
+
+void profile_init(void) {
+    profile_enabled = true;
+    profile_epoch = 0;
+    profile_epoch = profile_now();
+    scratch_tracking = true;
+    profile_ops = calloc(COUNT_OPS, sizeof(size_t));
+    if (profile_ops == NULL) error("out of memory");
+    profile_events = ProfileArray_new(&arena);
+    // The recipe may `cd` away before the trace is written
+    if (getcwd(profile_trace_path, sizeof(profile_trace_path) - sizeof(PROFILE_TRACE) - 1) == NULL) profile_trace_path[0] = 0;
+    else strcat(profile_trace_path, "/");
+    strcat(profile_trace_path, PROFILE_TRACE);
+}
+
+void profile_phase(char* name, uint64_t start) {
+    if (!profile_enabled) return;
+    scratch_sample();
+    ProfileArray_push(profile_events, (ProfileEvent) { .name = sv(name), .start = start, .end = profile_now() });
+}
+
+void profile_command(Command command, String cmd, uint64_t start, struct rusage* usage) {
+    if (!profile_enabled) return;
+    ProfileArray_push(profile_events, (ProfileEvent) {
+        .name = scratch_keep(cmd), // the command line goes away with the command
+        .command = true,
+        .start = start,
+        .end = profile_now(),
+        .cpu_user = usage->ru_utime.tv_sec * 1000000ull + usage->ru_utime.tv_usec,
+        .cpu_system = usage->ru_stime.tv_sec * 1000000ull + usage->ru_stime.tv_usec,
+        .loc = command.loc,
+        .macro = command.macro,
+    });
+}
+
+void profile_json_string(FILE* file, String s) {
+    fputc('"', file);
+    for (size_t i = 0; i < s.size; i++) {
+        unsigned char c = sv_index(s, i);
+        if (c == '"' || c == '\\') fprintf(file, "\\%c", c);
+        else if (c < 0x20) fprintf(file, "\\u%04x", c);
+        else fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+// Commands are given the first lane that's free by the time they start
+void profile_assign_lanes(void) {
+    uint64_t lanes[64] = {0};
+    size_t count = 0;
+    array_foreach(profile_events, i) {
+        ProfileEvent event = ProfileArray_get(profile_events, i);
+        if (!event.command) continue;
+        size_t lane = 0;
+        while (lane < count && lanes[lane] > event.start) lane++;
+        if (lane == 64) lane = 63;
+        if (lane == count && count < 64) count++;
+        lanes[lane] = event.end;
+        event.lane = lane + 1; // lane 0 is for the phases
+        ProfileArray_set(profile_events, i, event);
+    }
+}
+
+void profile_write_trace(void) {
+    FILE* file = fopen(profile_trace_path, "w");
+    if (file == NULL) { fprintf(stderr, "ERROR: could not write `%s`: %s\n", profile_trace_path, strerror(errno)); return; }
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"ph\":\"M\",\"pid\":1,\"tid\":0,\"name\":\"thread_name\",\"args\":{\"name\":\"mako\"}}");
+    array_foreach(profile_events, i) {
+        ProfileEvent event = ProfileArray_get(profile_events, i);
+        fprintf(file, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"cat\":\"%s\",\"ts\":%.3f,\"dur\":%.3f,\"name\":", event.lane, event.command ? "command" : "phase", event.start / 1e3, (event.end - event.start) / 1e3);
+        profile_json_string(file, event.name);
+        if (event.command) {
+            char location[PATH_MAX + 64];
+            int n = snprintf(location, sizeof(location), LOC_FMT, LocFmt(event.loc));
+            fprintf(file, ",\"args\":{\"location\":");
+            profile_json_string(file, sv_from_bytes(location, n < (int) sizeof(location) ? n : (int) sizeof(location) - 1));
+            fprintf(file, ",\"macro\":");
+            profile_json_string(file, event.macro);
+            fprintf(file, ",\"user_ms\":%.3f,\"system_ms\":%.3f}", event.cpu_user / 1e3, event.cpu_system / 1e3);
+        }
+        fprintf(file, "}");
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+}
+
+int profile_compare_commands(const void* a, const void* b) {
+    const ProfileEvent* x = a;
+    const ProfileEvent* y = b;
+    uint64_t dx = x->end - x->start, dy = y->end - y->start;
+    return dx < dy ? 1 : dx > dy ? -1 : 0;
+}
+
+void profile_report(void) {
+    if (!profile_enabled) return;
+    printf("PROFILE: phases\n");
+    array_foreach(profile_events, i) {
+        ProfileEvent event = ProfileArray_get(profile_events, i);
+        if (!event.command) printf("PROFILE:   %-12.*s %10.3f ms\n", (int) event.name.size, event.name.bytes, (event.end - event.start) / 1e6);
+    }
+
+    printf("PROFILE: operations executed\n");
+    for (size_t done = 0; done < COUNT_OPS; done++) {
+        // Most executed first
+        size_t best = COUNT_OPS;
+        for (size_t op = 0; op < COUNT_OPS; op++) {
+            if (profile_ops[op] > 0 && (best == COUNT_OPS || profile_ops[op] > profile_ops[best])) best = op;
+        }
+        if (best == COUNT_OPS) break;
+        printf("PROFILE:   %-12s %10zu\n", profile_op_names[best], profile_ops[best]);
+        profile_ops[best] = 0;
+    }
+
+    ProfileEvent* commands = malloc(sizeof(ProfileEvent) * (profile_events->size + 1));
+    if (commands == NULL) error("out of memory");
+    size_t count = 0;
+    array_foreach(profile_events, i) {
+        ProfileEvent event = ProfileArray_get(profile_events, i);
+        if (event.command) commands[count++] = event;
+    }
+    qsort(commands, count, sizeof(ProfileEvent), profile_compare_commands);
+    printf("PROFILE: slowest commands (wall, user, system)\n");
+    for (size_t i = 0; i < count && i < PROFILE_TOP_COMMANDS; i++) {
+        ProfileEvent event = commands[i];
+        printf("PROFILE:   %10.3f ms %10.3f ms %10.3f ms  "LOC_FMT, (event.end - event.start) / 1e6, event.cpu_user / 1e3, event.cpu_system / 1e3, LocFmt(event.loc));
+        if (event.macro.size > 0) printf(" in `"SV_FMT"`", SvFmt(event.macro));
+        printf(": "SV_FMT"\n", SvFmt(event.name));
+    }
+    free(commands);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("PROFILE: memory\n");
+#ifdef __GLIBC__
+    printf("PROFILE:   peak heap    %10zu KiB\n", scratch_peak / 1024);
+#endif
+    printf("PROFILE:   peak rss     %10ld KiB\n", usage.ru_maxrss);
+    printf("PROFILE:   scratch      %10zu released\n", scratch_released);
+
+    profile_assign_lanes();
+    profile_write_trace();
+    printf("PROFILE: trace written to `%s`\n", profile_trace_path);
+}
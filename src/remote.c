@@ -0,0 +1,413 @@
+// A command started with `remote` instead of `cmd` may run on another
+// machine. `mako --worker ADDRESS` serves such commands, see worker.c, and a
+// run hands them to the workers named with `--workers` (or in MAKO_WORKERS),
+// or runs them itself, whichever has the most room. A worker only gets what
+// the command declared: inputs, and what its depfile listed the last time,
+// are shipped by the hash of their content, so it never gets the same file
+// twice, and the outputs are sent back once the command is done. Everything
+// else, like the compiler and system headers, has to be on the worker already.
+//
+// A connection carries frames: a type, a size and that many bytes. The worker
+// greets it with how many jobs it takes and how many it's running, then gets
+// a job, asks for the inputs it doesn't have, and streams back the output,
+// the output files and the exit code. A connection is a single job. A worker
+// that has as many jobs running as it takes hangs up after the greeting, and
+// one started with MAKO_WORKER_TOKEN only takes jobs that carry the same.
+#define REMOTE_MAGIC "MAKOWK02"
+#define REMOTE_MAX_FRAME (1u << 30)
+#define REMOTE_HELLO_SIZE 16 // the magic, slots and running jobs
+#define REMOTE_TOKEN "MAKO_WORKER_TOKEN"
+#define REMOTE_GREETING_MS 2000 // to connect to a worker and get its greeting
+
+typedef enum {
+    REMOTE_HELLO = 'H', // to a run
+    REMOTE_JOB = 'J', // to a worker: `t`oken, `p`rogram, `a`rguments, `e`nvironment, `i`nputs and `o`utputs, each ending in a NUL
+    REMOTE_NEED = 'N', // to a run: hashes of the inputs to send
+    REMOTE_BLOB = 'B', // to a worker: a hash and the content
+    REMOTE_OUTPUT = 'O', // to a run: what the command wrote
+    REMOTE_FILE = 'F', // to a run: index of the output, its mode and content
+    REMOTE_EXIT = 'X', // to a run: the exit code
+} RemoteFrame;
+
+typedef struct {
+    char* address;
+    size_t slots, others; // as of its last greeting
+    size_t running; // our jobs on it
+    bool probed, down;
+} RemoteWorker;
+
+array_define(RemoteWorkerArray, RemoteWorker)
+array_implement(RemoteWorkerArray, RemoteWorker)
+
+RemoteWorkerArray* remote_workers = NULL;
+
+// `unix:PATH`, or anything with a slash in it, is a Unix socket; NULL for TCP
+const char* remote_unix_path(const char* address) {
+    if (strncmp(address, "unix:", 5) == 0) return address + 5;
+    return strchr(address, '/') != NULL ? address : NULL;
+}
+
+// Connects over TCP, giving up after REMOTE_GREETING_MS rather than however
+// long the kernel keeps trying to reach a host that doesn't answer
+bool remote_connect_tcp(int fd, struct addrinfo* ai) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return false;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        if (errno != EINPROGRESS) return false;
+        struct pollfd p = { .fd = fd, .events = POLLOUT };
+        int ready;
+        while ((ready = poll(&p, 1, REMOTE_GREETING_MS)) < 0 && errno == EINTR) {}
+        int failure = 0;
+        socklen_t size = sizeof(failure);
+        if (ready == 0) failure = ETIMEDOUT;
+        else if (ready < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &failure, &size) < 0) failure = errno;
+        if (failure != 0) { errno = failure; return false; }
+    }
+    return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+// Connects to an address, or listens at it; -1 with errno set on failure.
+// Anything that isn't a Unix socket is `HOST:PORT` over TCP.
+int remote_socket(const char* address, bool listening) {
+    const char* path = remote_unix_path(address);
+    if (path != NULL) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(path) >= sizeof(addr.sun_path)) { errno = ENAMETOOLONG; return -1; }
+        strcpy(addr.sun_path, path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        int result = listening ? bind(fd, (struct sockaddr*) &addr, sizeof(addr)) : connect(fd, (struct sockaddr*) &addr, sizeof(addr));
+        if (result == 0 && (!listening || listen(fd, 64) == 0)) return fd;
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    const char* colon = strrchr(address, ':');
+    char host[256];
+    if (colon == NULL || (size_t) (colon - address) >= sizeof(host)) { errno = EINVAL; return -1; }
+    snprintf(host, sizeof(host), "%.*s", (int) (colon - address), address);
+    if (host[0] == '[' && host[strlen(host)-1] == ']') {
+        host[strlen(host)-1] = 0;
+        memmove(host, host + 1, strlen(host));
+    }
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = listening ? AI_PASSIVE : 0 };
+    struct addrinfo* found;
+    if (getaddrinfo(host, colon + 1, &hints, &found) != 0) { errno = EADDRNOTAVAIL; return -1; }
+    int fd = -1, saved = 0;
+    for (struct addrinfo* ai = found; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        if (listening) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        else setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        bool ok = listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0 : remote_connect_tcp(fd, ai);
+        if (ok) break;
+        saved = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(found);
+    if (fd < 0) errno = saved;
+    return fd;
+}
+
+// Sockets are written with MSG_NOSIGNAL, so a peer that went away is an error
+// rather than SIGPIPE
+bool remote_send_all(int fd, const void* bytes, size_t size) {
+    const char* at = bytes;
+    while (size > 0) {
+        ssize_t n = send(fd, at, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        at += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool remote_read_all(int fd, void* bytes, size_t size) {
+    char* at = bytes;
+    while (size > 0) {
+        ssize_t n = read(fd, at, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        at += n;
+        size -= n;
+    }
+    return true;
+}
+
+// The payload of the frame follows separately
+bool remote_send_header(int fd, RemoteFrame type, size_t size) {
+    if (size > REMOTE_MAX_FRAME) return false;
+    uint32_t header[2] = { htonl(type), htonl(size) };
+    return remote_send_all(fd, header, sizeof(header));
+}
+
+bool remote_send(int fd, RemoteFrame type, String payload) {
+    return remote_send_header(fd, type, payload.size) && remote_send_all(fd, payload.bytes, payload.size);
+}
+
+// The payload is malloc'd and ends in a NUL; NULL once the connection is
+// closed or broken
+char* remote_receive(int fd, RemoteFrame* type, size_t* size) {
+    uint32_t header[2];
+    if (!remote_read_all(fd, header, sizeof(header))) return NULL;
+    *type = ntohl(header[0]);
+    *size = ntohl(header[1]);
+    if (*size > REMOTE_MAX_FRAME) return NULL;
+    char* payload = malloc(*size + 1);
+    if (payload == NULL) error("out of memory");
+    if (!remote_read_all(fd, payload, *size)) { free(payload); return NULL; }
+    payload[*size] = 0;
+    return payload;
+}
+
+// Sends a whole file as the rest of a frame
+bool remote_send_file(int fd, const char* path, size_t size) {
+    if (size == 0) return true;
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file < 0) return false;
+    void* content = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (content == MAP_FAILED) return false;
+    bool ok = remote_send_all(fd, content, size);
+    munmap(content, size);
+    return ok;
+}
+
+void remote_push(StringBuilder* sb, char kind, String string) {
+    StringBuilder_push(sb, kind);
+    for (size_t i = 0; i < string.size; i++) StringBuilder_push(sb, sv_index(string, i));
+    StringBuilder_push(sb, 0);
+}
+
+// Paths a worker can recreate in a sandbox: relative, and not going up
+bool remote_relative(String path) {
+    if (path.size == 0 || sv_index(path, 0) == '/') return false;
+    for (size_t i = 0; i + 1 < path.size; i++) {
+        bool starts = i == 0 || sv_index(path, i-1) == '/';
+        bool ends = i + 2 == path.size || sv_index(path, i+2) == '/';
+        if (starts && ends && sv_index(path, i) == '.' && sv_index(path, i+1) == '.') return false;
+    }
+    return true;
+}
+
+// Connects and takes the greeting; -1 if the worker isn't there, or if it's
+// `busy` with as many jobs as it takes. A worker that doesn't greet in time
+// isn't there; the job itself may take as long as it does.
+int remote_connect(size_t index, bool* busy) {
+    *busy = false;
+    RemoteWorker worker = RemoteWorkerArray_get(remote_workers, index);
+    int fd = remote_socket(worker.address, false);
+    if (fd < 0) return -1;
+    struct timeval timeout = { .tv_sec = REMOTE_GREETING_MS / 1000, .tv_usec = REMOTE_GREETING_MS % 1000 * 1000 };
+    struct timeval forever = {0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    RemoteFrame type;
+    size_t size;
+    char* hello = remote_receive(fd, &type, &size);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof(forever));
+    if (hello == NULL || type != REMOTE_HELLO || size != REMOTE_HELLO_SIZE || memcmp(hello, REMOTE_MAGIC, 8) != 0) {
+        free(hello);
+        close(fd);
+        return -1;
+    }
+    uint32_t slots, running;
+    memcpy(&slots, hello + 8, sizeof(slots));
+    memcpy(&running, hello + 12, sizeof(running));
+    free(hello);
+    // What it runs for others is what it runs besides our jobs
+    worker.slots = ntohl(slots) > 0 ? ntohl(slots) : 1;
+    worker.others = ntohl(running) > worker.running ? ntohl(running) - worker.running : 0;
+    worker.probed = true;
+    RemoteWorkerArray_set(remote_workers, index, worker);
+    if (ntohl(running) >= worker.slots) {
+        *busy = true;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void remote_lost(size_t index) {
+    RemoteWorker worker = RemoteWorkerArray_get(remote_workers, index);
+    if (!worker.down) printf("REMOTE: worker `%s` can't be reached, leaving it out\n", worker.address);
+    worker.down = true;
+    RemoteWorkerArray_set(remote_workers, index, worker);
+}
+
+// Workers are comma-separated addresses. They're only connected to once
+// there's a remote command to run, see `remote_probe`.
+void remote_init(String workers) {
+    remote_workers = RemoteWorkerArray_new(&arena);
+    if (workers.size == 0 && getenv("MAKO_WORKERS") != NULL) workers = sv(getenv("MAKO_WORKERS"));
+    for (size_t start = 0, i = 0; i <= workers.size; i++) {
+        if (i < workers.size && sv_index(workers, i) != ',') continue;
+        if (i > start) {
+            char* address = arena_alloc(&arena, i - start + 1);
+            memcpy(address, workers.bytes + start, i - start);
+            address[i - start] = 0;
+            RemoteWorkerArray_push(remote_workers, (RemoteWorker) { .address = address });
+        }
+        start = i + 1;
+    }
+}
+
+// Greets the workers not heard from yet, to know how much room they have.
+// Those that can't be reached are left out of the run.
+void remote_probe(void) {
+    array_foreach(remote_workers, i) {
+        RemoteWorker worker = RemoteWorkerArray_get(remote_workers, i);
+        if (worker.probed || worker.down) continue;
+        bool busy;
+        int fd = remote_connect(i, &busy);
+        if (fd >= 0) close(fd);
+        else if (!busy) remote_lost(i);
+    }
+}
+
+// Where a remote command has the most room: a worker, -1 for here, or -2 if
+// everything's busy. Load is running jobs per slot, and ties go to here,
+// where nothing has to be shipped.
+ssize_t remote_pick(size_t local, size_t local_slots) {
+    ssize_t best = -1;
+    size_t best_load = local, best_slots = local_slots;
+    if (remote_workers != NULL) remote_probe();
+    if (remote_workers != NULL) array_foreach(remote_workers, i) {
+        RemoteWorker worker = RemoteWorkerArray_get(remote_workers, i);
+        size_t load = worker.running + worker.others;
+        if (worker.down || load * best_slots >= best_load * worker.slots) continue;
+        best = i;
+        best_load = load;
+        best_slots = worker.slots;
+    }
+    return best_load < best_slots ? best : -2;
+}
+
+void remote_check(Command command) {
+    StringArray* lists[] = { command.inputs, command.outputs };
+    for (size_t l = 0; l < 2; l++) array_foreach(lists[l], i) {
+        String path = StringArray_get(lists[l], i);
+        if (!remote_relative(path)) lexer_error(command.loc, "a remote command can only declare paths inside the current directory, unlike `"SV_FMT"`", SvFmt(path));
+    }
+    if (command.depfile.size > 0 && !remote_relative(command.depfile)) lexer_error(command.loc, "a remote command can only declare paths inside the current directory, unlike `"SV_FMT"`", SvFmt(command.depfile));
+}
+
+// Hands a command over to a worker. Returns the connection the job runs on,
+// or -1 if it couldn't be handed over and has to run here.
+int remote_start(size_t index, Command command, StringArray* deps) {
+    bool busy;
+    int fd = remote_connect(index, &busy);
+    if (fd < 0) {
+        if (!busy) remote_lost(index);
+        return -1;
+    }
+
+    StringBuilder* sb = StringBuilder_new(command.arena);
+    char* token = getenv(REMOTE_TOKEN);
+    if (token != NULL && token[0] != 0) remote_push(sb, 't', sv(token));
+    remote_push(sb, 'p', command.program);
+    array_foreach(command.arguments, i) remote_push(sb, 'a', StringArray_get(command.arguments, i));
+    // The token is for the worker, not for the command
+    for (char** var = environ; *var != NULL; var++) {
+        if (strncmp(*var, REMOTE_TOKEN"=", sizeof(REMOTE_TOKEN)) != 0) remote_push(sb, 'e', sv(*var));
+    }
+    // An input is its hash, its mode in octal and its path; recorded
+    // dependencies outside of the current directory are left to the worker
+    StringArray* shipped = StringArray_new(command.arena);
+    StringArray* hashes = StringArray_new(command.arena);
+    size_t declared = command.inputs->size;
+    for (size_t i = 0; i < declared + (deps != NULL ? deps->size : 0); i++) {
+        String path = i < declared ? StringArray_get(command.inputs, i) : StringArray_get(deps, i - declared);
+        if (!remote_relative(path)) continue;
+        char cpath[PATH_MAX], entry[HASH_HEX_SIZE + 5];
+        struct stat st;
+        Hash hash;
+        if (stat(fs_cpath(path, cpath), &st) < 0 || !S_ISREG(st.st_mode) || !fs_hash_file(HASH_SEED, path, &hash)) { close(fd); return -1; }
+        hash_hex(hash, entry);
+        snprintf(entry + HASH_HEX_SIZE, 5, "%04o", (unsigned) (st.st_mode & 07777));
+        StringBuilder_push(sb, 'i');
+        for (char* c = entry; *c; c++) StringBuilder_push(sb, *c);
+        for (size_t c = 0; c < path.size; c++) StringBuilder_push(sb, sv_index(path, c));
+        StringBuilder_push(sb, 0);
+        StringArray_push(shipped, path);
+        char* hex = arena_alloc(command.arena, HASH_HEX_SIZE);
+        memcpy(hex, entry, HASH_HEX_SIZE);
+        StringArray_push(hashes, sv_from_bytes(hex, HASH_HEX_SIZE));
+    }
+    // The depfile comes back after the declared outputs
+    array_foreach(command.outputs, i) remote_push(sb, 'o', StringArray_get(command.outputs, i));
+    if (command.depfile.size > 0) remote_push(sb, 'o', command.depfile);
+
+    RemoteFrame type;
+    size_t size;
+    char* need = NULL;
+    bool ok = remote_send(fd, REMOTE_JOB, sv_from_sb(sb)) && (need = remote_receive(fd, &type, &size)) != NULL && type == REMOTE_NEED && size % HASH_HEX_SIZE == 0;
+    for (size_t at = 0; ok && at < size; at += HASH_HEX_SIZE) {
+        // A file that changed since it was hashed is turned down by the
+        // worker, and the command runs here
+        String path = {0};
+        array_foreach(hashes, i) {
+            if (memcmp(StringArray_get(hashes, i).bytes, need + at, HASH_HEX_SIZE) == 0) { path = StringArray_get(shipped, i); break; }
+        }
+        char cpath[PATH_MAX];
+        struct stat st;
+        ok = path.size > 0 && stat(fs_cpath(path, cpath), &st) == 0;
+        ok = ok && remote_send_header(fd, REMOTE_BLOB, HASH_HEX_SIZE + st.st_size) && remote_send_all(fd, need + at, HASH_HEX_SIZE) && remote_send_file(fd, cpath, st.st_size);
+    }
+    free(need);
+    if (!ok) {
+        close(fd);
+        remote_lost(index);
+        return -1;
+    }
+    RemoteWorker worker = RemoteWorkerArray_get(remote_workers, index);
+    worker.running++;
+    RemoteWorkerArray_set(remote_workers, index, worker);
+    return fd;
+}
+
+void remote_done(size_t index) {
+    RemoteWorker worker = RemoteWorkerArray_get(remote_workers, index);
+    worker.running--;
+    RemoteWorkerArray_set(remote_workers, index, worker);
+}
+
+// Puts an output a worker sent back in place, with the mode it had there
+bool remote_write_output(Command command, const char* payload, size_t size) {
+    uint32_t index, mode;
+    if (size < 8) return false;
+    memcpy(&index, payload, sizeof(index));
+    memcpy(&mode, payload + 4, sizeof(mode));
+    index = ntohl(index);
+    mode = ntohl(mode);
+    String path;
+    if (index < command.outputs->size) path = StringArray_get(command.outputs, index);
+    else if (index == command.outputs->size && command.depfile.size > 0) path = command.depfile;
+    else return false;
+
+    char cpath[PATH_MAX], ctmp[PATH_MAX];
+    fs_cpath(path, cpath);
+    if (snprintf(ctmp, sizeof(ctmp), "%s.tmp.%d", cpath, (int) getpid()) >= (int) sizeof(ctmp)) { errno = ENAMETOOLONG; return false; }
+    int fd = open(ctmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode & 07777);
+    if (fd < 0) return false;
+    bool ok = true;
+    for (size_t written = 8; ok && written < size;) {
+        ssize_t n = write(fd, payload + written, size - written);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) written += n;
+    }
+    if (ok) fchmod(fd, mode & 07777);
+    if (close(fd) < 0) ok = false;
+    if (ok && rename(ctmp, cpath) < 0) ok = false;
+    if (!ok) {
+        int saved = errno;
+        unlink(ctmp);
+        errno = saved;
+    }
+    return ok;
+}
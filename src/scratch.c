@@ -0,0 +1,81 @@
+// `arena` is permanent: the recipe, its tokens and bytecode, and whatever has
+// to last until mako exits. Temporaries come from scratch arenas instead, so
+// that a recipe looping over thousands of files or commands doesn't keep every
+// command line, listing and output it ever made. Strings that stay on the
+// stack are copied out when they are interned, see `interpret_intern`.
+#define SCRATCH_DEPTH 16
+
+// Scratch arenas for temporaries of a single operation; `scratch_begin` marks
+// where they start and `scratch_end` gives them back. They nest.
+Arena scratch_frames[SCRATCH_DEPTH];
+size_t scratch_depth = 0;
+
+// With `--profile`, heap usage is sampled right before scratch memory is given
+// back, when it's at its highest
+bool scratch_tracking = false;
+size_t scratch_peak = 0;
+size_t scratch_released = 0;
+
+void scratch_sample(void) {
+#ifdef __GLIBC__
+    if (!scratch_tracking) return;
+    struct mallinfo2 info = mallinfo2();
+    size_t used = info.uordblks + info.hblkhd;
+    if (used > scratch_peak) scratch_peak = used;
+#endif
+}
+
+Arena* scratch_begin(void) {
+    if (scratch_depth >= SCRATCH_DEPTH) error("scratch arenas are nested too deep");
+    return &scratch_frames[scratch_depth++];
+}
+
+void scratch_end(Arena* scratch) {
+    if (scratch != &scratch_frames[scratch_depth-1]) error("scratch arenas were released out of order");
+    scratch_sample();
+    arena_free(scratch);
+    *scratch = (Arena) {0};
+    scratch_depth--;
+    scratch_released++;
+}
+
+// An arena owned by something that outlives a single operation, like a running
+// job with its command line
+Arena* scratch_new(void) {
+    Arena* scratch = calloc(1, sizeof(Arena));
+    if (scratch == NULL) error("out of memory");
+    return scratch;
+}
+
+void scratch_free(Arena* scratch) {
+    if (scratch == NULL) return;
+    scratch_sample();
+    arena_free(scratch);
+    free(scratch);
+    scratch_released++;
+}
+
+// Kept strings are packed into blocks of their own, which are never freed
+#define SCRATCH_KEEP_BLOCK (64*1024)
+char* scratch_kept = NULL;
+size_t scratch_kept_left = 0;
+
+// Copies a string out of a scratch arena, to keep it for the rest of the run
+String scratch_keep(String string) {
+    if (string.size > SCRATCH_KEEP_BLOCK / 4) {
+        char* bytes = malloc(string.size);
+        if (bytes == NULL) error("out of memory");
+        memcpy(bytes, string.bytes, string.size);
+        return sv_from_bytes(bytes, string.size);
+    }
+    if (string.size > scratch_kept_left) {
+        scratch_kept = malloc(SCRATCH_KEEP_BLOCK);
+        if (scratch_kept == NULL) error("out of memory");
+        scratch_kept_left = SCRATCH_KEEP_BLOCK;
+    }
+    char* bytes = scratch_kept;
+    memcpy(bytes, string.bytes, string.size);
+    scratch_kept += string.size;
+    scratch_kept_left -= string.size;
+    return sv_from_bytes(bytes, string.size);
+}
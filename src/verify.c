@@ -0,0 +1,272 @@
+// Before anything runs, the program is interpreted abstractly: instead of
+// values, the verifier follows the types of the items on top of the stack,
+// merging what it knows where control flow joins. Instructions whose operands
+// are proven to be there with the right types are marked as verified and skip
+// their checks at runtime, while operands that are wrong on every path that
+// reaches an instruction are reported right away.
+#define VERIFY_DEPTH 32
+#define VERIFY_ANY COUNT_STACK_ITEMS // an item of unknown type
+
+typedef struct {
+    uint8_t types[VERIFY_DEPTH]; // of the tracked items, from bottom to top
+    uint8_t size; // tracked items, which are surely on the stack
+    bool exact; // there's nothing below the tracked items
+    bool reached;
+} VerifyState;
+
+char* verify_type_name(StackItemType type) {
+    switch (type) {
+        case STACK_ITEM_STRING: return "a string";
+        case STACK_ITEM_BOOL: return "a boolean";
+        case STACK_ITEM_INT: return "an integer";
+        case STACK_ITEM_CMD_MARKER: return "a command marker";
+        case STACK_ITEM_INPUT: return "an input";
+        case STACK_ITEM_OUTPUT: return "an output";
+        case STACK_ITEM_DEPFILE: return "a depfile";
+        case STACK_ITEM_EXCLUDE: return "an exclude pattern";
+        default: return "anything";
+    }
+}
+
+StackItemType verify_peek(VerifyState* s, size_t depth) {
+    if (depth >= s->size) return VERIFY_ANY;
+    return s->types[s->size - 1 - depth];
+}
+
+void verify_push(VerifyState* s, StackItemType type) {
+    if (s->size == VERIFY_DEPTH) {
+        // Forget the bottom item to make room
+        memmove(s->types, s->types + 1, VERIFY_DEPTH - 1);
+        s->size--;
+        s->exact = false;
+    }
+    s->types[s->size++] = type;
+}
+
+void verify_pop(VerifyState* s, size_t n) {
+    s->size = n > s->size ? 0 : s->size - n;
+}
+
+// Whether the stack surely has at least `n` items
+bool verify_depth(Program* p, size_t pc, VerifyState* s, size_t n, bool report) {
+    if (s->size >= n) return true;
+    if (s->exact && report) lexer_error(p->locs[pc], "expected stack to have at least %zu items, but it has %d here", n, s->size);
+    return false;
+}
+
+// Whether the item at `depth` from the top surely has the type `type`
+bool verify_type(Program* p, size_t pc, VerifyState* s, size_t depth, StackItemType type, bool report) {
+    StackItemType actual = verify_peek(s, depth);
+    if (actual == type) return true;
+    if (actual != VERIFY_ANY && report) lexer_error(p->locs[pc], "expected %s on the stack, got %s", verify_type_name(type), verify_type_name(actual));
+    return false;
+}
+
+// Pops `n` items that all have to be of type `type`
+bool verify_operands(Program* p, size_t pc, VerifyState* s, size_t n, StackItemType type, bool report) {
+    bool safe = verify_depth(p, pc, s, n, report);
+    for (size_t i = 0; i < n; i++) safe = verify_type(p, pc, s, i, type, report) && safe;
+    verify_pop(s, n);
+    return safe;
+}
+
+// Mirrors `interpret_pop_command`: everything above the topmost command
+// marker is the command, or the whole stack if there's no marker
+void verify_command(Program* p, size_t pc, VerifyState* s, bool report) {
+    for (size_t depth = 0; depth < s->size; depth++) {
+        StackItemType type = verify_peek(s, depth);
+        if (type == VERIFY_ANY) break; // might be a marker
+        if (type == STACK_ITEM_CMD_MARKER) {
+            if (depth == 0 && report) lexer_error(p->locs[pc], "expected a program name after `cmd`");
+            if (depth > 0) verify_type(p, pc, s, depth-1, STACK_ITEM_STRING, report);
+            verify_pop(s, depth + 1);
+            return;
+        }
+        if (s->exact && depth == (size_t) s->size - 1) {
+            verify_type(p, pc, s, depth, STACK_ITEM_STRING, report);
+            verify_pop(s, s->size);
+            return;
+        }
+        if ((type == STACK_ITEM_INT || type == STACK_ITEM_BOOL) && report) lexer_error(p->locs[pc], "use of a non-string as an argument");
+    }
+    if (s->exact && s->size == 0 && report) lexer_error(p->locs[pc], "the stack is empty");
+    *s = (VerifyState) { .reached = true };
+}
+
+// Applies an instruction to `s`; returns whether all of its operands are
+// surely fine. Errors are only reported with `report`, once states are final.
+bool verify_step(Program* p, size_t pc, VerifyState* s, bool report) {
+    Instruction ins = p->code[pc];
+    bool safe = true;
+    switch (ins.type) {
+        case OP_PUSH_STRING: case OP_GETCWD: verify_push(s, STACK_ITEM_STRING); break;
+        case OP_PUSH_INT: verify_push(s, STACK_ITEM_INT); break;
+        case OP_PUSH_BOOL: verify_push(s, STACK_ITEM_BOOL); break;
+        case OP_CMD: case OP_MEMO: case OP_REMOTE: verify_push(s, STACK_ITEM_CMD_MARKER); break;
+        case OP_RUN: verify_command(p, pc, s, report); safe = false; break;
+        case OP_SPAWN: verify_command(p, pc, s, report); verify_push(s, STACK_ITEM_INT); safe = false; break;
+        case OP_CAPTURE: verify_command(p, pc, s, report); verify_push(s, STACK_ITEM_STRING); safe = false; break;
+        case OP_CAPTUREWORDS:
+            // Any number of strings, then their count
+            verify_command(p, pc, s, report);
+            *s = (VerifyState) { .reached = true };
+            verify_push(s, STACK_ITEM_INT);
+            safe = false;
+            break;
+        case OP_WAIT: safe = verify_operands(p, pc, s, 1, STACK_ITEM_INT, report); break;
+        case OP_JUMPZ: case OP_JUMPNZ: case OP_NOT:
+            safe = verify_operands(p, pc, s, 1, STACK_ITEM_BOOL, report);
+            if (ins.type == OP_NOT) verify_push(s, STACK_ITEM_BOOL);
+            break;
+        case OP_GTEQ: case OP_LTEQ: case OP_GT: case OP_LT: case OP_EQ:
+            safe = verify_operands(p, pc, s, 2, STACK_ITEM_INT, report);
+            verify_push(s, STACK_ITEM_BOOL);
+            break;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+            safe = verify_operands(p, pc, s, 2, STACK_ITEM_INT, report);
+            verify_push(s, STACK_ITEM_INT);
+            break;
+        case OP_DUP: case OP_OVER: {
+            size_t depth = ins.type == OP_DUP ? 0 : 1;
+            safe = verify_depth(p, pc, s, depth + 1, report);
+            verify_push(s, verify_peek(s, depth));
+            break;
+        }
+        case OP_DROP: safe = verify_depth(p, pc, s, 1, report); verify_pop(s, 1); break;
+        case OP_SWAP: {
+            safe = verify_depth(p, pc, s, 2, report);
+            StackItemType a = verify_peek(s, 0), b = verify_peek(s, 1);
+            verify_pop(s, 2);
+            verify_push(s, a);
+            verify_push(s, b);
+            break;
+        }
+        case OP_ROT: {
+            safe = verify_depth(p, pc, s, 3, report);
+            StackItemType a = verify_peek(s, 0), b = verify_peek(s, 1), c = verify_peek(s, 2);
+            verify_pop(s, 3);
+            verify_push(s, c);
+            verify_push(s, a);
+            verify_push(s, b);
+            break;
+        }
+        case OP_FILEEXISTS: case OP_DIREXISTS:
+            safe = verify_operands(p, pc, s, 1, STACK_ITEM_STRING, report);
+            verify_push(s, STACK_ITEM_BOOL);
+            break;
+        case OP_MKDIR: case OP_CD: case OP_LOG: case OP_ERROR: case OP_PRINT:
+        case OP_REMOVE: case OP_REMOVEDIR: case OP_TOUCH:
+            safe = verify_operands(p, pc, s, 1, STACK_ITEM_STRING, report);
+            break;
+        case OP_LISTDIR: case OP_FNMATCH:
+            if (ins.type == OP_FNMATCH) {
+                size_t excludes = 0;
+                while (verify_peek(s, excludes) == STACK_ITEM_EXCLUDE) excludes++;
+                verify_pop(s, excludes);
+            }
+            // Any number of strings, then their count
+            safe = verify_operands(p, pc, s, 1, STACK_ITEM_STRING, report);
+            *s = (VerifyState) { .reached = true };
+            verify_push(s, STACK_ITEM_INT);
+            break;
+        case OP_NEWER:
+            safe = verify_operands(p, pc, s, 2, STACK_ITEM_STRING, report);
+            verify_push(s, STACK_ITEM_BOOL);
+            break;
+        case OP_COPY: case OP_COPYDIR: case OP_RENAME: case OP_WRITE:
+            safe = verify_operands(p, pc, s, 2, STACK_ITEM_STRING, report);
+            break;
+        case OP_UPTODATE:
+            // Takes as many inputs as the count on top says
+            verify_depth(p, pc, s, 1, report);
+            verify_type(p, pc, s, 0, STACK_ITEM_INT, report);
+            *s = (VerifyState) { .reached = true };
+            verify_push(s, STACK_ITEM_BOOL);
+            safe = false;
+            break;
+        case OP_INPUT: case OP_OUTPUT: case OP_DEPFILE: case OP_EXCLUDE:
+            safe = verify_operands(p, pc, s, 1, STACK_ITEM_STRING, report);
+            verify_push(s, ins.type == OP_INPUT ? STACK_ITEM_INPUT : ins.type == OP_OUTPUT ? STACK_ITEM_OUTPUT : ins.type == OP_DEPFILE ? STACK_ITEM_DEPFILE : STACK_ITEM_EXCLUDE);
+            break;
+        default: break;
+    }
+    return safe;
+}
+
+// Joins what's known at a place control flow reaches from several others;
+// returns whether `to` changed
+bool verify_merge(VerifyState* to, VerifyState* from) {
+    if (!to->reached) {
+        *to = *from;
+        to->reached = true;
+        return true;
+    }
+    VerifyState merged = { .reached = true };
+    merged.size = to->size < from->size ? to->size : from->size;
+    merged.exact = to->exact && from->exact && to->size == from->size;
+    for (size_t i = 0; i < merged.size; i++) {
+        StackItemType a = verify_peek(to, merged.size - 1 - i), b = verify_peek(from, merged.size - 1 - i);
+        merged.types[i] = a == b ? a : VERIFY_ANY;
+    }
+    if (merged.size == to->size && merged.exact == to->exact && memcmp(merged.types, to->types, merged.size) == 0) return false;
+    *to = merged;
+    return true;
+}
+
+void verify_flow(VerifyState* states, U32Array* worklist, size_t size, size_t to, VerifyState* state) {
+    if (to >= size) return;
+    if (verify_merge(&states[to], state)) U32Array_push(worklist, to);
+}
+
+void verify_program(Program* p) {
+    VerifyState* states = calloc(p->size + 1, sizeof(VerifyState));
+    if (states == NULL) error("out of memory");
+
+    // Macros return to every place they are called from
+    StringMap first_call = {0};
+    size_t* next_call = malloc(sizeof(size_t) * (p->size + 1));
+    if (next_call == NULL) error("out of memory");
+    for (size_t pc = p->size; pc > 0; pc--) {
+        if (p->code[pc-1].type != OP_CALL) continue;
+        size_t first = 0;
+        StringMap_get(&first_call, p->operands[pc-1], &first);
+        next_call[pc-1] = first;
+        StringMap_set(&first_call, p->operands[pc-1], pc);
+    }
+
+    U32Array* worklist = U32Array_new(&arena);
+    VerifyState start = { .exact = true, .reached = true };
+    verify_flow(states, worklist, p->size, 0, &start);
+    while (worklist->size > 0) {
+        size_t pc = U32Array_get(worklist, worklist->size-1);
+        U32Array_pop(worklist);
+        Instruction ins = p->code[pc];
+        VerifyState s = states[pc];
+        verify_step(p, pc, &s, false);
+
+        if (ins.type == OP_JUMP || ins.type == OP_CALL) verify_flow(states, worklist, p->size, ins.location, &s);
+        else if (ins.type == OP_TARGET) {
+            // The body runs later, on a stack of its own
+            VerifyState body = { .exact = true, .reached = true };
+            verify_flow(states, worklist, p->size, pc + 1 + ins.value, &body);
+            verify_flow(states, worklist, p->size, ins.location, &s);
+        } else if (ins.type == OP_RET) {
+            size_t call = 0;
+            if (p->operands[pc].size > 0) StringMap_get(&first_call, p->operands[pc], &call);
+            for (; call > 0; call = next_call[call-1]) verify_flow(states, worklist, p->size, call, &s);
+        } else if (ins.type != OP_ERROR && ins.type != OP_DEBUG) {
+            verify_flow(states, worklist, p->size, pc + 1, &s);
+            if (ins.type == OP_JUMPZ || ins.type == OP_JUMPNZ) verify_flow(states, worklist, p->size, ins.location, &s);
+        }
+    }
+
+    for (size_t pc = 0; pc < p->size; pc++) {
+        if (!states[pc].reached) continue;
+        VerifyState s = states[pc];
+        p->code[pc].verified = verify_step(p, pc, &s, true);
+    }
+
+    StringMap_clear(&first_call);
+    free(next_call);
+    free(states);
+}
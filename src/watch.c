@@ -0,0 +1,280 @@
+// `--watch`: once a run is over, mako waits for a file the run looked at to
+// change, and runs the recipe again. The recipe stays parsed in between, and
+// is only parsed again when one of its files changed. Every run happens in a
+// child process, so a failing command, an `error` or a `cd` only ends that
+// run; as it exits, the child tells the parent which paths it depended on,
+// and how each looked when the run got to it. Watches are only set up once
+// the run is over, so a path that looks different by then changed during the
+// run, and the next one starts right away. Paths the run may have changed
+// itself, like outputs of its commands, aren't compared.
+#define WATCH_DEBOUNCE_MS 30
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct {
+    String path;
+    bool any; // any change in it counts, not only changes to known names
+} WatchDir;
+
+array_define(WatchDirArray, WatchDir)
+array_implement(WatchDirArray, WatchDir)
+
+int watch_report = -1; // in a child, where to tell the parent what the run looked at
+int watch_status = 0; // of the last child
+Arena* watch_paths_arena = NULL;
+StringArray* watch_paths = NULL; // reported by the last run, each prefixed with its kind
+
+// In the parent, for a single wait
+int watch_fd = -1;
+Arena* watch_arena = NULL;
+WatchDirArray* watch_dirs = NULL; // by watch descriptor
+StringMap watch_names = {0}; // files looked at, by absolute path
+StringMap watch_recipes = {0}; // files of the recipe, by absolute path
+size_t watch_count = 0;
+
+// What's in a directory only matters to a listing of it
+Hash watch_seen_hash(char kind, FsSeen seen) {
+    bool content = !seen.is_dir || kind == 'd';
+    uint64_t fields[6] = {
+        seen.exists | (uint64_t) seen.is_dir << 1, seen.dev, seen.ino,
+        content ? (uint64_t) seen.size : 0, content ? (uint64_t) seen.mtime.tv_sec : 0, content ? (uint64_t) seen.mtime.tv_nsec : 0,
+    };
+    return hash_bytes(HASH_SEED, fields, sizeof(fields));
+}
+
+// A kind, the hash of how the path looked or dashes if it isn't compared,
+// and the path
+void watch_send_path(FILE* out, char kind, String path, const FsSeen* seen) {
+    if (sv_compare_at(path, sv(CACHE_DIR), 0)) return;
+    char hex[HASH_HEX_SIZE + 1] = "----------------";
+    if (seen != NULL) hash_hex(watch_seen_hash(kind, *seen), hex);
+    fputc(kind, out);
+    fwrite(hex, 1, HASH_HEX_SIZE, out);
+    fwrite(path.bytes, 1, path.size, out);
+    fputc(0, out);
+}
+
+// Registered with `atexit` in a child, so it runs however the run ends
+void watch_send(void) {
+    if (watch_report < 0) return;
+    FILE* out = fdopen(watch_report, "wb");
+    watch_report = -1;
+    if (out == NULL) return;
+    // `f`: a path that was looked at, `d`: a listed directory, `t`: a tree
+    // searched by `fnmatch`, `r`: a file of the recipe, even if it didn't load
+    if (modules != NULL) array_foreach(modules, i) {
+        Module module = ModuleArray_get(modules, i);
+        watch_send_path(out, 'r', module.filename, &module.seen);
+    }
+    if (fs_cache != NULL) array_foreach(fs_cache, i) {
+        FsCacheEntry entry = FsCacheArray_get(fs_cache, i);
+        watch_send_path(out, entry.listed ? 'd' : 'f', entry.path, entry.has_seen && !entry.written ? &entry.seen : NULL);
+    }
+    if (fs_patterns != NULL) array_foreach(fs_patterns, i) {
+        // Everything under the part of the pattern before the first wildcard
+        String pattern = FsCacheArray_get(fs_patterns, i).path;
+        size_t end = 0, root = 0;
+        while (end < pattern.size && strchr("\n*?[{", sv_index(pattern, end)) == NULL) {
+            if (sv_index(pattern, end) == '/') root = end == 0 ? 1 : end;
+            end++;
+        }
+        watch_send_path(out, 't', root == 0 ? sv(".") : sv_from_bytes(pattern.bytes, root), NULL);
+    }
+    fclose(out);
+}
+
+// Forks; the child gets true and ends with `exit`, telling the parent what it
+// looked at if `report`. The parent gets false once the child is gone, with
+// `watch_status` set to its exit code.
+bool watch_fork(bool report) {
+    int pipefd[2] = { -1, -1 };
+    if (report && pipe2(pipefd, O_CLOEXEC) < 0) error("could not create a pipe: %s", strerror(errno));
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) error("could not fork: %s", strerror(errno));
+    if (pid == 0) {
+        if (report) {
+            close(pipefd[0]);
+            watch_report = pipefd[1];
+            fs_seeing = true;
+            atexit(watch_send);
+        }
+        return true;
+    }
+
+    if (report) {
+        close(pipefd[1]);
+        scratch_free(watch_paths_arena);
+        watch_paths_arena = scratch_new();
+        watch_paths = StringArray_new(watch_paths_arena);
+        StringBuilder* sb = StringBuilder_new(watch_paths_arena);
+        char buffer[4096];
+        for (;;) {
+            ssize_t n = read(pipefd[0], buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            for (ssize_t i = 0; i < n; i++) {
+                if (buffer[i] != 0) { StringBuilder_push(sb, buffer[i]); continue; }
+                StringArray_push(watch_paths, sv_from_sb(sb));
+                sb = StringBuilder_new(watch_paths_arena);
+            }
+        }
+        close(pipefd[0]);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) error("could not wait for a child process: %s", strerror(errno));
+    }
+    watch_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return false;
+}
+
+String watch_copy(const char* string) {
+    StringBuilder* sb = StringBuilder_new(watch_arena);
+    for (const char* c = string; *c; c++) StringBuilder_push(sb, *c);
+    return sv_from_sb(sb);
+}
+
+void watch_dir(const char* dir, bool any) {
+    int wd = inotify_add_watch(watch_fd, dir, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd < 0) return;
+    while (watch_dirs->size <= (size_t) wd) WatchDirArray_push(watch_dirs, (WatchDir) {0});
+    WatchDir watched = WatchDirArray_get(watch_dirs, wd);
+    if (watched.path.size == 0) {
+        watched.path = watch_copy(dir);
+        watch_count++;
+    }
+    watched.any = watched.any || any;
+    WatchDirArray_set(watch_dirs, wd, watched);
+}
+
+// Watches the directory a path is in for changes to it. A missing directory
+// is waited for in the nearest one that exists.
+void watch_file(String path, char resolved[PATH_MAX]) {
+    char cpath[PATH_MAX], dir[PATH_MAX];
+    fs_cpath(path, cpath);
+    char* slash = strrchr(cpath, '/');
+    char* name = slash == NULL ? cpath : slash + 1;
+    if (slash == NULL) strcpy(dir, ".");
+    else if (slash == cpath) strcpy(dir, "/");
+    else snprintf(dir, sizeof(dir), "%.*s", (int) (slash - cpath), cpath);
+
+    if (realpath(dir, resolved) == NULL) {
+        while (strcmp(dir, ".") != 0 && strcmp(dir, "/") != 0) {
+            char* up = strrchr(dir, '/');
+            if (up == NULL) strcpy(dir, ".");
+            else if (up == dir) dir[1] = 0;
+            else *up = 0;
+            if (access(dir, F_OK) == 0) break;
+        }
+        watch_dir(dir, true);
+        resolved[0] = 0;
+        return;
+    }
+    watch_dir(resolved, false);
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || name[0] == 0) return;
+    size_t size = strlen(resolved);
+    snprintf(resolved + size, PATH_MAX - size, "%s%s", strcmp(resolved, "/") == 0 ? "" : "/", name);
+    StringMap_set(&watch_names, watch_copy(resolved), 1);
+}
+
+int watch_tree_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void) st;
+    if (flag != FTW_D) return FTW_CONTINUE;
+    const char* name = path + ftw->base;
+    if (ftw->level > 0 && (strcmp(name, CACHE_DIR) == 0 || strcmp(name, ".git") == 0)) return FTW_SKIP_SUBTREE;
+    watch_dir(path, true);
+    return FTW_CONTINUE;
+}
+
+String watch_entry_path(String entry) {
+    return sv_from_bytes(entry.bytes + 1 + HASH_HEX_SIZE, entry.size - 1 - HASH_HEX_SIZE);
+}
+
+void watch_add(String entry) {
+    char kind = sv_index(entry, 0);
+    String path = watch_entry_path(entry);
+    char resolved[PATH_MAX], cpath[PATH_MAX];
+    watch_file(path, resolved);
+    if (kind == 'r' && resolved[0] != 0) StringMap_set(&watch_recipes, watch_copy(resolved), 1);
+    if (kind == 'f' || kind == 'r' || resolved[0] == 0) return;
+    if (kind == 'd') watch_dir(resolved, true);
+    else nftw(fs_cpath(path, cpath), watch_tree_entry, 64, FTW_PHYS | FTW_ACTIONRETVAL);
+}
+
+// A path that looks different from when the run got to it, so it changed
+// before it was watched. Sets `recipe_changed` if it's a file of the recipe.
+bool watch_stale(String entry, bool* recipe_changed) {
+    char kind = sv_index(entry, 0), hex[HASH_HEX_SIZE + 1];
+    if (entry.bytes[1] == '-') return false;
+    hash_hex(watch_seen_hash(kind, fs_seen(watch_entry_path(entry))), hex);
+    if (memcmp(hex, entry.bytes + 1, HASH_HEX_SIZE) == 0) return false;
+    if (kind == 'r') *recipe_changed = true;
+    return true;
+}
+
+// Reads what's pending; true if any of it matters. Sets `recipe_changed` if
+// a file of the recipe is among the changed files.
+bool watch_read(bool* recipe_changed) {
+    char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool relevant = false;
+    for (;;) {
+        ssize_t n = read(watch_fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        for (char* at = buffer; at < buffer + n;) {
+            struct inotify_event* event = (struct inotify_event*) at;
+            at += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) { relevant = true; continue; }
+            if (event->wd < 0 || (size_t) event->wd >= watch_dirs->size) continue;
+            WatchDir dir = WatchDirArray_get(watch_dirs, event->wd);
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), SV_FMT"/%s", SvFmt(dir.path), event->len > 0 ? event->name : "");
+            size_t known;
+            bool named = event->len > 0 && StringMap_get(&watch_names, sv(path), &known);
+            if (!named && !dir.any && !(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) continue;
+            if (!relevant) printf("WATCH: `%s` changed\n", path);
+            relevant = true;
+            if (StringMap_get(&watch_recipes, sv(path), &known)) *recipe_changed = true;
+        }
+    }
+    return relevant;
+}
+
+// Blocks until something the last run looked at changes; true if a file of
+// the recipe did
+bool watch_wait(String filename) {
+    watch_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (watch_fd < 0) error("could not watch files: %s", strerror(errno));
+    watch_arena = scratch_new();
+    watch_dirs = WatchDirArray_new(watch_arena);
+    watch_count = 0;
+
+    char recipe[PATH_MAX];
+    watch_file(filename, recipe);
+    if (recipe[0] != 0) StringMap_set(&watch_recipes, watch_copy(recipe), 1);
+    if (watch_paths != NULL) array_foreach(watch_paths, i) watch_add(StringArray_get(watch_paths, i));
+
+    // Only compared once watched, so that no change can fall in between
+    bool recipe_changed = false, stale = false;
+    if (watch_paths != NULL) array_foreach(watch_paths, i) {
+        String entry = StringArray_get(watch_paths, i);
+        if (!watch_stale(entry, &recipe_changed)) continue;
+        if (!stale) printf("WATCH: `"SV_FMT"` changed during the run\n", SvFmt(watch_entry_path(entry)));
+        stale = true;
+    }
+    if (!stale) printf("WATCH: waiting for changes in %zu directories\n", watch_count);
+    fflush(stdout);
+
+    struct pollfd fd = { .fd = watch_fd, .events = POLLIN };
+    while (!stale && !watch_read(&recipe_changed)) {
+        if (poll(&fd, 1, -1) < 0 && errno != EINTR) error("could not watch files: %s", strerror(errno));
+    }
+    // Editors and compilers write in bursts: wait for them to settle down
+    while (poll(&fd, 1, WATCH_DEBOUNCE_MS) > 0) watch_read(&recipe_changed);
+
+    close(watch_fd);
+    StringMap_clear(&watch_names);
+    StringMap_clear(&watch_recipes);
+    scratch_free(watch_arena);
+    return recipe_changed;
+}
@@ -0,0 +1,304 @@
+// `--worker`: serves commands marked `remote` to runs of mako elsewhere, see
+// remote.c. A worker keeps to the directory it's started in: the inputs it's
+// been sent are kept by their hash in `.mako-cache/cas`, and each command
+// runs in a sandbox of its own under `.mako-cache/jobs`, which only has the
+// inputs of the command in it and is removed once the outputs are sent back.
+// Every connection is served by a child process, so jobs run side by side.
+#define WORKER_CAS CACHE_DIR"/cas"
+#define WORKER_JOBS CACHE_DIR"/jobs"
+
+char worker_root[PATH_MAX];
+char* worker_token = NULL; // that jobs have to carry, if any
+
+// Gives up on the job; the run starts it again by itself
+void worker_drop(char* reason) {
+    fprintf(stderr, "WORKER: dropped a job: %s\n", reason);
+    exit(1);
+}
+
+void worker_blob_path(const char* hex, char path[PATH_MAX]) {
+    snprintf(path, PATH_MAX, WORKER_CAS"/%.*s", HASH_HEX_SIZE, hex);
+}
+
+// Creates the directories a path is in
+void worker_make_parents(char* path) {
+    for (char* slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = 0;
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+}
+
+// Receives a blob and keeps it under its hash, once the content is checked
+// to have it
+void worker_receive_blob(int connection) {
+    RemoteFrame type;
+    size_t size;
+    char* blob = remote_receive(connection, &type, &size);
+    if (blob == NULL || type != REMOTE_BLOB || size < HASH_HEX_SIZE) worker_drop("expected an input");
+    char hex[HASH_HEX_SIZE + 1], path[PATH_MAX];
+    hash_hex(hash_bytes(HASH_SEED, blob + HASH_HEX_SIZE, size - HASH_HEX_SIZE), hex);
+    if (memcmp(hex, blob, HASH_HEX_SIZE) != 0) worker_drop("an input doesn't match its hash");
+    worker_blob_path(hex, path);
+    bool changed;
+    if (!fs_write_if_changed(sv(path), sv_from_bytes(blob + HASH_HEX_SIZE, size - HASH_HEX_SIZE), &changed)) worker_drop("could not keep an input");
+    free(blob);
+}
+
+void worker_send_output(int connection, uint32_t index, String path) {
+    char cpath[PATH_MAX];
+    struct stat st;
+    // An output the command didn't make is missing for the run as well
+    if (stat(fs_cpath(path, cpath), &st) < 0 || !S_ISREG(st.st_mode)) return;
+    uint32_t header[2] = { htonl(index), htonl(st.st_mode & 07777) };
+    bool ok = remote_send_header(connection, REMOTE_FILE, sizeof(header) + st.st_size) && remote_send_all(connection, header, sizeof(header));
+    if (!ok || !remote_send_file(connection, cpath, st.st_size)) exit(1);
+}
+
+// The run hung up: the command goes, and so does its sandbox
+void worker_abandon(pid_t pid, char* sandbox) {
+    kill(-pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    if (chdir(worker_root) == 0) fs_remove_tree(sv(sandbox));
+    exit(1);
+}
+
+// Runs a command in the sandbox it's in, streaming what it writes to the
+// run; returns its exit code
+int worker_run(int connection, Command command, char* sandbox) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) worker_drop("could not create a pipe");
+    char* block;
+    char** argv = jobs_argv(command, &block);
+    char program[PATH_MAX];
+    char* path = jobs_resolve(command.program, program);
+    // Its own process group, so everything it started goes if the run does
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDERR_FILENO);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    pid_t pid;
+    int result = jobs_posix_spawn(&pid, path, &actions, &attr, argv);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(pipefd[1]);
+    free(argv);
+    free(block);
+    if (result != 0) {
+        char message[PATH_MAX + 64];
+        int n = snprintf(message, sizeof(message), "could not execute `"SV_FMT"`: %s\n", SvFmt(command.program), strerror(result));
+        remote_send(connection, REMOTE_OUTPUT, sv_from_bytes(message, n < (int) sizeof(message) ? n : (int) sizeof(message) - 1));
+        close(pipefd[0]);
+        return 127;
+    }
+
+    // Runs send nothing while a job runs: anything from them is a hangup
+    struct pollfd fds[2] = { { .fd = pipefd[0], .events = POLLIN }, { .fd = connection, .events = POLLIN } };
+    char buffer[65536];
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents != 0) worker_abandon(pid, sandbox);
+        if (fds[0].revents == 0) continue;
+        ssize_t n = read(pipefd[0], buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (!remote_send(connection, REMOTE_OUTPUT, sv_from_bytes(buffer, n))) worker_abandon(pid, sandbox);
+    }
+    close(pipefd[0]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) worker_drop("could not wait for the command");
+    }
+    return jobs_exitcode(status);
+}
+
+// Compares all of it, so how long it takes says nothing about the token
+bool worker_token_matches(String token) {
+    size_t size = strlen(worker_token);
+    unsigned char differ = token.size != size;
+    for (size_t i = 0; i < token.size; i++) differ |= (unsigned char) sv_index(token, i) ^ (unsigned char) worker_token[i % size];
+    return differ == 0;
+}
+
+// Serves a single connection, in a child of the worker
+void worker_job(int connection) {
+    RemoteFrame type;
+    size_t size;
+    char* request = remote_receive(connection, &type, &size);
+    // A run checking that the worker is there hangs up right away
+    if (request == NULL) exit(0);
+    if (type != REMOTE_JOB) worker_drop("expected a job");
+
+    Arena* scratch = scratch_new();
+    Command command = {
+        .arguments = StringArray_new(scratch),
+        .inputs = StringArray_new(scratch),
+        .outputs = StringArray_new(scratch),
+        .arena = scratch,
+    };
+    StringArray* hashes = StringArray_new(scratch);
+    StringArray* environment = StringArray_new(scratch);
+    String token = {0};
+    for (size_t at = 0; at < size;) {
+        char* entry = request + at;
+        size_t length = strlen(entry);
+        at += length + 1;
+        String value = sv_from_bytes(entry + 1, length > 0 ? length - 1 : 0);
+        if (length == 0) worker_drop("malformed job");
+        else if (entry[0] == 't') token = value;
+        else if (entry[0] == 'p') command.program = value;
+        else if (entry[0] == 'a') StringArray_push(command.arguments, value);
+        else if (entry[0] == 'e') StringArray_push(environment, value);
+        else if (entry[0] == 'o') StringArray_push(command.outputs, value);
+        else if (entry[0] == 'i' && value.size > HASH_HEX_SIZE + 4) {
+            StringArray_push(hashes, sv_from_bytes(value.bytes, HASH_HEX_SIZE + 4));
+            StringArray_push(command.inputs, sv_from_bytes(value.bytes + HASH_HEX_SIZE + 4, value.size - HASH_HEX_SIZE - 4));
+        } else worker_drop("malformed job");
+    }
+    if (worker_token != NULL && !worker_token_matches(token)) worker_drop("a job without the right token");
+    if (command.program.size == 0) worker_drop("a job without a program");
+    StringArray* lists[] = { command.inputs, command.outputs };
+    for (size_t l = 0; l < 2; l++) array_foreach(lists[l], i) {
+        if (!remote_relative(StringArray_get(lists[l], i))) worker_drop("a path outside of the sandbox");
+    }
+    array_foreach(hashes, i) {
+        String hash = StringArray_get(hashes, i);
+        for (size_t c = 0; c < hash.size; c++) {
+            if (!isxdigit((unsigned char) sv_index(hash, c))) worker_drop("malformed hash");
+        }
+    }
+
+    // Inputs it doesn't have yet are asked for, each once
+    StringBuilder* need = StringBuilder_new(scratch);
+    size_t needed = 0;
+    StringMap asked = {0};
+    array_foreach(hashes, i) {
+        String hash = sv_from_bytes(StringArray_get(hashes, i).bytes, HASH_HEX_SIZE);
+        char path[PATH_MAX];
+        size_t known;
+        worker_blob_path(hash.bytes, path);
+        if (access(path, F_OK) == 0 || StringMap_get(&asked, hash, &known)) continue;
+        StringMap_set(&asked, hash, 1);
+        for (size_t c = 0; c < hash.size; c++) StringBuilder_push(need, sv_index(hash, c));
+        needed++;
+    }
+    StringMap_clear(&asked);
+    if (!remote_send(connection, REMOTE_NEED, sv_from_sb(need))) exit(1);
+    for (size_t i = 0; i < needed; i++) worker_receive_blob(connection);
+
+    char sandbox[] = WORKER_JOBS"/XXXXXX";
+    if (mkdtemp(sandbox) == NULL) worker_drop("could not create a sandbox");
+    array_foreach(command.inputs, i) {
+        String hash = StringArray_get(hashes, i);
+        char blob[PATH_MAX], path[PATH_MAX];
+        worker_blob_path(hash.bytes, blob);
+        snprintf(path, sizeof(path), "%s/"SV_FMT, sandbox, SvFmt(StringArray_get(command.inputs, i)));
+        worker_make_parents(path);
+        if (!fs_copy_cfile(blob, path)) worker_drop("an input went missing");
+        char mode[5] = {0};
+        memcpy(mode, hash.bytes + HASH_HEX_SIZE, 4);
+        chmod(path, strtol(mode, NULL, 8) & 07777);
+    }
+    array_foreach(command.outputs, i) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/"SV_FMT, sandbox, SvFmt(StringArray_get(command.outputs, i)));
+        worker_make_parents(path);
+    }
+
+    // The command gets the environment of the run, PATH included
+    if (chdir(sandbox) < 0) worker_drop("could not enter the sandbox");
+    clearenv();
+    array_foreach(environment, i) putenv((char*) StringArray_get(environment, i).bytes);
+    String cmd = command_render(command);
+    printf("WORKER: "SV_FMT"\n", SvFmt(cmd));
+    fflush(stdout);
+    int exitcode = worker_run(connection, command, sandbox);
+
+    if (exitcode == 0) array_foreach(command.outputs, i) worker_send_output(connection, i, StringArray_get(command.outputs, i));
+    int32_t code = htonl(exitcode);
+    remote_send(connection, REMOTE_EXIT, sv_from_bytes((char*) &code, sizeof(code)));
+    if (chdir(worker_root) == 0) fs_remove_tree(sv(sandbox));
+    exit(0);
+}
+
+void worker_serve(String address, size_t slots) {
+    if (slots == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        slots = cpus > 0 ? (size_t) cpus : 1;
+    }
+    char caddress[PATH_MAX];
+    fs_cpath(address, caddress);
+    if (getcwd(worker_root, sizeof(worker_root)) == NULL) error("could not get the current directory: %s", strerror(errno));
+    // Sandboxes of jobs that were cut short are left over
+    mkdir(CACHE_DIR, 0755);
+    fs_remove_tree(sv(WORKER_JOBS));
+    if ((mkdir(WORKER_CAS, 0755) < 0 && errno != EEXIST) || mkdir(WORKER_JOBS, 0755) < 0) error("could not create `"WORKER_JOBS"`: %s", strerror(errno));
+
+    // A socket left behind by a worker that's gone is taken over
+    const char* path = remote_unix_path(caddress);
+    if (path != NULL) {
+        int probe = remote_socket(caddress, false);
+        if (probe >= 0) error("a worker is already listening at `%s`", caddress);
+        unlink(path);
+    }
+    mode_t mask = umask(077);
+    int listener = remote_socket(caddress, true);
+    umask(mask);
+    if (listener < 0) error("could not listen at `%s`: %s", caddress, strerror(errno));
+    // Jobs are commands to run, and TCP says nothing about who sent them,
+    // even over loopback: they have to come with the token
+    worker_token = getenv(REMOTE_TOKEN);
+    if (worker_token != NULL && worker_token[0] == 0) worker_token = NULL;
+    if (path == NULL && worker_token == NULL) error("a worker listening over TCP needs "REMOTE_TOKEN" set to the token runs have to send");
+    signal(SIGPIPE, SIG_IGN);
+    printf("WORKER: listening at `%s` with %zu slots\n", caddress, slots);
+    fflush(stdout);
+
+    size_t running = 0;
+    for (;;) {
+        int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            error("could not accept a connection: %s", strerror(errno));
+        }
+        // Over a Unix socket, only the user who started it is served; over
+        // TCP, anyone who has the token
+        struct ucred cred;
+        socklen_t size = sizeof(cred);
+        if (path != NULL && (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &cred, &size) < 0 || cred.uid != getuid())) {
+            close(connection);
+            continue;
+        }
+        int one = 1;
+        if (path == NULL) setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        while (waitpid(-1, NULL, WNOHANG) > 0) running--;
+        char hello[REMOTE_HELLO_SIZE];
+        uint32_t counts[2] = { htonl(slots), htonl(running) };
+        memcpy(hello, REMOTE_MAGIC, 8);
+        memcpy(hello + 8, counts, sizeof(counts));
+        // A run that's turned away tries elsewhere, or runs the job itself
+        bool busy = running >= slots;
+        if (!remote_send(connection, REMOTE_HELLO, sv_from_bytes(hello, sizeof(hello))) || busy) {
+            close(connection);
+            continue;
+        }
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid < 0) error("could not fork: %s", strerror(errno));
+        if (pid == 0) {
+            close(listener);
+            signal(SIGPIPE, SIG_DFL);
+            worker_job(connection);
+        }
+        running++;
+        close(connection);
+    }
+}